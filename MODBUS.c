@@ -1,7 +1,17 @@
 /*MODBUS.c*/
 #include "MODBUS.h"
+#include "MODBUS_CRC.h"
 #include <stdlib.h>
 #include <string.h>
+#if defined(MBR_HOST_BUILD) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(MBR_HOST_BUILD) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "register encoding kernels expect little-endian CPU"
+#endif
 
 enum
 {
@@ -13,16 +23,70 @@ enum
 
 #define MODBUS_BUFFER_SIZE			0x100
 
+#if defined(MBR_HOST_BUILD)
+#define MBR_MEMORY_BARRIER()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define MBR_MEMORY_BARRIER()		__DMB()
+#endif
+
+#define SEQLOCK_WRITER				0x00000001	//low halfword of the sequence: writers inside MBR_Begin_Update/MBR_End_Update
+#define SEQLOCK_WRITERS_MASK		0x0000FFFF
+#define SEQLOCK_PUBLISH				0x0000FFFF	//one writer less and the high halfword (generation) incremented, by one addition
+
+#ifdef MBR_PROFILING
+#ifndef MBR_PROFILE_TIMESTAMP
+#if defined(MBR_HOST_BUILD)
+#define MBR_PROFILE_TIMESTAMP()		((uint32_t)HOST_Get_Time_ns())	//nanoseconds
+#elif defined(DWT_CTRL_CYCCNTENA_Msk)
+#define MBR_PROFILE_TIMESTAMP()		(DWT->CYCCNT)	//CPU cycles, DWT counter has to be enabled by application
+#else
+#define MBR_PROFILE_TIMESTAMP()		(HAL_GetTick()*(SysTick->LOAD+1) + SysTick->LOAD - SysTick->VAL)	//CPU cycles (Cortex-M0 has no DWT)
+#endif
+#endif
+#define PROFILE_BEGIN(timestamp)		uint32_t timestamp = MBR_PROFILE_TIMESTAMP()
+#define PROFILE_STAGE(stage, timestamp)	Profile_Stage(hmodbus, stage, &timestamp)
+#else
+#define PROFILE_BEGIN(timestamp)
+#define PROFILE_STAGE(stage, timestamp)
+#endif
+
 /*Modbus function codes*/
 enum function_code_e
 {
+	read_coils = 0x01,
+	read_discrete_inputs = 0x02,
 	read_holding_registers = 0x03,
 	read_input_registers = 0x04,
+	write_single_coil = 0x05,
 	write_single_register = 0x06,
+	diagnostics = 0x08,
+	write_multiple_coils = 0x0F,
 	write_multiple_registers = 0x10,
+	mask_write_register = 0x16,
+	read_write_multiple_registers = 0x17,
 	exception = 0x80
 };
 
+/*sub-functions of FC08 (serial line diagnostics)*/
+enum diagnostic_e
+{
+	return_query_data = 0x00,
+	restart_communications = 0x01,
+	return_diagnostic_register = 0x02,
+	force_listen_only_mode = 0x04,
+	clear_counters = 0x0A,
+	return_bus_message_count = 0x0B,
+	return_bus_communication_error_count = 0x0C,
+	return_bus_exception_error_count = 0x0D,
+	return_slave_message_count = 0x0E,
+	return_slave_no_response_count = 0x0F,
+	return_slave_nak_count = 0x10,
+	return_slave_busy_count = 0x11,
+	return_bus_character_overrun_count = 0x12,
+	clear_overrun_counter = 0x14,
+	return_turnaround_percentile = 0x0100		//not standard (MBR_PROFILING): data = percentile, response = 32-bit time in timestamp units
+};
+
 
 typedef struct __modbus_init_t
 {
@@ -31,13 +95,84 @@ typedef struct __modbus_init_t
 	uint8_t				parity;		//number of input registers
 } modbus_init_t;
 
-typedef struct __address_space_t
+typedef struct __address_map_t
+{
+	address_space_t		**spaces;							//sorted by type and start offset, storage or static register map
+	address_space_t		*storage[MBR_MAX_ADDRESS_SPACES];	//spaces added by MBR_Add_Address_Space
+	uint16_t			first[REGISTER_TYPES+1];			//index of the first address space of every type
+	uint8_t				flg_static;							//static register map is used, spaces cannot be added or removed
+#if MBR_RESPONSE_CACHE_SIZE
+	uint32_t			version;							//incremented when spaces are added or removed (indexes change)
+#endif
+} address_map_t;
+
+#if MBR_RESPONSE_CACHE_SIZE
+typedef struct __response_cache_t
+{
+	uint8_t				request[6];				//address, function code, start address and register count
+	uint8_t				len;					//length of the cached response including CRC, 0 = entry is empty
+	uint8_t				spaces;					//number of address spaces covered by the response
+	uint16_t			index;					//first address space covered by the response
+	uint32_t			map_version;
+	uint32_t			version;				//sum of versions of the covered address spaces
+	uint8_t				frame[MODBUS_BUFFER_SIZE];
+} response_cache_t;
+#endif
+
+#if MBR_CLIENT_POLLS
+typedef struct __client_slave_t
+{
+	uint8_t				slave_id;
+	uint8_t				failures;				//consecutive timeouts
+	uint16_t			timeout;				//response timeout [ms]
+	uint32_t			retry_time;				//tick when the backed off slave is polled again
+} client_slave_t;
+
+typedef struct __client_poll_t
+{
+	uint8_t				slave;					//index in the slave table
+	uint8_t				function;
+	uint16_t			start_address;
+	uint16_t			count;
+	uint16_t			*data;					//registers (host order) or bit-packed coils / discrete inputs
+#if MBR_CLIENT_TAGS
+	uint16_t			first_tag;				//tags served by the poll, data is scattered directly into them
+	uint16_t			tag_count;				//0 = poll added by MBR_Add_Poll
+#endif
+} client_poll_t;
+
+#if MBR_CLIENT_TAGS
+typedef struct __client_tag_t
 {
+	uint8_t				slave_id;
 	register_type_t		type;
-	uint16_t			start_offset;
-	uint16_t			size;
-	uint16_t			*address;
-} address_space_t;
+	uint16_t			address;
+	uint16_t			length;					//number of registers or bits
+	uint16_t			*data;
+} client_tag_t;
+#endif
+
+typedef struct __client_t
+{
+	client_poll_t		polls[MBR_CLIENT_POLLS];
+	client_slave_t		slaves[MBR_CLIENT_SLAVES];
+#if MBR_CLIENT_TAGS
+	client_tag_t		tags[MBR_CLIENT_TAGS];	//sorted by slave, type and address when the polls are planned
+	uint16_t			tag_count;
+#endif
+	uint16_t			poll_count;
+	uint8_t				slave_count;
+	uint16_t			next;					//next poll to be selected (round robin)
+	int32_t				selected;				//last selected poll, -1 = none
+	int32_t				current;				//poll waiting for response, -1 = none
+	int32_t				prepared;				//poll whose request is ready in the TX buffer, -1 = none
+	uint8_t				flg_new_cycle;			//the prepared poll starts a new cycle of the poll list
+	uint8_t				tx_len;					//length of the prepared request
+	uint8_t				sent_len;				//length and CRC of the sent request, RS-485 echo is recognized by them
+	uint8_t				sent_crc[2];
+	uint32_t			request_time;			//tick when the request has been sent
+} client_t;
+#endif
 
 typedef struct __modbus_hanle_t
 {
@@ -46,32 +181,169 @@ typedef struct __modbus_hanle_t
 	UART_HandleTypeDef	*huart;					//pointer to UART handle
 	HAL_LockTypeDef		Lock;					//locking object (useful for RTOS)
 	uint32_t			ErrorCode;				//error code
-	address_space_t		*address_spaces[0x10];
-	uint8_t				num_address_spaces;
+	uint8_t				flg_storage;			//storage of the application (MBR_Init_Modbus_Static), not freed by the library
+	address_map_t		*map;					//map of the unit being served
+	address_map_t		maps[1 + MBR_MAX_UNITS];	//index of address spaces of the slave id and of the other units
+#if MBR_MAX_UNITS
+	uint32_t			unit_bitmap[8];			//unit ids served in addition to the slave id
+	uint8_t				unit_map[0x100];		//index in maps of every served unit id
+	uint8_t				unit_count;
+#endif
+	command_handler_t	commands[0x100];		//handler of every function code
+
+	/*receiving*/
+	uint8_t				buf_modbus_rx[MBR_RX_SLOTS][MODBUS_BUFFER_SIZE] __ALIGNED(4);
+	uint8_t				len_modbus_rx[MBR_RX_SLOTS];
+	volatile uint8_t	rx_head;				//slot filled by DMA (ISR only)
+	volatile uint8_t	rx_tail;				//oldest received frame (main loop only)
+	uint8_t				*buf_modbus;			//request being processed (one of the receive slots)
+	uint8_t				len_modbus_frame;		//length of the request being processed
+
+	/*transmitting*/
+	uint8_t				tx_storage[MODBUS_BUFFER_SIZE+4] __ALIGNED(4);
+	uint8_t				*buf_modbus_tx;			//response being built / transmitted, starts at tx_storage[1] to keep register data word aligned
+	volatile uint8_t	flg_tx_busy;
+
+	/*communication state*/
+	uint8_t				flg_modbus_no_comm;
+	volatile uint8_t	flg_wakeup;				//set by the default MBR_Wakeup_Callback, cleared by the default MBR_Wait_Callback
+#if MBR_ISR_FAST_PATH
+	volatile uint8_t	flg_isr_context;		//the request is being processed in the receiver timeout interrupt
+	volatile uint8_t	flg_comm_restored;		//valid frame answered in the interrupt while communication was lost, reported by the main loop
+#endif
+	uint32_t			last_communication_time;
+	uint32_t			comm_timeout;			//communication is lost when no valid frame is received for this time [ms]
+	uint32_t			frame_gap_bits;			//receiver timeout set by MBR_Set_Frame_Gap, 0 = t3.5
+	uint32_t			rto_bits;				//receiver timeout in use [bit times]
+	uint32_t			t15_us;					//inter-character timeout
+	uint32_t			t35_us;					//inter-frame delay
+	uint8_t				flg_listen_only;		//FC08 force listen only mode: requests are not executed, except of restart communications
+	statistics_t		statistics;
+
+#ifdef MBR_RX_STREAMING_CRC
+	uint16_t			rx_crc;					//running CRC of the received part of the frame
+	uint8_t				rx_crc_position;		//number of bytes folded into rx_crc
+	volatile uint8_t	flg_rx_crc_busy;		//folding is in progress (main loop can be interrupted by ISR)
+	volatile uint8_t	flg_rx_crc_reset;		//received bytes have been discarded, folding has to start from the beginning
+	uint8_t				flg_rx_crc_ready[MBR_RX_SLOTS];	//whole frame has been folded in ISR, rx_crc_result holds the verdict
+	uint16_t			rx_crc_result[MBR_RX_SLOTS];
+#endif
+
+#if MBR_CLIENT_POLLS
+	client_t			client;
+#endif
+
+#if MBR_CHANGE_QUEUE_SIZE
+	change_t			changes[MBR_CHANGE_QUEUE_SIZE];	//ranges written by Modbus master, single producer (protocol) / single consumer (application)
+	volatile uint32_t	change_head;			//free running index of the next posted change (protocol side only)
+	volatile uint32_t	change_tail;			//free running index of the next taken change (application side only)
+	volatile uint32_t	changes_lost;			//posts rejected because the queue was full (protocol side only)
+	uint32_t			changes_lost_reported;	//(application side only)
+#endif
+
+#if MBR_RESPONSE_CACHE_SIZE
+	response_cache_t	cache[MBR_RESPONSE_CACHE_SIZE];
+	uint8_t				cache_next;				//entry to be replaced (round robin)
+	response_cache_t	cache_fill;				//address spaces and their version captured while the response is encoded
+#endif
+
+#ifdef MBR_PROFILING
+	profile_t			profile;
+	uint32_t			frame_end_timestamp;	//end of the request being processed
+	uint32_t			rx_timestamp[MBR_RX_SLOTS];
+#endif
 } modbus_handle_t;
 
 
 /*VARIABLES*/
-/*for internal and external usage*/
-uint8_t flg_modbus_no_comm;
 /*for internal usage only*/
-uint32_t last_communication_time;
-uint8_t len_modbus_frame;
-uint8_t buf_modbus[MODBUS_BUFFER_SIZE];
-uint8_t flg_modbus_packet_received;
-
-uint8_t communication_parity;
-uint8_t communication_baudrate;
-uint8_t communication_slave_id;
-
-uint32_t test[2];
+static modbus_handle_t *modbus_handles[MBR_MAX_INSTANCES];	//UART to Modbus handle registry for HAL callbacks
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_HANDLES
+static modbus_handle_t handle_pool[MBR_STATIC_HANDLES];
+static uint8_t handle_used[MBR_STATIC_HANDLES];
+#endif
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_SPACES
+static address_space_t space_pool[MBR_STATIC_SPACES];
+static uint8_t space_used[MBR_STATIC_SPACES];
+#endif
+
+_Static_assert(sizeof(modbus_handle_t) <= sizeof(modbus_handle_storage_t), "MBR_HANDLE_STORAGE_SIZE is smaller than the handle");
 
 /*FUNCTION PROTOTYPES*/
 /*for internal use only*/
 static void Send_Response(modbus_handle_t *hmodbus, uint8_t payload_size);
 static void Check_Frame(modbus_handle_t *hmodbus);
 static void Process_Request(modbus_handle_t *hmodbus);
+static void Read_Input_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Read_Holding_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Write_Single_Register(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Write_Multiple_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Read_Coils(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Read_Discrete_Inputs(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Write_Single_Coil(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Write_Multiple_Coils(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Mask_Write_Register(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Read_Write_Multiple_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Custom_Command(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Diagnostics(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Execute_Command(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+static void Store_Registers(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t register_count, const uint16_t *registers);
+static void Read_Bits(modbus_handle_t *hmodbus, register_type_t type, modbus_request_t *request, modbus_response_t *response);
+static void Write_Bits(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t bit_count, const uint8_t *src);
+static void Copy_Bits(uint8_t *dst, uint32_t dst_bit, const uint8_t *src, uint32_t src_bit, uint32_t count);
+#if MBR_SEQLOCK_RETRIES
+static void Atomic_Add(volatile uint32_t *value, uint32_t addend);
+#endif
+#ifdef MBR_RX_STREAMING_CRC
+static void Fold_Received_Bytes(modbus_handle_t *hmodbus);
+static uint8_t Get_Received_Length(UART_HandleTypeDef *huart);
+#endif
 static void Send_Exeption(modbus_handle_t *hmodbus, uint8_t exeption_code);
+static void Set_Communication_Ok(modbus_handle_t *hmodbus);
+static uint16_t Frame_CRC16(modbus_handle_t *hmodbus, uint8_t *buf, uint16_t len);
+#if MBR_CHANGE_QUEUE_SIZE
+static void Post_Change(modbus_handle_t *hmodbus, address_space_t *address_space, uint16_t start_address, uint16_t count);
+#endif
+static void Configure_Timing(modbus_handle_t *hmodbus);
+static void Restart_UART(modbus_handle_t *hmodbus);
+#if MBR_ISR_FAST_PATH
+static uint8_t Is_Fast_Request(modbus_handle_t *hmodbus, const uint8_t *frame, uint8_t len);
+#endif
+static void Check_Communication(modbus_handle_t *hmodbus);
+static modbus_handle_t *Get_Handle(UART_HandleTypeDef *huart);
+static modbus_handle_t *Setup_Handle(modbus_handle_t *hmodbus, UART_HandleTypeDef *huart);
+static void Free_Address_Space(address_space_t *address_space);
+static uint8_t Add_Space(address_map_t *map, address_space_t *address_space);
+static uint8_t Remove_Space(address_map_t *map, uint16_t *address);
+static uint8_t Set_Static_Map(address_map_t *map, const register_map_t *static_map);
+static address_map_t *Select_Map(modbus_handle_t *hmodbus, uint8_t address);
+static int32_t Find_Address_Space(address_map_t *map, register_type_t type, uint16_t register_address);
+static int32_t Find_Address_Range(address_map_t *map, register_type_t type, uint16_t start_address, uint16_t register_count);
+static uint8_t Encode_Registers(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t register_count, uint8_t *buf);
+static void Swap_Registers(uint8_t *dst, const uint8_t *src, uint32_t count);
+static uint16_t *Decode_Registers_In_Place(uint8_t *buf, uint32_t count);
+#if MBR_CLIENT_POLLS
+static void Client_Process(modbus_handle_t *hmodbus);
+static int32_t Client_Find_Slave(client_t *client, uint8_t slave_id);
+static int32_t Client_Select_Poll(client_t *client, uint32_t now);
+static uint32_t Client_Get_Wait_Time(modbus_handle_t *hmodbus, uint32_t now);
+static void Client_Prepare_Request(modbus_handle_t *hmodbus, int32_t poll);
+static void Client_Check_Response(modbus_handle_t *hmodbus);
+static void Client_Poll_Done(modbus_handle_t *hmodbus, uint8_t status);
+#if MBR_CLIENT_TAGS
+static int Compare_Tags(const void *a, const void *b);
+#endif
+#endif
+#if MBR_RESPONSE_CACHE_SIZE
+static uint8_t Send_Cached_Response(modbus_handle_t *hmodbus);
+static void Store_Cached_Response(modbus_handle_t *hmodbus, uint8_t payload_size);
+#endif
+
+#ifdef MBR_PROFILING
+static void Profile_Stage(modbus_handle_t *hmodbus, profile_stage_t stage, uint32_t *timestamp);
+static void Profile_Function(modbus_handle_t *hmodbus, uint8_t function, uint32_t time);
+static void Profile_Turnaround(modbus_handle_t *hmodbus, uint32_t time);
+#endif
 
 /*PUBLIC FUNCTIONS*/
 /**
@@ -90,507 +362,3254 @@ uint32_t MBR_Get_Version(void)
 
 /**
  * @brief Allocating the memory for Modbus handle and making initial setup.
- * @param huart UART handle.
- * @retval pointer to modbus handle
+ * With MBR_STATIC_ALLOCATION the handle is taken from the pool of MBR_STATIC_HANDLES handles.
+ * @param huart UART handle, every handle has to use its own UART. NULL creates a handle without UART (e.g. for MODBUS_TCP.c).
+ * @retval pointer to modbus handle, NULL when MBR_MAX_INSTANCES handles are already in use or the memory cannot be allocated
  */
 modbus_handle_t *MBR_Init_Modbus(UART_HandleTypeDef *huart)
 {
-	modbus_handle_t *hmodbus;
+	modbus_handle_t *hmodbus = NULL;
 
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_HANDLES
+	for(uint32_t i=0; i<MBR_STATIC_HANDLES; i++)
+	{
+		if(handle_used[i] == 0)
+		{
+			hmodbus = &handle_pool[i];
+			break;
+		}
+	}
+#elif !MBR_STATIC_ALLOCATION
 	hmodbus = (modbus_handle_t*) malloc(sizeof(modbus_handle_t));
-	memset(hmodbus, 0, sizeof(modbus_handle_t));
+#endif
+	if(hmodbus == NULL)
+	{
+		return NULL;
+	}
 
-	hmodbus->huart = huart;
+	if(Setup_Handle(hmodbus, huart) == NULL)
+	{
+#if !MBR_STATIC_ALLOCATION
+		free(hmodbus);
+#endif
+		return NULL;
+	}
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_HANDLES
+	handle_used[hmodbus - handle_pool] = 1;
+#endif
 
-	//init usart and dma
-	HAL_UART_ReceiverTimeout_Config(hmodbus->huart, 34);
-	HAL_UART_EnableReceiverTimeout(hmodbus->huart);
-	HAL_UART_Receive_DMA(hmodbus->huart, buf_modbus, 0x100);
+	return hmodbus;
+}
+
+/**
+ * @brief Making initial setup of Modbus handle placed in storage of the application (static, section of its choice).
+ * @param huart UART handle, every handle has to use its own UART. NULL creates a handle without UART (e.g. for MODBUS_TCP.c).
+ * @param storage Storage of the handle, it has to exist until MBR_Destroy_Modbus.
+ * @retval pointer to modbus handle (inside storage), NULL when MBR_MAX_INSTANCES handles are already in use
+ */
+modbus_handle_t *MBR_Init_Modbus_Static(UART_HandleTypeDef *huart, modbus_handle_storage_t *storage)
+{
+	modbus_handle_t *hmodbus = Setup_Handle((modbus_handle_t*)storage, huart);
+
+	if(hmodbus != NULL)
+	{
+		hmodbus->flg_storage = 1;
+	}
 
 	return hmodbus;
 }
 
 /**
  * @brief Allocating the memory for Address Space handle and making setup of the address space.
+ * With MBR_STATIC_ALLOCATION the space is taken from the pool of MBR_STATIC_SPACES spaces.
  * @param type Type of address space
  * @param start_offset Address of the first element in address space
- * @param size Number of elements in address space
- * @param address Pointer to array with actual values
- * @retval pointer to modbus handle
+ * @param size Number of elements in address space (registers or bits)
+ * @param address Pointer to array with actual values, (size+15)/16 words for coils and discrete inputs
+ * @retval pointer to address space, NULL when the memory cannot be allocated
  */
 address_space_t *MBR_Init_Address_Space(register_type_t type, uint16_t start_offset, uint16_t size, uint16_t *address)
 {
-	address_space_t *address_space;
+	address_space_t *address_space = NULL;
 
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_SPACES
+	for(uint32_t i=0; i<MBR_STATIC_SPACES; i++)
+	{
+		if(space_used[i] == 0)
+		{
+			space_used[i] = 1;
+			address_space = &space_pool[i];
+			break;
+		}
+	}
+#elif !MBR_STATIC_ALLOCATION
 	address_space = (address_space_t*) malloc(sizeof(address_space_t));
+#endif
+	if(address_space == NULL)
+	{
+		return NULL;
+	}
 
-	address_space->type = type;
-	address_space->start_offset = start_offset;
-	address_space->size = size;
-	address_space->address = address;
+	MBR_Init_Address_Space_Static(address_space, type, start_offset, size, address);
+	address_space->flg_storage = 0;	//owned by the library, freed with the handle
 
 	return address_space;
 }
 
-void MBR_Destroy_Modbus(modbus_handle_t *hmodbus)
+/**
+ * @brief Setup of the address space placed in storage of the application, the library does not free it.
+ * @param storage Storage of the address space, it has to exist as long as the space is added to a handle.
+ * @param type Type of address space
+ * @param start_offset Address of the first element in address space
+ * @param size Number of elements in address space (registers or bits)
+ * @param address Pointer to array with actual values, (size+15)/16 words for coils and discrete inputs
+ * @retval pointer to address space (storage)
+ */
+address_space_t *MBR_Init_Address_Space_Static(address_space_t *storage, register_type_t type, uint16_t start_offset, uint16_t size, uint16_t *address)
 {
-	//TODO free all address spaces?
-	free(hmodbus);
-}
+	memset(storage, 0, sizeof(address_space_t));
+	storage->flg_storage = 1;
 
-void MBR_Add_Address_Space(modbus_handle_t *hmodbus, address_space_t *address_space)
-{
-	//if(hmodbus->num_address_spaces < 8)
-	hmodbus->address_spaces[hmodbus->num_address_spaces] = address_space;
-	hmodbus->num_address_spaces++;
+	storage->type = type;
+	storage->start_offset = start_offset;
+	storage->size = size;
+	storage->address = address;
+
+	return storage;
 }
 
-void MBR_Remove_Address_Space(modbus_handle_t *hmodbus, uint16_t *address)
+void MBR_Destroy_Modbus(modbus_handle_t *hmodbus)
 {
-	uint8_t address_deleted;
+	address_map_t *map;
 
-	for(uint32_t i=0; i<hmodbus->num_address_spaces; i++)
+	for(uint32_t i=0; i<MBR_MAX_INSTANCES; i++)
 	{
-		if(hmodbus->address_spaces[i]->address == address)	//TODO address has not been found
+		if(modbus_handles[i] == hmodbus)
 		{
-			free(hmodbus->address_spaces[i]);
-			hmodbus->num_address_spaces--;
-			address_deleted = i;
-			break;
+			modbus_handles[i] = NULL;
 		}
 	}
 
-	for(uint32_t i=address_deleted; i<hmodbus->num_address_spaces; i++)
-	{
-		hmodbus->address_spaces[i] = hmodbus->address_spaces[i+1];
-	}
-}
-
-/**
- * @brief Check for the new received Modbus request.
- * @param none
- * @retval none
- */
-void MBR_Check_For_Request(modbus_handle_t *hmodbus)
-{
-	uint32_t modbus_no_comm, current_tick;
-
-	if(flg_modbus_packet_received)
-	{
-		flg_modbus_packet_received = 0;
-
-		Check_Frame(hmodbus);
-	}
-	else
+	for(uint32_t unit=0; unit<=MBR_MAX_UNITS; unit++)
 	{
-		if(flg_modbus_no_comm == 0)
+		map = &hmodbus->maps[unit];
+		if(map->flg_static == 0)	//spaces of the static register map are not owned by the handle
 		{
-			current_tick = HAL_GetTick();
-
-			if(current_tick > last_communication_time)	//TODO handle false condition
-			{
-				modbus_no_comm = current_tick - last_communication_time;
-			}
-
-			if(modbus_no_comm > 10*1000)	//TODO make it configurable
+			for(uint32_t i=0; i<map->first[REGISTER_TYPES]; i++)
 			{
-				flg_modbus_no_comm = 1;
+				Free_Address_Space(map->spaces[i]);
 			}
 		}
 	}
+
+	if(hmodbus->flg_storage)
+	{
+		return;
+	}
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_HANDLES
+	handle_used[hmodbus - handle_pool] = 0;
+#elif !MBR_STATIC_ALLOCATION
+	free(hmodbus);
+#endif
 }
 
-/*CALLBACKS*/
 /**
- * @brief This function is called every time when Modbus master tries to update holding register value.
- * @param none
- * @retval 0 = ok (new value is allowed), 1 = not ok (new value is not allowed)
+ * @brief Using the register map defined at compile time (MBR_DEFINE_REGISTER_MAP) instead of address spaces
+ * added one by one. The map is only checked, its index is used as it is. Spaces cannot be added or removed afterwards.
+ * @param hmodbus Modbus handle.
+ * @param map Static register map, it has to exist as long as the handle.
+ * @retval 0 = ok, 1 = not ok (address spaces have been added, the map is not sorted or spaces overlap)
  */
-__weak uint8_t MBR_Check_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data)
+uint8_t MBR_Set_Register_Map(modbus_handle_t *hmodbus, const register_map_t *map)
 {
-	UNUSED(register_address);
-	UNUSED(register_data);
-	return 0;
+	return Set_Static_Map(&hmodbus->maps[0], map);
 }
 
 /**
- * @brief This function is called when holding register value has been updated.
- * @param none
- * @retval none
+ * @brief Registering the handler of a function code, built-in function codes can be overridden as well.
+ * @param hmodbus Modbus handle.
+ * @param function_code Function code 0x01..0x7F.
+ * @param handler Handler, NULL restores the default one (MBR_Custom_Command_Callback).
+ * @retval 0 = ok, 1 = not ok (invalid function code)
  */
-__weak void MBR_Register_Update_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data)
-{
-	UNUSED(register_address);
-	UNUSED(register_data);
-}
-
-__weak void MBR_Register_Read_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data)
+uint8_t MBR_Add_Custom_Command(modbus_handle_t *hmodbus, uint8_t function_code, command_handler_t handler)
 {
-	UNUSED(hmodbus);
-	UNUSED(register_address);
-	UNUSED(register_data);
-}
+	if(function_code == 0x00 || function_code >= exception)
+	{
+		return 1;
+	}
 
-//__weak void MBR_Register_Init_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data)
-//{
-//	UNUSED(register_address);
-//	UNUSED(register_data);
-//}
+	hmodbus->commands[function_code] = (handler != NULL) ? handler : Custom_Command;
 
-__weak void MBR_Start_Sending_Callback(UART_HandleTypeDef *huart)
-{
-	UNUSED(huart);
+	return 0;
 }
 
-__weak void MBR_End_Sending_Callback(UART_HandleTypeDef *huart)
+/**
+ * @brief Adding the address space to the address map of Modbus handle (the map is kept sorted).
+ * @param hmodbus Modbus handle.
+ * @param address_space Address space created by MBR_Init_Address_Space.
+ * @retval 0 = ok, 1 = not ok (map is full, wrong type or the space overlaps with already added one)
+ */
+uint8_t MBR_Add_Address_Space(modbus_handle_t *hmodbus, address_space_t *address_space)
 {
-	UNUSED(huart);
+	return Add_Space(&hmodbus->maps[0], address_space);
 }
 
-//TODO replace with MBR_Add_Custom_Command()
-__weak void MBR_Custom_Command_Callback(uint8_t *buf_modbus, response_t *response)
+/**
+ * @brief Serving one more unit id on the port with its own register map (e.g. sub-devices behind a gateway).
+ * Requests are dispatched to the map by the unit id in O(1), broadcasts use the map of the slave id of the handle.
+ * @param hmodbus Modbus handle.
+ * @param unit_id 1..247, different from the slave id of the handle (set the slave id first, requests for the slave id
+ * always use the map of the handle).
+ * @param map Static register map of the unit, NULL = empty map filled by MBR_Add_Unit_Address_Space.
+ * @retval 0 = ok, 1 = not ok (MBR_MAX_UNITS units are served already, invalid unit id or invalid map)
+ */
+uint8_t MBR_Add_Unit(modbus_handle_t *hmodbus, uint8_t unit_id, const register_map_t *map)
 {
-	UNUSED(buf_modbus);
+#if MBR_MAX_UNITS
+	address_map_t *unit_map;
 
-	response->flg_response = 1;
-	response->exception = illegal_function;
-}
+	if(unit_id == 0 || unit_id > 247 || unit_id == hmodbus->init.slave_id || hmodbus->unit_count >= MBR_MAX_UNITS || (hmodbus->unit_bitmap[unit_id>>5] & (1u << (unit_id & 0x1F))))
+	{
+		return 1;
+	}
 
-/*HAL CALLBACKS*/
-void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
-{
-	test[0]++;
-	if(huart->ErrorCode == HAL_UART_ERROR_RTO)
+	unit_map = &hmodbus->maps[hmodbus->unit_count + 1];
+	if(map != NULL && Set_Static_Map(unit_map, map))
 	{
-		len_modbus_frame = MODBUS_BUFFER_SIZE - huart->hdmarx->Instance->CNDTR;
-		if(len_modbus_frame > 7)	//minimum Modbus frame length (for requests)
-		{
-			flg_modbus_packet_received = 1;
-		}
+		return 1;
 	}
 
-	huart->ErrorCode = HAL_UART_ERROR_NONE;
+	hmodbus->unit_count++;
+	hmodbus->unit_map[unit_id] = hmodbus->unit_count;
+	hmodbus->unit_bitmap[unit_id>>5] |= 1u << (unit_id & 0x1F);
 
-	HAL_UART_Receive_DMA(huart, buf_modbus, MODBUS_BUFFER_SIZE);
+	return 0;
+#else
+	UNUSED(hmodbus);
+	UNUSED(unit_id);
+	UNUSED(map);
+	return 1;
+#endif
 }
 
-void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+/**
+ * @brief Adding the address space to the register map of the unit added by MBR_Add_Unit.
+ * @retval 0 = ok, 1 = not ok (unknown unit, map is full or static, the space overlaps with already added one)
+ */
+uint8_t MBR_Add_Unit_Address_Space(modbus_handle_t *hmodbus, uint8_t unit_id, address_space_t *address_space)
 {
-	test[1]++;
-	MBR_End_Sending_Callback(huart);
-	HAL_UART_Receive_DMA(huart, buf_modbus, MODBUS_BUFFER_SIZE);
-}
-
+#if MBR_MAX_UNITS
+	if((hmodbus->unit_bitmap[unit_id>>5] & (1u << (unit_id & 0x1F))) == 0)
+	{
+		return 1;
+	}
 
-/*PRIVATE FUNCTIONS*/
-uint16_t Calculate_CRC16(uint8_t *buf, uint16_t len)	//TODO compute table at Modbus_Init
-{
-	static const uint16_t crc_table[] = {
-			0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
-			0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
-			0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
-			0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
-			0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
-			0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
-			0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
-			0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
-			0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
-			0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
-			0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
-			0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
-			0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
-			0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
-			0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
-			0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
-			0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
-			0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
-			0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
-			0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
-			0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
-			0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
-			0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
-			0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
-			0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
-			0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
-			0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
-			0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
-			0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
-			0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
-			0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
-			0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040};
-
-	uint8_t xor;
-	uint16_t crc = 0xFFFF;
-
-	while(len--)
-	{
-		xor = *buf++ ^ crc;
-		crc >>= 8;
-		crc ^= crc_table[xor];
-	}
-
-	return crc;
+	return Add_Space(&hmodbus->maps[hmodbus->unit_map[unit_id]], address_space);
+#else
+	UNUSED(hmodbus);
+	UNUSED(unit_id);
+	UNUSED(address_space);
+	return 1;
+#endif
 }
 
-
-static void Check_Frame(modbus_handle_t *hmodbus)
+/**
+ * @brief Removing the address space from the address map and freeing its memory.
+ * The maps of all units are searched (the array identifies the space).
+ * @param hmodbus Modbus handle.
+ * @param address Pointer to array with actual values, which has been used for MBR_Init_Address_Space.
+ * @retval none
+ */
+void MBR_Remove_Address_Space(modbus_handle_t *hmodbus, uint16_t *address)
 {
-	uint16_t crc_int;
-
-	crc_int = (buf_modbus[len_modbus_frame-1]<<8) + buf_modbus[len_modbus_frame-2];	//get CRC16 bytes from the received packet
-
-	if(crc_int == Calculate_CRC16(buf_modbus,(len_modbus_frame-2)))	// Check does the CRC match
+	for(uint32_t unit=0; unit<=MBR_MAX_UNITS; unit++)
 	{
-		if ((buf_modbus[0] == hmodbus->init.slave_id) || buf_modbus[0] == 0x00)	//Check if the device address is correct
+		if(Remove_Space(&hmodbus->maps[unit], address) == 0)
 		{
-			Process_Request(hmodbus);	// Return flag OK;
-			flg_modbus_no_comm = 0;
-			last_communication_time = HAL_GetTick();
+			return;
 		}
 	}
 }
 
-static void Read_Input_Registers(modbus_handle_t *hmodbus, struct response_s *response_s)
+/**
+ * @brief Removing the address space from the register map of the unit added by MBR_Add_Unit and freeing its memory.
+ * @retval 0 = ok, 1 = not ok (unknown unit, static map or the space is not in the map)
+ */
+uint8_t MBR_Remove_Unit_Address_Space(modbus_handle_t *hmodbus, uint8_t unit_id, uint16_t *address)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t register_count, data;
-	address_space_t *address_space;
-
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
-	buf_modbus[2] = register_count*2;	// byte count
-
-	response_s->exception = 0x02;
-	for(uint32_t i=0; i<hmodbus->num_address_spaces; i++)
+#if MBR_MAX_UNITS
+	if((hmodbus->unit_bitmap[unit_id>>5] & (1u << (unit_id & 0x1F))) == 0)
 	{
-		if(hmodbus->address_spaces[i]->type == input_registers)
-		{
-			if(start_address >= hmodbus->address_spaces[i]->start_offset && start_address + register_count <= hmodbus->address_spaces[i]->start_offset + hmodbus->address_spaces[i]->size)
-			{
-				response_s->exception = 0x00;
-				address_space = hmodbus->address_spaces[i];
-				break;
-			}
-		}
-	}
-
-	if(response_s->exception == 0)
-	{
-		for(uint32_t i = 0; i < register_count; i++)
-		{
-			MBR_Register_Read_Callback(hmodbus, start_address+i, &data);
-			data = address_space->address[start_address-(address_space->start_offset)+i];
-			buf_modbus[3+(i)*2] = data>>8;
-			buf_modbus[4+(i)*2] = data;
-		}
+		return 1;
 	}
 
-	response_s->payload_size = 3 + buf_modbus[2];
+	return Remove_Space(&hmodbus->maps[hmodbus->unit_map[unit_id]], address);
+#else
+	UNUSED(hmodbus);
+	UNUSED(unit_id);
+	UNUSED(address);
+	return 1;
+#endif
 }
 
-static void Read_Holding_Registers(modbus_handle_t *hmodbus, struct response_s *response_s)
+/**
+ * @brief Check for the new received Modbus request.
+ * @param none
+ * @retval none
+ */
+void MBR_Check_For_Request(modbus_handle_t *hmodbus)
 {
-	uint16_t start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t register_count, data;
-	address_space_t *address_space;
-
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
-	buf_modbus[2] = register_count*2;	// byte count
-
-	response_s->exception = 0x02;
-	for(uint32_t i=0; i<hmodbus->num_address_spaces; i++)
+#if MBR_CLIENT_POLLS
+	if(hmodbus->mode == master_mode)
 	{
-		if(hmodbus->address_spaces[i]->type == holding_registers)
-		{
-			if(start_address >= hmodbus->address_spaces[i]->start_offset && start_address + register_count <= hmodbus->address_spaces[i]->start_offset + hmodbus->address_spaces[i]->size)
-			{
-				response_s->exception = 0x00;
-				address_space = hmodbus->address_spaces[i];
-				break;
-			}
-		}
+		Client_Process(hmodbus);
+		Check_Communication(hmodbus);
+		return;
 	}
+#endif
 
-	if(response_s->exception == 0)
+	if(hmodbus->rx_tail != hmodbus->rx_head)
 	{
-
-		for(uint32_t i = 0; i < register_count; i++)
+		if(hmodbus->flg_tx_busy == 0)	//the frame stays in its slot until the previous response has been sent
 		{
-			MBR_Register_Read_Callback(hmodbus, start_address+i, &data);
-			data = address_space->address[start_address-(address_space->start_offset)+i];
-			buf_modbus[3+(i)*2] = data>>8;
-			buf_modbus[4+(i)*2] = data;
-		}
-	}
+			hmodbus->buf_modbus = hmodbus->buf_modbus_rx[hmodbus->rx_tail];
+			hmodbus->len_modbus_frame = hmodbus->len_modbus_rx[hmodbus->rx_tail];
+#ifdef MBR_PROFILING
+			hmodbus->frame_end_timestamp = hmodbus->rx_timestamp[hmodbus->rx_tail];
+#endif
 
-	response_s->payload_size = 3 + buf_modbus[2];
+			Check_Frame(hmodbus);
 
-	if(start_address == 0 && register_count == 4)	//response to broadcast
+			hmodbus->rx_tail = (hmodbus->rx_tail + 1) % MBR_RX_SLOTS;
+		}
+	}
+	else
 	{
-		response_s->flg_response = 1;
+#ifdef MBR_RX_STREAMING_CRC
+		MBR_Receive_Progress(hmodbus);	//use the idle time of the main loop to fold the bytes being received
+#endif
+		Check_Communication(hmodbus);
 	}
 }
 
-static void Write_Multiple_Registers(modbus_handle_t *hmodbus, struct response_s *response_s)
+/**
+ * @brief Time until MBR_Check_For_Request has something to do without a new event (received frame or end of transmission),
+ * the application (RTOS task, low power loop) can sleep for this time. Events are signalled by MBR_Wakeup_Callback.
+ * @param hmodbus Modbus handle.
+ * @retval time [ms], 0 = call MBR_Check_For_Request now, MBR_WAIT_FOREVER = only events are expected
+ */
+uint32_t MBR_Get_Wait_Time(modbus_handle_t *hmodbus)
 {
-	uint16_t start_address, register_count;
-	uint16_t reg_data;
-	uint16_t uint_hold_reg_temporary[125/*hold_reg_count*/] = {0};
-	address_space_t *address_space;
-
-	start_address  = (buf_modbus[2]<<8)+ buf_modbus[3];
-	register_count =  (buf_modbus[4]<<8)+ buf_modbus[5];
+	uint32_t now, elapsed, wait = MBR_WAIT_FOREVER;
 
-	response_s->exception = 0x02;
-	for(uint32_t i=0; i<hmodbus->num_address_spaces; i++)
+	if(hmodbus->rx_tail != hmodbus->rx_head && hmodbus->flg_tx_busy == 0)
 	{
-		if(hmodbus->address_spaces[i]->type == holding_registers)
-		{
-			if(start_address >= hmodbus->address_spaces[i]->start_offset && start_address + register_count <= hmodbus->address_spaces[i]->start_offset + hmodbus->address_spaces[i]->size)
-			{
-				response_s->exception = 0x00;
-				address_space = hmodbus->address_spaces[i];
-				break;
-			}
-		}
+		return 0;
 	}
-
-	if(response_s->exception == 0)
+#if MBR_ISR_FAST_PATH
+	if(hmodbus->flg_comm_restored)	//restored callback deferred from the interrupt
 	{
-		for(uint32_t i = 0; i < register_count; i++)
-		{
-			reg_data = (buf_modbus[7+(i)*2]<<8) + buf_modbus[8+(i)*2];
+		return 0;
+	}
+#endif
 
-			if(MBR_Check_Restrictions_Callback(hmodbus, start_address+i, reg_data))
-			{
-				response_s->exception = 0x03;
-				break;
-			}
-			else
-			{
-				uint_hold_reg_temporary[i] = reg_data;
-			}
+	now = HAL_GetTick();
 
-		}
+	if(hmodbus->flg_modbus_no_comm == 0 && hmodbus->comm_timeout != 0)	//deadline of the communication lost timer
+	{
+		elapsed = now - hmodbus->last_communication_time;
+		wait = (elapsed < hmodbus->comm_timeout) ? hmodbus->comm_timeout - elapsed : 0;
 	}
 
-	if(response_s->exception == 0)
+#if MBR_CLIENT_POLLS
+	if(hmodbus->mode == master_mode)
 	{
-		for(uint32_t i = 0; i < register_count; i++)//write the new data;	//TODO move it under flag no_exception
+		elapsed = Client_Get_Wait_Time(hmodbus, now);
+		if(elapsed < wait)
 		{
-			address_space->address[start_address-(address_space->start_offset)+i] = uint_hold_reg_temporary[i];
-			MBR_Register_Update_Callback(hmodbus, start_address+i, uint_hold_reg_temporary[i]);
+			wait = elapsed;
 		}
-
-		response_s->payload_size = 6;
 	}
+#endif
+
+	return wait;
 }
 
-static void Write_Single_Register(modbus_handle_t *hmodbus, struct response_s *response_s)
+/**
+ * @brief Event driven processing: sleeps by MBR_Wait_Callback until the next event or deadline, then processes it.
+ * Replaces the busy loop calling MBR_Check_For_Request, call it in the main loop or in a task.
+ * @param hmodbus Modbus handle.
+ * @param timeout_ms Maximum time to sleep, MBR_WAIT_FOREVER = no limit.
+ * @retval none
+ */
+void MBR_Wait_For_Request(modbus_handle_t *hmodbus, uint32_t timeout_ms)
 {
-	uint16_t start_address = (buf_modbus[2]<<8)+ buf_modbus[3];
-	uint16_t reg_data;
-	address_space_t *address_space;
+	uint32_t wait = MBR_Get_Wait_Time(hmodbus);
 
-	response_s->exception = 0x02;
-	for(uint32_t i=0; i<hmodbus->num_address_spaces; i++)
+	if(wait > timeout_ms)
 	{
-		if(hmodbus->address_spaces[i]->type == holding_registers)
-		{
-			if(start_address >= hmodbus->address_spaces[i]->start_offset && start_address < hmodbus->address_spaces[i]->start_offset + hmodbus->address_spaces[i]->size)
-			{
-				response_s->exception = 0x00;
-				address_space = hmodbus->address_spaces[i];
-				break;
-			}
-		}
+		wait = timeout_ms;
 	}
 
-	if(response_s->exception == 0)
+	if(wait != 0)
 	{
-		reg_data = (buf_modbus[4]<<8)+ buf_modbus[5];
-
-		if(MBR_Check_Restrictions_Callback(hmodbus, start_address, reg_data))
-		{
-			response_s->exception = 0x03;
-		}
-		else
-		{
-			address_space->address[start_address-(address_space->start_offset)] = reg_data;
-			MBR_Register_Update_Callback(hmodbus, start_address, reg_data);
-		}
+		MBR_Wait_Callback(hmodbus, wait);
+	}
 
-		buf_modbus[4] = reg_data>>8;	//Register value 1st byte
-		buf_modbus[5] = reg_data;	//Register value 2nd byte
+	MBR_Check_For_Request(hmodbus);
+}
 
-		response_s->payload_size = 6;
-	}
+/**
+ * @brief Setting the timeout of the communication lost detection.
+ * @param hmodbus Modbus handle.
+ * @param timeout_ms Time without valid frame [ms], 0 = detection is disabled.
+ * @retval none
+ */
+void MBR_Set_Communication_Timeout(modbus_handle_t *hmodbus, uint32_t timeout_ms)
+{
+	hmodbus->comm_timeout = timeout_ms;
 }
 
-static void Process_Request(modbus_handle_t *hmodbus)
+/**
+ * @brief Processing the request received by other transport than UART (e.g. MODBUS_TCP.c).
+ * Handlers registered in the handle are used, the caller has to serialize calls for the same handle.
+ * @param hmodbus Modbus handle.
+ * @param request Unit address, function code and data (no CRC), has to be halfword aligned (FC16 is decoded in place).
+ * @param request_length Number of bytes of the request.
+ * @param response Buffer for the response (unit address, function code and data, no CRC), MODBUS_BUFFER_SIZE bytes.
+ * @retval length of the response, 0 = no response
+ */
+uint16_t MBR_Process_Frame(modbus_handle_t *hmodbus, uint8_t *request, uint16_t request_length, uint8_t *response)
 {
-	struct response_s response_s = {0, 0, 0};
+	modbus_request_t request_view;
+	modbus_response_t response_view;
 
-	if(buf_modbus[0])
+	if(request_length < 2 || request_length > MODBUS_BUFFER_SIZE - 2)
 	{
-		response_s.flg_response = 1;
+		return 0;
 	}
 
-	switch(buf_modbus[1])
-	{
-	case read_input_registers:
-		Read_Input_Registers(hmodbus, &response_s);
-		break;
+	request_view.address = request[0];
+	request_view.function = request[1];
+	request_view.data = &request[2];
+	request_view.length = request_length - 2;
 
-	case read_holding_registers:
-		Read_Holding_Registers(hmodbus, &response_s);
-		break;
+	response_view.data = &response[2];
+	response_view.max_length = MODBUS_BUFFER_SIZE - 4;
+	response_view.length = 0;
+	response_view.exception = 0;
+	response_view.flg_response = 1;
 
-	case write_single_register:
-		Write_Single_Register(hmodbus, &response_s);
-		break;
+	response[0] = request[0];
+	response[1] = request[1];
 
-	case write_multiple_registers:
-		Write_Multiple_Registers(hmodbus, &response_s);
-		break;
+	hmodbus->statistics.bus_messages++;
+	if(request[0] == 0x00)
+	{
+		hmodbus->statistics.broadcasts++;
+	}
+	hmodbus->map = Select_Map(hmodbus, request[0]);
+	if(hmodbus->map == NULL)	//unit id filtering is up to the transport
+	{
+		hmodbus->map = &hmodbus->maps[0];
+	}
+	Execute_Command(hmodbus, &request_view, &response_view);
 
-	default:	//if the command is not supported by default
-		MBR_Custom_Command_Callback(buf_modbus, &response_s);
+	if(response_view.flg_response == 0)
+	{
+		return 0;
 	}
 
-	if(response_s.flg_response)
+	if(response_view.exception)
 	{
-		if(response_s.exception)
-		{
-			Send_Exeption(hmodbus, response_s.exception);
-		}
-		else
-		{
-			Send_Response(hmodbus, response_s.payload_size);	// Send packet response
-		}
+		response[1] |= exception;
+		response[2] = response_view.exception;
+		return 3;
 	}
+
+	return 2 + response_view.length;
 }
 
+/**
+ * @brief Getting the state of communication (no valid frame during the communication timeout, 10 seconds by default).
+ * @param hmodbus Modbus handle.
+ * @retval 0 = communication is ok, 1 = communication is lost
+ */
+uint8_t MBR_Is_Communication_Lost(modbus_handle_t *hmodbus)
+{
+	return hmodbus->flg_modbus_no_comm;
+}
+
+/**
+ * @brief Getting the copy of communication counters (the same counters are returned by FC08 sub-functions, truncated to 16 bits).
+ * @param hmodbus Modbus handle.
+ * @param statistics Pointer to the structure to be filled.
+ * @retval none
+ */
+void MBR_Get_Statistics(modbus_handle_t *hmodbus, statistics_t *statistics)
+{
+	*statistics = hmodbus->statistics;
+}
+
+void MBR_Reset_Statistics(modbus_handle_t *hmodbus)
+{
+	memset(&hmodbus->statistics, 0, sizeof(statistics_t));
+}
+
+/**
+ * @brief Invalidating cached responses which contain the registers. Has to be called after the application
+ * has written to an address space directly (writes from Modbus master invalidate the cache automatically).
+ * @param hmodbus Modbus handle.
+ * @param type Type of registers.
+ * @param start_address Address of the first written register.
+ * @param register_count Number of written registers.
+ * @retval none
+ */
+void MBR_Mark_Dirty(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t register_count)
+{
+#if MBR_RESPONSE_CACHE_SIZE
+	address_map_t *map;
+	uint32_t end = (uint32_t)start_address + register_count;
+
+	if(type >= REGISTER_TYPES)
+	{
+		return;
+	}
+
+	for(uint32_t unit=0; unit<=MBR_MAX_UNITS; unit++)	//the unit is not known, spaces of all units at these addresses are invalidated
+	{
+		map = &hmodbus->maps[unit];
+		for(uint32_t i=map->first[type]; i<map->first[type+1] && map->spaces[i]->start_offset < end; i++)
+		{
+			if((uint32_t)map->spaces[i]->start_offset + map->spaces[i]->size > start_address)
+			{
+				map->spaces[i]->version++;
+			}
+		}
+	}
+#else
+	UNUSED(hmodbus);
+	UNUSED(type);
+	UNUSED(start_address);
+	UNUSED(register_count);
+#endif
+}
+
+/**
+ * @brief Starting the update of the address space (seqlock writer side). Allowed writers are the application
+ * (main loop, interrupts, RTOS tasks) and the request processing (Store_Registers, Write_Bits), any number of them
+ * can overlap: the sequence is changed by atomic additions, so readers retry until the last writer has finished.
+ * Writers of the same registers are not serialized against each other, only readers are protected.
+ * Requests reading the space meanwhile copy it again or get slave_device_busy, the writer never waits.
+ * @param address_space Address space created by MBR_Init_Address_Space.
+ * @retval none
+ */
+void MBR_Begin_Update(address_space_t *address_space)
+{
+#if MBR_SEQLOCK_RETRIES
+	Atomic_Add(&address_space->sequence, SEQLOCK_WRITER);
+	MBR_MEMORY_BARRIER();
+#else
+	UNUSED(address_space);
+#endif
+}
+
+/**
+ * @brief Publishing the update of the address space, cached responses are invalidated as well.
+ * @param address_space Address space created by MBR_Init_Address_Space.
+ * @retval none
+ */
+void MBR_End_Update(address_space_t *address_space)
+{
+#if MBR_SEQLOCK_RETRIES
+	MBR_MEMORY_BARRIER();
+	Atomic_Add(&address_space->sequence, SEQLOCK_PUBLISH);
+#endif
+#if MBR_RESPONSE_CACHE_SIZE
+	address_space->version++;
+#endif
+	UNUSED(address_space);
+}
+
+/**
+ * @brief Seqlock reader side, e.g. for application reading registers written by Modbus master:
+ *	do { sequence = MBR_Read_Begin(space); copy the values; } while(MBR_Read_Retry(space, sequence));
+ * @param address_space Address space created by MBR_Init_Address_Space.
+ * @retval sequence to be passed to MBR_Read_Retry
+ */
+uint32_t MBR_Read_Begin(address_space_t *address_space)
+{
+#if MBR_SEQLOCK_RETRIES
+	uint32_t sequence = address_space->sequence;
+
+	MBR_MEMORY_BARRIER();
+	return sequence;
+#else
+	UNUSED(address_space);
+	return 0;
+#endif
+}
+
+/**
+ * @retval 0 = the values copied since MBR_Read_Begin are consistent, 1 = they have to be copied again
+ */
+uint8_t MBR_Read_Retry(address_space_t *address_space, uint32_t sequence)
+{
+#if MBR_SEQLOCK_RETRIES
+	MBR_MEMORY_BARRIER();
+	return (sequence & SEQLOCK_WRITERS_MASK) || address_space->sequence != sequence;
+#else
+	UNUSED(address_space);
+	UNUSED(sequence);
+	return 0;
+#endif
+}
+
+/**
+ * @brief Allowing the processing of FC03/FC04/FC06 requests for the address space directly in the receiver timeout
+ * interrupt (MBR_ISR_FAST_PATH), the response time is then independent of the main loop.
+ * Read, restriction and update callbacks of the space are called from the interrupt, they must be interrupt safe;
+ * exceptions they cause (restriction rejected, slave_device_busy) are sent from the interrupt as well.
+ * @param address_space Address space created by MBR_Init_Address_Space.
+ * @param flg_isr_access 1 = requests can be processed in the interrupt, 0 = in MBR_Check_For_Request only (default)
+ * @retval none
+ */
+void MBR_Set_ISR_Access(address_space_t *address_space, uint8_t flg_isr_access)
+{
+#if MBR_ISR_FAST_PATH
+	address_space->flg_isr_access = flg_isr_access;
+#else
+	UNUSED(address_space);
+	UNUSED(flg_isr_access);
+#endif
+}
+
+/**
+ * @brief Taking the next change from the change queue (MBR_CHANGE_QUEUE_SIZE), consumer side, one application task only.
+ * Queued changes of the same address space that overlap or follow each other are merged into one range,
+ * e.g. a block written by several FC06 requests is returned once. The values are read from the address space
+ * (with MBR_Read_Begin/MBR_Read_Retry when they have to be consistent).
+ * @param hmodbus Modbus handle.
+ * @param change Taken change. address_space == NULL means that changes have been lost (the queue was full),
+ * the queue has been emptied and all writable spaces have to be re-read.
+ * @retval 1 = change has been taken, 0 = the queue is empty
+ */
+uint8_t MBR_Get_Change(modbus_handle_t *hmodbus, change_t *change)
+{
+#if MBR_CHANGE_QUEUE_SIZE
+	uint32_t tail = hmodbus->change_tail;
+	uint32_t head = hmodbus->change_head;
+	uint32_t lost = hmodbus->changes_lost;
+	const change_t *next;
+	uint32_t end;
+
+	if(lost != hmodbus->changes_lost_reported)
+	{
+		hmodbus->changes_lost_reported = lost;
+		hmodbus->change_tail = head;	//queued changes are covered by the re-read
+		change->address_space = NULL;
+		change->start_address = 0;
+		change->count = 0;
+		return 1;
+	}
+
+	if(tail == head)
+	{
+		return 0;
+	}
+
+	MBR_MEMORY_BARRIER();	//entries are read after they have been published
+	*change = hmodbus->changes[tail++ & (MBR_CHANGE_QUEUE_SIZE - 1)];
+	end = (uint32_t)change->start_address + change->count;
+
+	for(; tail != head; tail++)
+	{
+		next = &hmodbus->changes[tail & (MBR_CHANGE_QUEUE_SIZE - 1)];
+		if(next->address_space != change->address_space || next->start_address > end || (uint32_t)next->start_address + next->count < change->start_address)
+		{
+			break;
+		}
+
+		if(next->start_address < change->start_address)
+		{
+			change->start_address = next->start_address;
+		}
+		if((uint32_t)next->start_address + next->count > end)
+		{
+			end = (uint32_t)next->start_address + next->count;
+		}
+	}
+	change->count = end - change->start_address;
+
+	MBR_MEMORY_BARRIER();	//entries are read before they are released
+	hmodbus->change_tail = tail;
+	return 1;
+#else
+	UNUSED(hmodbus);
+	UNUSED(change);
+	return 0;
+#endif
+}
+
+/**
+ * @brief Switching the handle between slave (server) and master (client) mode.
+ * @param hmodbus Modbus handle.
+ * @param mode slave_mode or master_mode (requires MBR_CLIENT_POLLS > 0).
+ * @retval none
+ */
+void MBR_Set_Mode(modbus_handle_t *hmodbus, modbus_mode_t mode)
+{
+#if MBR_CLIENT_POLLS
+	hmodbus->mode = mode;
+	hmodbus->client.current = -1;
+	hmodbus->client.prepared = -1;
+	hmodbus->client.selected = -1;
+#else
+	UNUSED(hmodbus);
+	UNUSED(mode);
+#endif
+}
+
+/**
+ * @brief Adding the request to the poll list of master mode, polls are executed one after another in a loop.
+ * @param hmodbus Modbus handle.
+ * @param slave_id 1..247
+ * @param function_code 0x01, 0x02, 0x03, 0x04 (read into data) or 0x10 (write from data).
+ * @param start_address Address of the first register or bit.
+ * @param count Number of registers (1..125, 1..123 for 0x10) or bits (1..2000).
+ * @param data Registers in host order or bit-packed bits (point n is bit n%16 of word n/16).
+ * @retval index of the poll (passed to MBR_Poll_Result_Callback), -1 = not ok (list is full or invalid request)
+ */
+int32_t MBR_Add_Poll(modbus_handle_t *hmodbus, uint8_t slave_id, uint8_t function_code, uint16_t start_address, uint16_t count, uint16_t *data)
+{
+#if MBR_CLIENT_POLLS
+	client_t *client = &hmodbus->client;
+	client_poll_t *poll;
+	uint16_t max_count;
+	int32_t slave;
+
+	switch(function_code)
+	{
+	case read_coils:
+	case read_discrete_inputs:
+		max_count = 2000;
+		break;
+	case read_holding_registers:
+	case read_input_registers:
+		max_count = 125;
+		break;
+	case write_multiple_registers:
+		max_count = 123;
+		break;
+	default:
+		return -1;
+	}
+
+	if(slave_id == 0 || slave_id > 247 || count == 0 || count > max_count || client->poll_count >= MBR_CLIENT_POLLS)
+	{
+		return -1;
+	}
+
+	slave = Client_Find_Slave(client, slave_id);
+	if(slave < 0)
+	{
+		return -1;
+	}
+
+	poll = &client->polls[client->poll_count];
+	poll->slave = slave;
+	poll->function = function_code;
+	poll->start_address = start_address;
+	poll->count = count;
+	poll->data = data;
+#if MBR_CLIENT_TAGS
+	poll->tag_count = 0;
+#endif
+
+	return client->poll_count++;
+#else
+	UNUSED(hmodbus);
+	UNUSED(slave_id);
+	UNUSED(function_code);
+	UNUSED(start_address);
+	UNUSED(count);
+	UNUSED(data);
+	return -1;
+#endif
+}
+
+/**
+ * @brief Setting the response timeout of the slave (default MBR_CLIENT_TIMEOUT).
+ * @param hmodbus Modbus handle.
+ * @param slave_id 1..247
+ * @param timeout_ms Time from the end of the request to the end of the response.
+ * @retval 0 = ok, 1 = not ok (slave table is full)
+ */
+uint8_t MBR_Set_Slave_Timeout(modbus_handle_t *hmodbus, uint8_t slave_id, uint16_t timeout_ms)
+{
+#if MBR_CLIENT_POLLS
+	int32_t slave;
+
+	slave = Client_Find_Slave(&hmodbus->client, slave_id);
+	if(slave < 0)
+	{
+		return 1;
+	}
+
+	hmodbus->client.slaves[slave].timeout = timeout_ms;
+	return 0;
+#else
+	UNUSED(hmodbus);
+	UNUSED(slave_id);
+	UNUSED(timeout_ms);
+	return 1;
+#endif
+}
+
+/**
+ * @brief Adding the tag to the tag list of the read planner.
+ * @param hmodbus Modbus handle.
+ * @param slave_id 1..247
+ * @param type Type of registers, it selects the function code (FC01..FC04).
+ * @param address Address of the first register or bit.
+ * @param length Number of registers (1..125) or bits (1..2000).
+ * @param data Storage of the tag, registers in host order or bit-packed bits.
+ * @retval 0 = ok, 1 = not ok (tag list is full or invalid tag)
+ */
+uint8_t MBR_Add_Tag(modbus_handle_t *hmodbus, uint8_t slave_id, register_type_t type, uint16_t address, uint16_t length, uint16_t *data)
+{
+#if MBR_CLIENT_POLLS && MBR_CLIENT_TAGS
+	client_t *client = &hmodbus->client;
+	client_tag_t *tag;
+
+	if(slave_id == 0 || slave_id > 247 || type >= REGISTER_TYPES || length == 0 || length > ((type >= coils) ? 2000 : 125)
+			|| (uint32_t)address + length > 0x10000 || client->tag_count >= MBR_CLIENT_TAGS)
+	{
+		return 1;
+	}
+
+	tag = &client->tags[client->tag_count++];
+	tag->slave_id = slave_id;
+	tag->type = type;
+	tag->address = address;
+	tag->length = length;
+	tag->data = data;
+
+	return 0;
+#else
+	UNUSED(hmodbus);
+	UNUSED(slave_id);
+	UNUSED(type);
+	UNUSED(address);
+	UNUSED(length);
+	UNUSED(data);
+	return 1;
+#endif
+}
+
+/**
+ * @brief Merging the tags into the minimal number of read requests and adding them to the poll list.
+ * Tags of the same slave and type are merged while the request fits the length limit (125 registers, 2000 bits)
+ * and the unused space between the tags does not exceed max_gap. Call it once, after all tags have been added.
+ * @param hmodbus Modbus handle.
+ * @param max_gap Number of unused registers (bits) which can be read to save a request, 0 = only adjacent tags are merged.
+ * @retval number of added polls, -1 = not ok (poll list or slave table is full)
+ */
+int32_t MBR_Plan_Polls(modbus_handle_t *hmodbus, uint16_t max_gap)
+{
+#if MBR_CLIENT_POLLS && MBR_CLIENT_TAGS
+	static const uint8_t function_codes[REGISTER_TYPES] = {read_input_registers, read_holding_registers, read_coils, read_discrete_inputs};
+	client_t *client = &hmodbus->client;
+	client_poll_t *poll = NULL;
+	client_tag_t *tag;
+	uint32_t end = 0, tag_end, limit;
+	int32_t slave, added = 0;
+
+	qsort(client->tags, client->tag_count, sizeof(client_tag_t), Compare_Tags);
+
+	for(uint32_t i=0; i<client->tag_count; i++)
+	{
+		tag = &client->tags[i];
+		tag_end = (uint32_t)tag->address + tag->length;
+		limit = (tag->type >= coils) ? 2000 : 125;
+
+		if(poll != NULL && client->tags[i-1].slave_id == tag->slave_id && client->tags[i-1].type == tag->type
+				&& tag->address <= end + max_gap && ((tag_end > end) ? tag_end : end) - poll->start_address <= limit)
+		{
+			if(tag_end > end)
+			{
+				end = tag_end;
+			}
+		}
+		else	//new request
+		{
+			slave = Client_Find_Slave(client, tag->slave_id);
+			if(slave < 0 || client->poll_count >= MBR_CLIENT_POLLS)
+			{
+				return -1;
+			}
+
+			poll = &client->polls[client->poll_count++];
+			poll->slave = slave;
+			poll->function = function_codes[tag->type];
+			poll->start_address = tag->address;
+			poll->data = NULL;
+			poll->first_tag = i;
+			poll->tag_count = 0;
+			end = tag_end;
+			added++;
+		}
+
+		poll->count = end - poll->start_address;
+		poll->tag_count++;
+	}
+
+	return added;
+#else
+	UNUSED(hmodbus);
+	UNUSED(max_gap);
+	return -1;
+#endif
+}
+
+#ifdef MBR_RX_STREAMING_CRC
+/**
+ * @brief Folding the bytes received by DMA so far into the running CRC.
+ * Can be called from the main loop, a timer or the idle line interrupt, it is also called on DMA half transfer.
+ * @param hmodbus Modbus handle.
+ * @retval none
+ */
+void MBR_Receive_Progress(modbus_handle_t *hmodbus)
+{
+	Fold_Received_Bytes(hmodbus);
+}
+#endif
+
+#ifdef MBR_PROFILING
+/**
+ * @brief Getting the copy of the accumulated processing profile.
+ * @param hmodbus Modbus handle.
+ * @param profile Pointer to the structure to be filled.
+ * @retval none
+ */
+void MBR_Get_Profile(modbus_handle_t *hmodbus, profile_t *profile)
+{
+	*profile = hmodbus->profile;
+}
+
+void MBR_Reset_Profile(modbus_handle_t *hmodbus)
+{
+	memset(&hmodbus->profile, 0, sizeof(profile_t));
+}
+
+/**
+ * @brief Getting the percentile of frame end to TX start time.
+ * @param hmodbus Modbus handle.
+ * @param percentile 1..100, e.g. 50 for median, 99 for p99
+ * @retval lower bound of the histogram bucket, in timestamp units (0 when nothing has been sent)
+ */
+uint32_t MBR_Get_Turnaround_Percentile(modbus_handle_t *hmodbus, uint8_t percentile)
+{
+	uint32_t threshold, sum = 0;
+	uint32_t msb;
+
+	threshold = ((uint64_t)hmodbus->profile.responses * percentile + 99) / 100;
+	if(threshold == 0)
+	{
+		return 0;
+	}
+
+	for(uint32_t i=0; i<PROFILE_HISTOGRAM_SIZE; i++)
+	{
+		sum += hmodbus->profile.turnaround[i];
+		if(sum >= threshold)
+		{
+			if(i < 4)
+			{
+				return i;
+			}
+			msb = i/4 + 1;
+			return (4 + i%4) << (msb-2);
+		}
+	}
+
+	return UINT32_MAX;
+}
+#endif
+
+/*CALLBACKS*/
+/**
+ * @brief This function is called every time when Modbus master tries to update holding register value.
+ * @param none
+ * @retval 0 = ok (new value is allowed), 1 = not ok (new value is not allowed)
+ */
+__weak uint8_t MBR_Check_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+	return 0;
+}
+
+/**
+ * @brief This function is called when holding register value has been updated.
+ * @param none
+ * @retval none
+ */
+__weak void MBR_Register_Update_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data)
+{
+	UNUSED(register_address);
+	UNUSED(register_data);
+}
+
+__weak void MBR_Register_Read_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data)
+{
+	UNUSED(hmodbus);
+	UNUSED(register_address);
+	UNUSED(register_data);
+}
+
+/**
+ * @brief This function is called once per request when Modbus master tries to update holding registers.
+ * @param hmodbus Modbus handle.
+ * @param start_address Address of the first register.
+ * @param register_count Number of registers.
+ * @param register_data New values (not written to the address space yet).
+ * @retval 0 = ok (new values are allowed), 1 = not ok (request is rejected, nothing is written)
+ */
+__weak uint8_t MBR_Check_Range_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t register_count, const uint16_t *register_data)
+{
+#if MBR_PER_REGISTER_CALLBACKS
+	for(uint32_t i=0; i<register_count; i++)
+	{
+		if(MBR_Check_Restrictions_Callback(hmodbus, start_address+i, register_data[i]))
+		{
+			return 1;
+		}
+	}
+#else
+	UNUSED(hmodbus);
+	UNUSED(start_address);
+	UNUSED(register_count);
+	UNUSED(register_data);
+#endif
+	return 0;
+}
+
+/**
+ * @brief This function is called when holding registers have been updated, once per address space touched by the request.
+ * @param hmodbus Modbus handle.
+ * @param start_address Address of the first register.
+ * @param register_count Number of registers.
+ * @param register_data Pointer to the updated registers in the address space.
+ * @retval none
+ */
+__weak void MBR_Register_Range_Update_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t register_count, const uint16_t *register_data)
+{
+#if MBR_PER_REGISTER_CALLBACKS
+	for(uint32_t i=0; i<register_count; i++)
+	{
+		MBR_Register_Update_Callback(hmodbus, start_address+i, register_data[i]);
+	}
+#else
+	UNUSED(hmodbus);
+	UNUSED(start_address);
+	UNUSED(register_count);
+	UNUSED(register_data);
+#endif
+}
+
+/**
+ * @brief This function is called before registers are sent, once per address space touched by the request.
+ * The application can refresh the whole block in place.
+ * @param hmodbus Modbus handle.
+ * @param type Type of registers.
+ * @param start_address Address of the first register.
+ * @param register_count Number of registers.
+ * @param register_data Pointer to the registers in the address space.
+ * @retval none
+ */
+__weak void MBR_Register_Range_Read_Callback(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t register_count, uint16_t *register_data)
+{
+	UNUSED(type);
+#if MBR_PER_REGISTER_CALLBACKS
+	for(uint32_t i=0; i<register_count; i++)
+	{
+		MBR_Register_Read_Callback(hmodbus, start_address+i, &register_data[i]);
+	}
+#else
+	UNUSED(hmodbus);
+	UNUSED(start_address);
+	UNUSED(register_count);
+	UNUSED(register_data);
+#endif
+}
+
+/**
+ * @brief This function is called once per address space when Modbus master tries to update coils.
+ * @param hmodbus Modbus handle.
+ * @param start_address Address of the first coil.
+ * @param coil_count Number of coils.
+ * @param coil_data New values, bit-packed (the first coil is bit 0 of coil_data[0]).
+ * @retval 0 = ok (new values are allowed), 1 = not ok (request is rejected)
+ */
+__weak uint8_t MBR_Check_Coil_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t coil_count, const uint8_t *coil_data)
+{
+	UNUSED(hmodbus);
+	UNUSED(start_address);
+	UNUSED(coil_count);
+	UNUSED(coil_data);
+	return 0;
+}
+
+/**
+ * @brief This function is called when coils have been updated, once per address space touched by the request.
+ */
+__weak void MBR_Coil_Update_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t coil_count)
+{
+	UNUSED(hmodbus);
+	UNUSED(start_address);
+	UNUSED(coil_count);
+}
+
+/**
+ * @brief This function is called before coils or discrete inputs are sent, once per address space touched by the request.
+ */
+__weak void MBR_Bit_Read_Callback(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t bit_count)
+{
+	UNUSED(hmodbus);
+	UNUSED(type);
+	UNUSED(start_address);
+	UNUSED(bit_count);
+}
+
+/**
+ * @brief This function is called when a write request has posted its changes to the change queue (MBR_CHANGE_QUEUE_SIZE),
+ * it replaces MBR_Register_Range_Update_Callback and MBR_Coil_Update_Callback then.
+ * Notify the application task here, it takes the changes by MBR_Get_Change. Can be called from interrupt (MBR_ISR_FAST_PATH).
+ * @param hmodbus Modbus handle.
+ * @retval none
+ */
+__weak void MBR_Change_Posted_Callback(modbus_handle_t *hmodbus)
+{
+	UNUSED(hmodbus);
+}
+
+//__weak void MBR_Register_Init_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data)
+//{
+//	UNUSED(register_address);
+//	UNUSED(register_data);
+//}
+
+__weak void MBR_Start_Sending_Callback(UART_HandleTypeDef *huart)
+{
+	UNUSED(huart);
+}
+
+__weak void MBR_End_Sending_Callback(UART_HandleTypeDef *huart)
+{
+	UNUSED(huart);
+}
+
+/**
+ * @brief This function is called for function codes without handler registered by MBR_Add_Custom_Command.
+ * @param buf_modbus Request frame (without CRC), the response is built in place.
+ * @param response Payload size of the response (address and function code included), exception and response flag.
+ * @retval none
+ */
+__weak void MBR_Custom_Command_Callback(uint8_t *buf_modbus, response_t *response)
+{
+	UNUSED(buf_modbus);
+
+	response->flg_response = 1;
+	response->exception = illegal_function;
+}
+
+/**
+ * @brief This function is called when the poll has finished (master mode).
+ * @param hmodbus Modbus handle.
+ * @param poll Index returned by MBR_Add_Poll.
+ * @param status poll_ok, exception code of the slave, poll_invalid_response or poll_timeout.
+ * @retval none
+ */
+__weak void MBR_Poll_Result_Callback(modbus_handle_t *hmodbus, int32_t poll, uint8_t status)
+{
+	UNUSED(hmodbus);
+	UNUSED(poll);
+	UNUSED(status);
+}
+
+__weak void MBR_Poll_Cycle_Callback(modbus_handle_t *hmodbus)
+{
+	UNUSED(hmodbus);
+}
+
+__weak void MBR_Communication_Lost_Callback(modbus_handle_t *hmodbus)
+{
+	UNUSED(hmodbus);
+}
+
+__weak void MBR_Communication_Restored_Callback(modbus_handle_t *hmodbus)
+{
+	UNUSED(hmodbus);
+}
+
+/**
+ * @brief This function is called from interrupt when MBR_Check_For_Request has work to do (frame received, transmission finished).
+ * Give a semaphore / notify the task here, the task sleeps in MBR_Wait_Callback.
+ * @param hmodbus Modbus handle.
+ * @retval none
+ */
+__weak void MBR_Wakeup_Callback(modbus_handle_t *hmodbus)
+{
+	hmodbus->flg_wakeup = 1;
+}
+
+/**
+ * @brief This function is called by MBR_Wait_For_Request to sleep until MBR_Wakeup_Callback or the timeout.
+ * Default one sleeps until any interrupt (WFI), on host it polls the UART (interrupt emulation).
+ * The wakeup flag is tested with interrupts masked: an event signalled after MBR_Get_Wait_Time is not lost,
+ * WFI still wakes up on the pending interrupt, which is then served after __enable_irq.
+ * @param hmodbus Modbus handle.
+ * @param timeout_ms Maximum time to sleep, MBR_WAIT_FOREVER = no limit.
+ * @retval none
+ */
+__weak void MBR_Wait_Callback(modbus_handle_t *hmodbus, uint32_t timeout_ms)
+{
+#if defined(MBR_HOST_BUILD)
+	if(hmodbus->huart != NULL)
+	{
+		HOST_UART_Poll(hmodbus->huart, (timeout_ms > INT32_MAX) ? -1 : (int)timeout_ms);
+	}
+#else
+	UNUSED(timeout_ms);
+	__disable_irq();
+	if(hmodbus->flg_wakeup == 0)
+	{
+		__WFI();
+	}
+	hmodbus->flg_wakeup = 0;
+	__enable_irq();
+#endif
+}
+
+/*HAL CALLBACKS*/
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	modbus_handle_t *hmodbus;
+	uint8_t len, next;
+
+	hmodbus = Get_Handle(huart);
+	if(hmodbus == NULL)	//UART is not used by Modbus
+	{
+		return;
+	}
+
+	if(huart->ErrorCode & ~HAL_UART_ERROR_RTO)
+	{
+		hmodbus->statistics.uart_errors++;
+		if(huart->ErrorCode & HAL_UART_ERROR_ORE)
+		{
+			hmodbus->statistics.overruns++;
+		}
+	}
+
+	if(huart->ErrorCode == HAL_UART_ERROR_RTO)
+	{
+		len = MODBUS_BUFFER_SIZE - huart->hdmarx->Instance->CNDTR;
+		if(len > 7 || (hmodbus->mode == master_mode && len >= 5))	//minimum Modbus frame length (for requests, exception responses are shorter)
+		{
+			next = (hmodbus->rx_head + 1) % MBR_RX_SLOTS;
+			if(next != hmodbus->rx_tail)
+			{
+				hmodbus->len_modbus_rx[hmodbus->rx_head] = len;
+#ifdef MBR_PROFILING
+				hmodbus->rx_timestamp[hmodbus->rx_head] = MBR_PROFILE_TIMESTAMP();
+#endif
+#ifdef MBR_RX_STREAMING_CRC
+				Fold_Received_Bytes(hmodbus);	//usually only the last few bytes are left
+				hmodbus->flg_rx_crc_ready[hmodbus->rx_head] = (hmodbus->rx_crc_position == len);
+				hmodbus->rx_crc_result[hmodbus->rx_head] = hmodbus->rx_crc;
+#endif
+#if MBR_ISR_FAST_PATH
+				if(hmodbus->rx_tail == hmodbus->rx_head && hmodbus->flg_tx_busy == 0 && Is_Fast_Request(hmodbus, hmodbus->buf_modbus_rx[hmodbus->rx_head], len))
+				{
+					/*nothing is queued or being processed, the frame is answered here and its slot is reused*/
+					hmodbus->buf_modbus = hmodbus->buf_modbus_rx[hmodbus->rx_head];
+					hmodbus->len_modbus_frame = len;
+#ifdef MBR_PROFILING
+					hmodbus->frame_end_timestamp = hmodbus->rx_timestamp[hmodbus->rx_head];
+#endif
+					hmodbus->flg_isr_context = 1;
+					Check_Frame(hmodbus);
+					hmodbus->flg_isr_context = 0;
+				}
+				else
+#endif
+				{
+					hmodbus->rx_head = next;
+					MBR_Wakeup_Callback(hmodbus);
+				}
+			}
+			else	//all slots are full, the frame is dropped
+			{
+				hmodbus->statistics.overruns++;
+			}
+		}
+	}
+
+#ifdef MBR_RX_STREAMING_CRC
+	hmodbus->flg_rx_crc_reset = 1;	//the next frame is folded from the beginning
+#endif
+
+	huart->ErrorCode = HAL_UART_ERROR_NONE;
+
+	HAL_UART_Receive_DMA(huart, hmodbus->buf_modbus_rx[hmodbus->rx_head], MODBUS_BUFFER_SIZE);	//reception is restarted immediately
+}
+
+#ifdef MBR_RX_STREAMING_CRC
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+	modbus_handle_t *hmodbus;
+
+	hmodbus = Get_Handle(huart);
+	if(hmodbus != NULL)
+	{
+		Fold_Received_Bytes(hmodbus);
+	}
+}
+#endif
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	modbus_handle_t *hmodbus;
+
+	hmodbus = Get_Handle(huart);
+	if(hmodbus == NULL)
+	{
+		return;
+	}
+
+	hmodbus->statistics.transmissions++;
+#if MBR_CLIENT_POLLS
+	hmodbus->client.request_time = HAL_GetTick();	//response timeout starts at the end of the request
+#endif
+	hmodbus->flg_tx_busy = 0;
+	MBR_End_Sending_Callback(huart);
+	HAL_UART_Receive_DMA(huart, hmodbus->buf_modbus_rx[hmodbus->rx_head], MODBUS_BUFFER_SIZE);	//in case reception has been stopped
+	MBR_Wakeup_Callback(hmodbus);	//deferred frame or the next request of master mode can be sent
+}
+
+
+/*PRIVATE FUNCTIONS*/
+/**
+ * @brief Finding the Modbus handle which uses the UART (HAL callbacks do not know the Modbus handle).
+ * @retval Modbus handle, NULL when the UART is not used by Modbus
+ */
+static modbus_handle_t *Get_Handle(UART_HandleTypeDef *huart)
+{
+	for(uint32_t i=0; i<MBR_MAX_INSTANCES; i++)
+	{
+		if(modbus_handles[i] != NULL && modbus_handles[i]->huart == huart)
+		{
+			return modbus_handles[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Registering the handle and its initial setup, common for all kinds of storage.
+ * @retval hmodbus, NULL when MBR_MAX_INSTANCES handles are already in use
+ */
+static modbus_handle_t *Setup_Handle(modbus_handle_t *hmodbus, UART_HandleTypeDef *huart)
+{
+	uint32_t index;
+
+	for(index=0; index<MBR_MAX_INSTANCES; index++)
+	{
+		if(modbus_handles[index] == NULL)
+		{
+			break;
+		}
+	}
+
+	if(index == MBR_MAX_INSTANCES)	//all handles are in use
+	{
+		return NULL;
+	}
+
+	memset(hmodbus, 0, sizeof(modbus_handle_t));
+
+	hmodbus->huart = huart;
+	hmodbus->buf_modbus_tx = &hmodbus->tx_storage[1];
+	for(uint32_t unit=0; unit<=MBR_MAX_UNITS; unit++)
+	{
+		hmodbus->maps[unit].spaces = hmodbus->maps[unit].storage;
+	}
+	hmodbus->map = &hmodbus->maps[0];
+	hmodbus->comm_timeout = MBR_COMM_TIMEOUT;
+	modbus_handles[index] = hmodbus;
+
+	for(uint32_t i=0; i<0x100; i++)
+	{
+		hmodbus->commands[i] = Custom_Command;
+	}
+	hmodbus->commands[read_coils] = Read_Coils;
+	hmodbus->commands[read_discrete_inputs] = Read_Discrete_Inputs;
+	hmodbus->commands[read_holding_registers] = Read_Holding_Registers;
+	hmodbus->commands[read_input_registers] = Read_Input_Registers;
+	hmodbus->commands[write_single_register] = Write_Single_Register;
+	hmodbus->commands[write_multiple_registers] = Write_Multiple_Registers;
+	hmodbus->commands[write_single_coil] = Write_Single_Coil;
+	hmodbus->commands[write_multiple_coils] = Write_Multiple_Coils;
+	hmodbus->commands[diagnostics] = Diagnostics;
+	hmodbus->commands[mask_write_register] = Mask_Write_Register;
+	hmodbus->commands[read_write_multiple_registers] = Read_Write_Multiple_Registers;
+
+#ifdef MBR_RX_STREAMING_CRC
+	hmodbus->rx_crc = MBR_CRC16_INIT;
+	hmodbus->rx_crc_position = 0;
+#endif
+
+#if MBR_CLIENT_POLLS
+	hmodbus->client.current = -1;
+	hmodbus->client.prepared = -1;
+	hmodbus->client.selected = -1;
+#endif
+
+	if(huart == NULL)
+	{
+		return hmodbus;
+	}
+
+	//init usart and dma
+	Configure_Timing(hmodbus);
+	HAL_UART_EnableReceiverTimeout(hmodbus->huart);
+	HAL_UART_Receive_DMA(hmodbus->huart, hmodbus->buf_modbus_rx[hmodbus->rx_head], MODBUS_BUFFER_SIZE);
+
+	return hmodbus;
+}
+
+/**
+ * @brief Unit id dispatch: the slave id and broadcast use the main map, other unit ids are looked up in the bitmap.
+ * @retval register map of the unit, NULL when the unit id is not served
+ */
+static address_map_t *Select_Map(modbus_handle_t *hmodbus, uint8_t address)
+{
+	if(address == hmodbus->init.slave_id || address == 0x00)
+	{
+		return &hmodbus->maps[0];
+	}
+#if MBR_MAX_UNITS
+	if(hmodbus->unit_bitmap[address>>5] & (1u << (address & 0x1F)))
+	{
+		return &hmodbus->maps[hmodbus->unit_map[address]];
+	}
+#endif
+
+	return NULL;
+}
+
+static void Free_Address_Space(address_space_t *address_space)
+{
+	if(address_space->flg_storage)
+	{
+		return;
+	}
+#if MBR_STATIC_ALLOCATION && MBR_STATIC_SPACES
+	space_used[address_space - space_pool] = 0;
+#elif !MBR_STATIC_ALLOCATION
+	free(address_space);
+#endif
+}
+
+/**
+ * @brief Adding the address space to the address map (the map is kept sorted).
+ * @retval 0 = ok, 1 = not ok (map is full or static, wrong type or the space overlaps with already added one)
+ */
+static uint8_t Add_Space(address_map_t *map, address_space_t *address_space)
+{
+	uint32_t index, end;
+
+	if(address_space == NULL || map->flg_static || map->first[REGISTER_TYPES] >= MBR_MAX_ADDRESS_SPACES || address_space->type >= REGISTER_TYPES)
+	{
+		return 1;
+	}
+
+	end = (uint32_t)address_space->start_offset + address_space->size;
+	if(address_space->size == 0 || end > 0x10000)
+	{
+		return 1;
+	}
+
+	/*position of the first space of the same type with greater start offset*/
+	index = map->first[address_space->type];
+	while(index < map->first[address_space->type+1] && map->spaces[index]->start_offset < address_space->start_offset)
+	{
+		index++;
+	}
+
+	/*only neighbours can overlap*/
+	if(index > map->first[address_space->type])
+	{
+		if(map->spaces[index-1]->start_offset + map->spaces[index-1]->size > address_space->start_offset)
+		{
+			return 1;
+		}
+	}
+	if(index < map->first[address_space->type+1])
+	{
+		if(map->spaces[index]->start_offset < end)
+		{
+			return 1;
+		}
+	}
+
+	memmove(&map->spaces[index+1], &map->spaces[index], (map->first[REGISTER_TYPES] - index) * sizeof(address_space_t*));
+	map->spaces[index] = address_space;
+
+	for(uint32_t type = address_space->type + 1; type <= REGISTER_TYPES; type++)
+	{
+		map->first[type]++;
+	}
+#if MBR_RESPONSE_CACHE_SIZE
+	map->version++;
+#endif
+
+	return 0;
+}
+
+/**
+ * @brief Removing the address space with the given array from the map and freeing it.
+ * @retval 0 = removed, 1 = not found or static map
+ */
+static uint8_t Remove_Space(address_map_t *map, uint16_t *address)
+{
+	register_type_t type;
+
+	if(map->flg_static)
+	{
+		return 1;
+	}
+
+	for(uint32_t i=0; i<map->first[REGISTER_TYPES]; i++)
+	{
+		if(map->spaces[i]->address == address)
+		{
+			type = map->spaces[i]->type;
+			Free_Address_Space(map->spaces[i]);
+
+			memmove(&map->spaces[i], &map->spaces[i+1], (map->first[REGISTER_TYPES] - i - 1) * sizeof(address_space_t*));
+
+			for(uint32_t t = type + 1; t <= REGISTER_TYPES; t++)
+			{
+				map->first[t]--;
+			}
+#if MBR_RESPONSE_CACHE_SIZE
+			map->version++;
+#endif
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t Set_Static_Map(address_map_t *map, const register_map_t *static_map)
+{
+	const address_space_t *space, *previous;
+
+	if(map->flg_static == 0 && map->first[REGISTER_TYPES] != 0)	//address spaces have been added already
+	{
+		return 1;
+	}
+
+	if(static_map->first[0] != 0)
+	{
+		return 1;
+	}
+
+	for(uint32_t type=0; type<REGISTER_TYPES; type++)
+	{
+		previous = NULL;
+		for(uint32_t i=static_map->first[type]; i<static_map->first[type+1]; i++)
+		{
+			space = static_map->spaces[i];
+			if(space->type != type || space->size == 0 || (uint32_t)space->start_offset + space->size > 0x10000)
+			{
+				return 1;
+			}
+			if(previous != NULL && (uint32_t)previous->start_offset + previous->size > space->start_offset)
+			{
+				return 1;
+			}
+			previous = space;
+		}
+	}
+
+	map->spaces = (address_space_t**)static_map->spaces;
+	memcpy(map->first, static_map->first, sizeof(map->first));
+	map->flg_static = 1;
+#if MBR_RESPONSE_CACHE_SIZE
+	map->version++;
+#endif
+
+	return 0;
+}
+/**
+ * @brief CRC16 (Modbus) of the buffer, engine is selected by MBR_CRC_ENGINE (see MODBUS_CRC.h).
+ * @param buf Data.
+ * @param len Number of bytes.
+ * @retval CRC16 value, Lo byte is sent first
+ */
+uint16_t Calculate_CRC16(uint8_t *buf, uint16_t len)
+{
+	return MBR_CRC16_Final(MBR_CRC16_Update(MBR_CRC16_INIT, buf, len));
+}
+
+
+static void Check_Frame(modbus_handle_t *hmodbus)
+{
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	address_map_t *map;
+	uint16_t crc_int, crc_calc;
+	PROFILE_BEGIN(timestamp);
+
+#ifdef MBR_RX_STREAMING_CRC
+	crc_int = 0;			//CRC of the frame including its CRC bytes is 0 for a valid frame
+	crc_calc = 1;
+	if(hmodbus->flg_rx_crc_ready[hmodbus->rx_tail])
+	{
+		crc_calc = hmodbus->rx_crc_result[hmodbus->rx_tail];
+	}
+	if(crc_calc != 0)	//ISR was not able to finish folding, or the running CRC is suspect: the frame is checked as a whole
+	{
+		crc_calc = Frame_CRC16(hmodbus, buf_modbus, hmodbus->len_modbus_frame);
+	}
+#else
+	crc_int = (buf_modbus[hmodbus->len_modbus_frame-1]<<8) + buf_modbus[hmodbus->len_modbus_frame-2];	//get CRC16 bytes from the received packet
+	crc_calc = Frame_CRC16(hmodbus, buf_modbus, hmodbus->len_modbus_frame-2);
+#endif
+	PROFILE_STAGE(profile_crc_check, timestamp);
+
+	if(crc_int == crc_calc)	// Check does the CRC match
+	{
+		hmodbus->statistics.bus_messages++;
+		map = Select_Map(hmodbus, buf_modbus[0]);
+		if(map != NULL)	//Check if the device address is correct
+		{
+			hmodbus->map = map;
+#ifdef MBR_PROFILING
+			hmodbus->profile.frames++;
+#endif
+			if(buf_modbus[0] == 0x00)
+			{
+				hmodbus->statistics.broadcasts++;
+			}
+			Process_Request(hmodbus);	// Return flag OK;
+			Set_Communication_Ok(hmodbus);
+		}
+		else
+		{
+			hmodbus->statistics.other_ids++;
+		}
+	}
+	else
+	{
+		hmodbus->statistics.crc_errors++;
+	}
+}
+
+/**
+ * @brief Binary search of the address space which contains the register.
+ * @retval index in the address map, -1 when the register is not mapped
+ */
+static int32_t Find_Address_Space(address_map_t *map, register_type_t type, uint16_t register_address)
+{
+	int32_t low = map->first[type];
+	int32_t high = map->first[type+1] - 1;
+	int32_t middle, found = -1;
+
+	while(low <= high)	//last space with start offset <= register address
+	{
+		middle = (low + high) / 2;
+		if(map->spaces[middle]->start_offset <= register_address)
+		{
+			found = middle;
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle - 1;
+		}
+	}
+
+	if(found >= 0 && register_address >= map->spaces[found]->start_offset + map->spaces[found]->size)
+	{
+		found = -1;
+	}
+
+	return found;
+}
+
+/**
+ * @brief Checking that the whole range is mapped, the range can span adjacent address spaces.
+ * @retval index of the address space with the first register, -1 when any register is not mapped
+ */
+static int32_t Find_Address_Range(address_map_t *map, register_type_t type, uint16_t start_address, uint16_t register_count)
+{
+	int32_t index, next;
+	uint32_t end, covered;
+
+	index = Find_Address_Space(map, type, start_address);
+	if(index < 0)
+	{
+		return -1;
+	}
+
+	end = (uint32_t)start_address + register_count;
+	covered = (uint32_t)map->spaces[index]->start_offset + map->spaces[index]->size;
+
+	for(next = index + 1; covered < end; next++)
+	{
+		if(next >= map->first[type+1] || map->spaces[next]->start_offset != covered)
+		{
+			return -1;
+		}
+		covered += map->spaces[next]->size;
+	}
+
+	return index;
+}
+
+/**
+ * @brief Encoding registers to the frame (big-endian), starting from the address space found by Find_Address_Range.
+ * @retval 0 = ok, 1 = not ok (consistent block has not been read in MBR_SEQLOCK_RETRIES attempts)
+ */
+static uint8_t Encode_Registers(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t register_count, uint8_t *buf)
+{
+	address_space_t *address_space;
+	uint16_t offset, count;
+	uint32_t sequence, attempts;
+
+#if MBR_RESPONSE_CACHE_SIZE
+	hmodbus->cache_fill.index = index;
+	hmodbus->cache_fill.spaces = 0;
+	hmodbus->cache_fill.version = 0;
+#endif
+
+	while(register_count)
+	{
+		address_space = hmodbus->map->spaces[index++];
+#if MBR_RESPONSE_CACHE_SIZE
+		hmodbus->cache_fill.spaces++;
+		hmodbus->cache_fill.version += address_space->version;	//captured before reading, a concurrent write makes the entry stale
+#endif
+		offset = start_address - address_space->start_offset;
+		count = address_space->size - offset;
+		if(count > register_count)
+		{
+			count = register_count;
+		}
+
+		MBR_Register_Range_Read_Callback(hmodbus, address_space->type, start_address, count, &address_space->address[offset]);
+
+		attempts = 0;
+		do	//the block is copied again when the application has updated it meanwhile
+		{
+			if(attempts++ > MBR_SEQLOCK_RETRIES)
+			{
+				return 1;
+			}
+			sequence = MBR_Read_Begin(address_space);
+			Swap_Registers(buf, (const uint8_t*)&address_space->address[offset], count);
+		} while(MBR_Read_Retry(address_space, sequence));
+
+		start_address += count;
+		register_count -= count;
+		buf += count*2;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Swapping bytes of every register: host order (little-endian) <-> Modbus order (big-endian).
+ * @param dst Destination, can be unaligned.
+ * @param src Source, can be unaligned, must not overlap with dst.
+ * @param count Number of registers.
+ */
+static void Swap_Registers(uint8_t *dst, const uint8_t *src, uint32_t count)
+{
+#if defined(MBR_HOST_BUILD) && defined(__SSE2__)
+	__m128i v;
+
+	for(; count >= 8; count -= 8, src += 16, dst += 16)
+	{
+		v = _mm_loadu_si128((const __m128i*)src);
+		_mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined(MBR_HOST_BUILD) && defined(__ARM_NEON)
+	for(; count >= 8; count -= 8, src += 16, dst += 16)
+	{
+		vst1q_u8(dst, vrev16q_u8(vld1q_u8(src)));
+	}
+#elif defined(__ARM_ARCH) && !defined(MBR_HOST_BUILD)
+	/*Cortex-M0 has no unaligned access: words when both pointers have the same alignment, halfwords when dst is even*/
+	if((((uintptr_t)dst | (uintptr_t)src) & 1) == 0)
+	{
+		if((((uintptr_t)dst ^ (uintptr_t)src) & 2) == 0)
+		{
+			if(((uintptr_t)dst & 2) && count)
+			{
+				*(uint16_t*)dst = __REV16(*(const uint16_t*)src);
+				src += 2;
+				dst += 2;
+				count--;
+			}
+
+			for(; count >= 2; count -= 2, src += 4, dst += 4)
+			{
+				*(uint32_t*)dst = __REV16(*(const uint32_t*)src);
+			}
+		}
+
+		for(; count; count--, src += 2, dst += 2)
+		{
+			*(uint16_t*)dst = __REV16(*(const uint16_t*)src);
+		}
+	}
+#endif
+
+	for(; count; count--, src += 2, dst += 2)
+	{
+		dst[0] = src[1];
+		dst[1] = src[0];
+	}
+}
+
+/**
+ * @brief Decoding registers of the request in place: big-endian data at buf (odd offset in the frame)
+ * is converted to host order at buf+1, so it can be used as uint16_t array. Runs backwards, because the areas overlap.
+ * @param buf Register data of the request, buf+1 must be halfword aligned.
+ * @param count Number of registers.
+ * @retval pointer to decoded registers
+ */
+static uint16_t *Decode_Registers_In_Place(uint8_t *buf, uint32_t count)
+{
+	uint16_t *registers = (uint16_t*)(buf + 1);
+
+#if defined(MBR_HOST_BUILD) && defined(__SSE2__)
+	__m128i v;
+
+	for(; count >= 8; count -= 8)	//whole chunk is loaded before the store overwrites it
+	{
+		v = _mm_loadu_si128((const __m128i*)&buf[(count-8)*2]);
+		_mm_storeu_si128((__m128i*)&registers[count-8], _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined(MBR_HOST_BUILD) && defined(__ARM_NEON)
+	for(; count >= 8; count -= 8)
+	{
+		vst1q_u8((uint8_t*)&registers[count-8], vrev16q_u8(vld1q_u8(&buf[(count-8)*2])));
+	}
+#endif
+
+	while(count--)
+	{
+		registers[count] = (buf[count*2]<<8) | buf[count*2+1];
+	}
+
+	return registers;
+}
+
+static void Read_Input_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address  = (request->data[0]<<8)+ request->data[1];
+	uint16_t register_count;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	register_count =  (request->data[2]<<8)+ request->data[3];
+	if(request->length < 4 || register_count == 0 || register_count > 125)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Range(hmodbus->map, input_registers, start_address, register_count);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		response->data[0] = register_count*2;	// byte count
+		if(Encode_Registers(hmodbus, index, start_address, register_count, &response->data[1]))
+		{
+			response->exception = slave_device_busy;	//application keeps updating the registers
+		}
+		response->length = 1 + response->data[0];
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+static void Read_Holding_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address  = (request->data[0]<<8)+ request->data[1];
+	uint16_t register_count;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	register_count =  (request->data[2]<<8)+ request->data[3];
+	if(request->length < 4 || register_count == 0 || register_count > 125)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Range(hmodbus->map, holding_registers, start_address, register_count);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		response->data[0] = register_count*2;	// byte count
+		if(Encode_Registers(hmodbus, index, start_address, register_count, &response->data[1]))
+		{
+			response->exception = slave_device_busy;	//application keeps updating the registers
+		}
+		response->length = 1 + response->data[0];
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+
+	if(start_address == 0 && register_count == 4)	//response to broadcast
+	{
+		response->flg_response = 1;
+	}
+}
+
+static void Write_Multiple_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address, register_count;
+	uint16_t *registers;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	start_address  = (request->data[0]<<8)+ request->data[1];
+	register_count =  (request->data[2]<<8)+ request->data[3];
+	if(register_count == 0 || register_count > 123 || request->data[4] != register_count*2 || request->length < 5 + register_count*2)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Range(hmodbus->map, holding_registers, start_address, register_count);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		registers = Decode_Registers_In_Place(&request->data[5], register_count);	//validated in the receive buffer, no copy
+
+		if(MBR_Check_Range_Restrictions_Callback(hmodbus, start_address, register_count, registers))
+		{
+			response->exception = illegal_data_value;
+		}
+	}
+
+	if(response->exception == 0)
+	{
+		Store_Registers(hmodbus, index, start_address, register_count, registers);
+
+		memcpy(response->data, request->data, 4);	//start address and register count are echoed
+		response->length = 4;
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+static void Write_Single_Register(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t reg_data;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	if(request->length < 4)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Space(hmodbus->map, holding_registers, start_address);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		reg_data = (request->data[2]<<8)+ request->data[3];
+
+		if(MBR_Check_Range_Restrictions_Callback(hmodbus, start_address, 1, &reg_data))
+		{
+			response->exception = illegal_data_value;
+		}
+		else
+		{
+			Store_Registers(hmodbus, index, start_address, 1, &reg_data);
+		}
+
+		memcpy(response->data, request->data, 4);	//register address and value are echoed
+		response->length = 4;
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+static void Read_Coils(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	Read_Bits(hmodbus, coils, request, response);
+}
+
+static void Read_Discrete_Inputs(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	Read_Bits(hmodbus, discrete_inputs, request, response);
+}
+
+static void Write_Single_Coil(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t coil_data = (request->data[2]<<8)+ request->data[3];
+	uint8_t value = (coil_data == 0xFF00);
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	if(request->length < 4 || (coil_data != 0xFF00 && coil_data != 0x0000))
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Space(hmodbus->map, coils, start_address);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		if(MBR_Check_Coil_Restrictions_Callback(hmodbus, start_address, 1, &value))
+		{
+			response->exception = illegal_data_value;
+		}
+		else
+		{
+			Write_Bits(hmodbus, index, start_address, 1, &value);
+		}
+
+		memcpy(response->data, request->data, 4);	//coil address and value are echoed
+		response->length = 4;
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+static void Write_Multiple_Coils(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t coil_count = (request->data[2]<<8)+ request->data[3];
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	if(coil_count == 0 || coil_count > 1968 || request->data[4] != (coil_count+7)/8 || request->length < 5 + request->data[4])
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Range(hmodbus->map, coils, start_address, coil_count);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		if(MBR_Check_Coil_Restrictions_Callback(hmodbus, start_address, coil_count, &request->data[5]))
+		{
+			response->exception = illegal_data_value;
+		}
+		else
+		{
+			Write_Bits(hmodbus, index, start_address, coil_count, &request->data[5]);
+		}
+
+		memcpy(response->data, request->data, 4);	//start address and coil count are echoed
+		response->length = 4;
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+/**
+ * @brief Reading coils or discrete inputs, the range can span adjacent address spaces.
+ */
+static void Read_Bits(modbus_handle_t *hmodbus, register_type_t type, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t bit_count = (request->data[2]<<8)+ request->data[3];
+	address_space_t *address_space;
+	uint16_t offset, count;
+	uint32_t position = 0;
+	uint32_t sequence, attempts;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	if(request->length < 4 || bit_count == 0 || bit_count > 2000)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Range(hmodbus->map, type, start_address, bit_count);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		response->data[0] = (bit_count+7)/8;	// byte count
+		memset(&response->data[1], 0, response->data[0]);	//unused bits of the last byte are zero
+
+		while(position < bit_count)
+		{
+			address_space = hmodbus->map->spaces[index++];
+			offset = start_address + position - address_space->start_offset;
+			count = address_space->size - offset;
+			if(count > bit_count - position)
+			{
+				count = bit_count - position;
+			}
+
+			MBR_Bit_Read_Callback(hmodbus, type, start_address + position, count);
+
+			attempts = 0;
+			do
+			{
+				if(attempts++ > MBR_SEQLOCK_RETRIES)
+				{
+					response->exception = slave_device_busy;
+					return;
+				}
+				sequence = MBR_Read_Begin(address_space);
+				Copy_Bits(&response->data[1], position, (const uint8_t*)address_space->address, offset, count);
+			} while(MBR_Read_Retry(address_space, sequence));
+
+			position += count;
+		}
+
+		response->length = 1 + response->data[0];
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+/**
+ * @brief Writing bit-packed values to coils found by Find_Address_Range, the range can span adjacent address spaces.
+ */
+static void Write_Bits(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t bit_count, const uint8_t *src)
+{
+	address_space_t *address_space;
+	uint16_t offset, count;
+	uint32_t position = 0;
+
+	while(position < bit_count)
+	{
+		address_space = hmodbus->map->spaces[index++];
+		offset = start_address + position - address_space->start_offset;
+		count = address_space->size - offset;
+		if(count > bit_count - position)
+		{
+			count = bit_count - position;
+		}
+
+		MBR_Begin_Update(address_space);
+		Copy_Bits((uint8_t*)address_space->address, offset, src, position, count);
+		MBR_End_Update(address_space);
+#if MBR_CHANGE_QUEUE_SIZE
+		Post_Change(hmodbus, address_space, start_address + position, count);
+#else
+		MBR_Coil_Update_Callback(hmodbus, start_address + position, count);
+#endif
+		position += count;
+	}
+#if MBR_CHANGE_QUEUE_SIZE
+	MBR_Change_Posted_Callback(hmodbus);
+#endif
+}
+
+/**
+ * @brief Copying bit strings, LSB first (Modbus order, which is also the order of bits in little-endian words).
+ * Up to 16 bits are moved at once, only the bytes which contain the bits are accessed.
+ * @param dst Destination, bits outside of the range are kept.
+ * @param dst_bit Position of the first bit in destination.
+ * @param src Source.
+ * @param src_bit Position of the first bit in source.
+ * @param count Number of bits.
+ */
+static void Copy_Bits(uint8_t *dst, uint32_t dst_bit, const uint8_t *src, uint32_t src_bit, uint32_t count)
+{
+	const uint8_t *s;
+	uint8_t *d;
+	uint32_t n, shift, value, mask;
+
+	for(; count; count -= n, src_bit += n, dst_bit += n)
+	{
+		n = (count > 16) ? 16 : count;
+
+		/*load n bits, they are spread over up to 3 bytes*/
+		s = &src[src_bit >> 3];
+		shift = src_bit & 7;
+		value = s[0];
+		if(shift + n > 8)
+		{
+			value |= s[1] << 8;
+		}
+		if(shift + n > 16)
+		{
+			value |= s[2] << 16;
+		}
+		value = (value >> shift) & ((1u << n) - 1);
+
+		/*store them with read-modify-write of the border bytes*/
+		d = &dst[dst_bit >> 3];
+		shift = dst_bit & 7;
+		value <<= shift;
+		mask = ((1u << n) - 1) << shift;
+		d[0] = (d[0] & ~mask) | value;
+		if(shift + n > 8)
+		{
+			d[1] = (d[1] & ~(mask >> 8)) | (value >> 8);
+		}
+		if(shift + n > 16)
+		{
+			d[2] = (d[2] & ~(mask >> 16)) | (value >> 16);
+		}
+	}
+}
+
+#if MBR_SEQLOCK_RETRIES
+/**
+ * @brief Addition which is not lost when the writer is interrupted by another one (interrupt, RTOS task, thread).
+ * Cortex-M3 and newer retry LDREX/STREX, Cortex-M0 has no exclusive access and masks interrupts for the addition.
+ */
+static void Atomic_Add(volatile uint32_t *value, uint32_t addend)
+{
+#if defined(MBR_HOST_BUILD)
+	__atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+#elif defined(__ARM_ARCH) && (__ARM_ARCH >= 7)
+	uint32_t sum;
+
+	do
+	{
+		sum = __LDREXW(value) + addend;
+	} while(__STREXW(sum, value));
+#else
+	uint32_t primask = __get_PRIMASK();
+
+	__disable_irq();
+	*value += addend;
+	__set_PRIMASK(primask);
+#endif
+}
+#endif
+
+/**
+ * @brief Mask write: register = (register AND and_mask) OR (or_mask AND NOT and_mask), in one transaction.
+ */
+static void Mask_Write_Register(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t start_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t and_mask = (request->data[2]<<8)+ request->data[3];
+	uint16_t or_mask = (request->data[4]<<8)+ request->data[5];
+	uint16_t reg_data;
+	address_space_t *address_space;
+	int32_t index;
+	PROFILE_BEGIN(timestamp);
+
+	if(request->length < 6)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	index = Find_Address_Space(hmodbus->map, holding_registers, start_address);
+	response->exception = (index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		address_space = hmodbus->map->spaces[index];
+		reg_data = address_space->address[start_address - address_space->start_offset];
+		reg_data = (reg_data & and_mask) | (or_mask & ~and_mask);
+
+		if(MBR_Check_Range_Restrictions_Callback(hmodbus, start_address, 1, &reg_data))
+		{
+			response->exception = illegal_data_value;
+		}
+		else
+		{
+			Store_Registers(hmodbus, index, start_address, 1, &reg_data);
+
+			memcpy(response->data, request->data, 6);	//the request is echoed
+			response->length = 6;
+		}
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+/**
+ * @brief Write followed by read in one transaction. Both ranges are validated before anything is written,
+ * registers are read after the write (the read range can overlap the written one).
+ */
+static void Read_Write_Multiple_Registers(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint16_t read_address = (request->data[0]<<8)+ request->data[1];
+	uint16_t read_count = (request->data[2]<<8)+ request->data[3];
+	uint16_t write_address = (request->data[4]<<8)+ request->data[5];
+	uint16_t write_count = (request->data[6]<<8)+ request->data[7];
+	uint16_t *registers;
+	int32_t read_index, write_index;
+	PROFILE_BEGIN(timestamp);
+
+	if(read_count == 0 || read_count > 125 || write_count == 0 || write_count > 121 || request->data[8] != write_count*2 || request->length < 9 + write_count*2)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	read_index = Find_Address_Range(hmodbus->map, holding_registers, read_address, read_count);
+	write_index = Find_Address_Range(hmodbus->map, holding_registers, write_address, write_count);
+	response->exception = (read_index < 0 || write_index < 0) ? illegal_data_address : 0x00;
+
+	PROFILE_STAGE(profile_lookup, timestamp);
+
+	if(response->exception == 0)
+	{
+		registers = Decode_Registers_In_Place(&request->data[9], write_count);	//buf+1 is halfword aligned as in FC16
+
+		if(MBR_Check_Range_Restrictions_Callback(hmodbus, write_address, write_count, registers))
+		{
+			response->exception = illegal_data_value;
+		}
+	}
+
+	if(response->exception == 0)
+	{
+		Store_Registers(hmodbus, write_index, write_address, write_count, registers);
+
+		response->data[0] = read_count*2;	// byte count
+		if(Encode_Registers(hmodbus, read_index, read_address, read_count, &response->data[1]))
+		{
+			response->exception = slave_device_busy;	//application keeps updating the registers
+		}
+		response->length = 1 + response->data[0];
+	}
+
+	PROFILE_STAGE(profile_encode, timestamp);
+}
+
+/**
+ * @brief Writing validated registers to the address spaces found by Find_Address_Range, the range can span adjacent address spaces.
+ */
+static void Store_Registers(modbus_handle_t *hmodbus, int32_t index, uint16_t start_address, uint16_t register_count, const uint16_t *registers)
+{
+	address_space_t *address_space;
+	uint16_t offset, count;
+
+	for(uint32_t i = 0; i < register_count; index++)
+	{
+		address_space = hmodbus->map->spaces[index];
+		offset = start_address + i - address_space->start_offset;
+		count = address_space->size - offset;
+		if(count > register_count - i)
+		{
+			count = register_count - i;
+		}
+
+		MBR_Begin_Update(address_space);
+		memcpy(&address_space->address[offset], &registers[i], count*2);
+		MBR_End_Update(address_space);
+#if MBR_CHANGE_QUEUE_SIZE
+		Post_Change(hmodbus, address_space, start_address+i, count);
+#else
+		MBR_Register_Range_Update_Callback(hmodbus, start_address+i, count, &address_space->address[offset]);
+#endif
+		i += count;
+	}
+#if MBR_CHANGE_QUEUE_SIZE
+	MBR_Change_Posted_Callback(hmodbus);
+#endif
+}
+
+#if MBR_CHANGE_QUEUE_SIZE
+/**
+ * @brief Posting the written range to the change queue (producer side), the response is not delayed by the application.
+ * When the queue is full the change is counted as lost, the application is then told to re-read all spaces.
+ */
+static void Post_Change(modbus_handle_t *hmodbus, address_space_t *address_space, uint16_t start_address, uint16_t count)
+{
+	uint32_t head = hmodbus->change_head;
+	change_t *change;
+
+	if(head - hmodbus->change_tail >= MBR_CHANGE_QUEUE_SIZE)
+	{
+		hmodbus->changes_lost++;
+		return;
+	}
+
+	change = &hmodbus->changes[head & (MBR_CHANGE_QUEUE_SIZE - 1)];
+	change->address_space = address_space;
+	change->start_address = start_address;
+	change->count = count;
+	MBR_MEMORY_BARRIER();	//entry is complete before it is published
+	hmodbus->change_head = head + 1;
+}
+#endif
+
+/**
+ * @brief FC08 Diagnostics (serial line sub-functions), counters are taken from the statistics of the handle.
+ * The sub-function and data are echoed, the counters are returned in place of the data.
+ */
+static void Diagnostics(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	statistics_t *statistics = &hmodbus->statistics;
+	uint16_t sub_function;
+	uint32_t value = 0;
+	uint8_t flg_value = 1;
+
+	if(request->length < 2)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	sub_function = (request->data[0]<<8) + request->data[1];
+	if(sub_function != return_query_data && request->length != 4)
+	{
+		response->exception = illegal_data_value;
+		return;
+	}
+
+	memmove(response->data, request->data, request->length);
+	response->length = request->length;
+
+	switch(sub_function)
+	{
+	case return_query_data:
+		flg_value = 0;
+		break;
+	case restart_communications:
+		if(hmodbus->flg_listen_only)	//no response when leaving listen only mode
+		{
+			response->flg_response = 0;
+		}
+		hmodbus->flg_listen_only = 0;
+		memset(statistics, 0, sizeof(statistics_t));
+		flg_value = 0;
+		break;
+	case return_diagnostic_register:
+		break;
+	case force_listen_only_mode:
+		hmodbus->flg_listen_only = 1;
+		response->flg_response = 0;
+		flg_value = 0;
+		break;
+	case clear_counters:
+		memset(statistics, 0, sizeof(statistics_t));
+		flg_value = 0;
+		break;
+	case return_bus_message_count:
+		value = statistics->bus_messages;
+		break;
+	case return_bus_communication_error_count:
+		value = statistics->crc_errors;
+		break;
+	case return_bus_exception_error_count:
+		value = statistics->exceptions;
+		break;
+	case return_slave_message_count:
+		value = statistics->slave_messages;
+		break;
+	case return_slave_no_response_count:
+		value = statistics->no_responses;
+		break;
+	case return_slave_nak_count:
+		value = statistics->exception_codes[negative_acknowledgement];
+		break;
+	case return_slave_busy_count:
+		value = statistics->exception_codes[slave_device_busy];
+		break;
+	case return_bus_character_overrun_count:
+		value = statistics->overruns;
+		break;
+	case clear_overrun_counter:
+		statistics->overruns = 0;
+		flg_value = 0;
+		break;
+#ifdef MBR_PROFILING
+	case return_turnaround_percentile:
+		value = MBR_Get_Turnaround_Percentile(hmodbus, request->data[3]);
+		response->data[2] = value>>24;
+		response->data[3] = value>>16;
+		response->data[4] = value>>8;
+		response->data[5] = value;
+		response->length = 6;
+		flg_value = 0;
+		break;
+#endif
+	default:
+		response->exception = illegal_function;	//sub-function is not supported
+		return;
+	}
+
+	if(flg_value)
+	{
+		response->data[2] = value>>8;	//counters are 16-bit on the wire
+		response->data[3] = value;
+	}
+}
+
+/**
+ * @brief Default handler of function codes without registered handler, it calls MBR_Custom_Command_Callback
+ * with the whole frame copied to the response buffer (the response is built in place).
+ */
+static void Custom_Command(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	uint8_t *frame = response->data - 2;	//address and function code precede the response data
+	response_t response_s = {0, 0, response->flg_response};
+
+	UNUSED(hmodbus);
+
+	memmove(&frame[2], request->data, request->length);
+	MBR_Custom_Command_Callback(frame, &response_s);
+
+	response->exception = response_s.exception;
+	response->length = (response_s.payload_size > 2) ? response_s.payload_size - 2 : 0;
+	response->flg_response = response_s.flg_response;
+}
+
+/**
+ * @brief Calling the handler of the function code and counting the result.
+ * In listen only mode only the restart communications option (FC08) is executed.
+ */
+static void Execute_Command(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response)
+{
+	statistics_t *statistics = &hmodbus->statistics;
+#ifdef MBR_PROFILING
+	uint32_t timestamp = MBR_PROFILE_TIMESTAMP();
+#endif
+
+	statistics->slave_messages++;
+
+	if(hmodbus->flg_listen_only && !(request->function == diagnostics && request->length == 4 && request->data[0] == 0x00 && request->data[1] == restart_communications))
+	{
+		response->flg_response = 0;
+	}
+	else
+	{
+		hmodbus->commands[request->function](hmodbus, request, response);
+	}
+
+#ifdef MBR_PROFILING
+	Profile_Function(hmodbus, request->function, MBR_PROFILE_TIMESTAMP() - timestamp);
+#endif
+
+	if(response->flg_response == 0)
+	{
+		statistics->no_responses++;
+	}
+	else if(response->exception)
+	{
+		statistics->exceptions++;
+		statistics->exception_codes[response->exception & 0x0F]++;
+	}
+}
+
+static void Process_Request(modbus_handle_t *hmodbus)
+{
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	uint8_t *buf_modbus_tx = hmodbus->buf_modbus_tx;
+	modbus_request_t request;
+	modbus_response_t response;
+
+#if MBR_RESPONSE_CACHE_SIZE
+	if(!hmodbus->flg_listen_only && Send_Cached_Response(hmodbus) == 0)	//unchanged registers, the response is sent from the cache
+	{
+		hmodbus->statistics.slave_messages++;
+		return;
+	}
+#endif
+
+	request.address = buf_modbus[0];
+	request.function = buf_modbus[1];
+	request.data = &buf_modbus[2];
+	request.length = hmodbus->len_modbus_frame - 4;	//address, function code and CRC
+
+	response.data = &buf_modbus_tx[2];
+	response.max_length = MODBUS_BUFFER_SIZE - 4;
+	response.length = 0;
+	response.exception = 0;
+	response.flg_response = (buf_modbus[0] != 0x00);	//no response to broadcast
+
+	buf_modbus_tx[0] = buf_modbus[0];	//address
+	buf_modbus_tx[1] = buf_modbus[1];	//function code
+
+	Execute_Command(hmodbus, &request, &response);
+
+	if(response.flg_response)
+	{
+		if(response.exception)
+		{
+			Send_Exeption(hmodbus, response.exception);
+		}
+		else
+		{
+			Send_Response(hmodbus, 2 + response.length);	// Send packet response
+#if MBR_RESPONSE_CACHE_SIZE
+			Store_Cached_Response(hmodbus, 2 + response.length);
+#endif
+		}
+	}
+}
+
+#if MBR_CLIENT_POLLS
+/**
+ * @brief Master mode scheduler: processes received responses, handles timeouts and sends the next request.
+ * The next request is prepared in the TX buffer while waiting for the response, so it is sent as soon as the
+ * response has been received (the receiver timeout already guarantees the inter-frame gap).
+ */
+static void Client_Process(modbus_handle_t *hmodbus)
+{
+	client_t *client = &hmodbus->client;
+	client_slave_t *slave;
+	uint32_t now;
+
+	while(hmodbus->rx_tail != hmodbus->rx_head)
+	{
+		hmodbus->buf_modbus = hmodbus->buf_modbus_rx[hmodbus->rx_tail];
+		hmodbus->len_modbus_frame = hmodbus->len_modbus_rx[hmodbus->rx_tail];
+
+		if(client->current >= 0 && hmodbus->flg_tx_busy == 0)
+		{
+			Client_Check_Response(hmodbus);
+		}
+
+		hmodbus->rx_tail = (hmodbus->rx_tail + 1) % MBR_RX_SLOTS;
+	}
+
+	if(hmodbus->flg_tx_busy)
+	{
+		return;
+	}
+
+	now = HAL_GetTick();
+
+	if(client->current >= 0)
+	{
+		slave = &client->slaves[client->polls[client->current].slave];
+		if(now - client->request_time < slave->timeout)
+		{
+			if(client->prepared < 0)	//pipelining: the next request is ready before the response arrives
+			{
+				Client_Prepare_Request(hmodbus, Client_Select_Poll(client, now));
+			}
+			return;
+		}
+
+		if(slave->failures < 0xFF)
+		{
+			slave->failures++;
+		}
+		if(slave->failures >= MBR_CLIENT_RETRIES)	//dead slave is skipped for a while, so it does not stall the cycle
+		{
+			slave->retry_time = now + ((uint32_t)MBR_CLIENT_BACKOFF << ((slave->failures - MBR_CLIENT_RETRIES < 4) ? slave->failures - MBR_CLIENT_RETRIES : 4));
+		}
+		Client_Poll_Done(hmodbus, poll_timeout);
+	}
+
+	if(client->prepared >= 0 && client->slaves[client->polls[client->prepared].slave].failures >= MBR_CLIENT_RETRIES
+			&& (int32_t)(client->slaves[client->polls[client->prepared].slave].retry_time - now) > 0)
+	{
+		client->next = client->prepared;	//slave of the prepared request has been backed off meanwhile
+		client->prepared = -1;
+	}
+
+	if(client->prepared < 0)
+	{
+		Client_Prepare_Request(hmodbus, Client_Select_Poll(client, now));
+		if(client->prepared < 0)	//nothing to poll (empty list or all slaves backed off)
+		{
+			return;
+		}
+	}
+
+	if(client->flg_new_cycle)
+	{
+		client->flg_new_cycle = 0;
+		MBR_Poll_Cycle_Callback(hmodbus);
+	}
+
+	client->current = client->prepared;
+	client->prepared = -1;
+	client->request_time = now;
+	client->sent_len = client->tx_len;
+	client->sent_crc[0] = hmodbus->buf_modbus_tx[client->tx_len-2];
+	client->sent_crc[1] = hmodbus->buf_modbus_tx[client->tx_len-1];
+
+	MBR_Start_Sending_Callback(hmodbus->huart);
+	hmodbus->flg_tx_busy = 1;
+	HAL_UART_Transmit_DMA(hmodbus->huart, hmodbus->buf_modbus_tx, client->tx_len);
+}
+
+/**
+ * @brief Finding the slave in the slave table, a new entry is created for unknown slave.
+ * @retval index in the slave table, -1 when the table is full
+ */
+static int32_t Client_Find_Slave(client_t *client, uint8_t slave_id)
+{
+	for(uint32_t i=0; i<client->slave_count; i++)
+	{
+		if(client->slaves[i].slave_id == slave_id)
+		{
+			return i;
+		}
+	}
+
+	if(client->slave_count >= MBR_CLIENT_SLAVES)
+	{
+		return -1;
+	}
+
+	memset(&client->slaves[client->slave_count], 0, sizeof(client_slave_t));
+	client->slaves[client->slave_count].slave_id = slave_id;
+	client->slaves[client->slave_count].timeout = MBR_CLIENT_TIMEOUT;
+
+	return client->slave_count++;
+}
+
+/**
+ * @brief Selecting the next poll in round robin order, polls of backed off slaves are skipped.
+ * @retval poll index, -1 when there is nothing to poll
+ */
+static int32_t Client_Select_Poll(client_t *client, uint32_t now)
+{
+	client_slave_t *slave;
+	uint32_t poll;
+
+	for(uint32_t i=0; i<client->poll_count; i++)
+	{
+		poll = (client->next + i) % client->poll_count;
+		slave = &client->slaves[client->polls[poll].slave];
+
+		if(slave->failures < MBR_CLIENT_RETRIES || (int32_t)(slave->retry_time - now) <= 0)
+		{
+			if((int32_t)poll <= client->selected)	//end of the list has been passed
+			{
+				client->flg_new_cycle = 1;
+			}
+			client->selected = poll;
+			client->next = (poll + 1) % client->poll_count;
+			return poll;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * @brief Time until the scheduler has to run without an event: response timeout or the end of the back-off.
+ * @retval time [ms], MBR_WAIT_FOREVER when only events are expected
+ */
+static uint32_t Client_Get_Wait_Time(modbus_handle_t *hmodbus, uint32_t now)
+{
+	client_t *client = &hmodbus->client;
+	client_slave_t *slave;
+	uint32_t elapsed, wait = MBR_WAIT_FOREVER;
+
+	if(hmodbus->flg_tx_busy || client->poll_count == 0)	//end of transmission is an event
+	{
+		return MBR_WAIT_FOREVER;
+	}
+
+	if(client->current >= 0)
+	{
+		slave = &client->slaves[client->polls[client->current].slave];
+		elapsed = now - client->request_time;
+		return (elapsed < slave->timeout) ? slave->timeout - elapsed : 0;
+	}
+
+	for(uint32_t i=0; i<client->poll_count; i++)	//nothing is pending: slaves of all polls are backed off
+	{
+		slave = &client->slaves[client->polls[i].slave];
+		if(slave->failures < MBR_CLIENT_RETRIES || (int32_t)(slave->retry_time - now) <= 0)
+		{
+			return 0;
+		}
+		if(slave->retry_time - now < wait)
+		{
+			wait = slave->retry_time - now;
+		}
+	}
+
+	return wait;
+}
+
+/**
+ * @brief Building the request of the poll in the TX buffer.
+ */
+static void Client_Prepare_Request(modbus_handle_t *hmodbus, int32_t poll)
+{
+	client_t *client = &hmodbus->client;
+	client_poll_t *p;
+	uint8_t *buf_modbus_tx = hmodbus->buf_modbus_tx;
+	uint8_t len = 6;
+	uint16_t crc16;
+
+	if(poll < 0)
+	{
+		return;
+	}
+
+	p = &client->polls[poll];
+	buf_modbus_tx[0] = client->slaves[p->slave].slave_id;
+	buf_modbus_tx[1] = p->function;
+	buf_modbus_tx[2] = p->start_address>>8;
+	buf_modbus_tx[3] = p->start_address;
+	buf_modbus_tx[4] = p->count>>8;
+	buf_modbus_tx[5] = p->count;
+
+	if(p->function == write_multiple_registers)
+	{
+		buf_modbus_tx[6] = p->count*2;
+		Swap_Registers(&buf_modbus_tx[7], (const uint8_t*)p->data, p->count);
+		len = 7 + p->count*2;
+	}
+
+	crc16 = Frame_CRC16(hmodbus, buf_modbus_tx, len);
+	buf_modbus_tx[len] = crc16;
+	buf_modbus_tx[len+1] = crc16>>8;
+
+	client->tx_len = len + 2;
+	client->prepared = poll;
+}
+
+/**
+ * @brief Checking the received frame against the current poll and storing the data.
+ * Frames of other slaves (late responses) and the echo of the request are ignored.
+ */
+static void Client_Check_Response(modbus_handle_t *hmodbus)
+{
+	client_t *client = &hmodbus->client;
+	client_poll_t *p = &client->polls[client->current];
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	uint8_t len = hmodbus->len_modbus_frame;
+	uint8_t byte_count;
+
+	if(Calculate_CRC16(buf_modbus, len) != 0)	//CRC of the frame including its CRC bytes is 0 for a valid frame
+	{
+		return;
+	}
+
+	if(buf_modbus[0] != client->slaves[p->slave].slave_id || (buf_modbus[1] & ~exception) != p->function)
+	{
+		return;
+	}
+
+	if(len == client->sent_len && buf_modbus[len-2] == client->sent_crc[0] && buf_modbus[len-1] == client->sent_crc[1])	//RS-485 echo
+	{
+		return;
+	}
+
+	client->slaves[p->slave].failures = 0;
+	Set_Communication_Ok(hmodbus);
+
+	if(buf_modbus[1] & exception)
+	{
+		Client_Poll_Done(hmodbus, (len == 5) ? buf_modbus[2] : poll_invalid_response);
+		return;
+	}
+
+	byte_count = buf_modbus[2];
+	switch(p->function)
+	{
+	case read_coils:
+	case read_discrete_inputs:
+		if(byte_count != (p->count+7)/8 || len != 5 + byte_count)
+		{
+			Client_Poll_Done(hmodbus, poll_invalid_response);
+			return;
+		}
+#if MBR_CLIENT_TAGS
+		if(p->tag_count)	//scattered straight from the frame
+		{
+			for(client_tag_t *tag = &client->tags[p->first_tag]; tag < &client->tags[p->first_tag + p->tag_count]; tag++)
+			{
+				Copy_Bits((uint8_t*)tag->data, 0, &buf_modbus[3], tag->address - p->start_address, tag->length);
+			}
+			break;
+		}
+#endif
+		Copy_Bits((uint8_t*)p->data, 0, &buf_modbus[3], 0, p->count);
+		break;
+
+	case read_holding_registers:
+	case read_input_registers:
+		if(byte_count != p->count*2 || len != 5 + byte_count)
+		{
+			Client_Poll_Done(hmodbus, poll_invalid_response);
+			return;
+		}
+#if MBR_CLIENT_TAGS
+		if(p->tag_count)
+		{
+			for(client_tag_t *tag = &client->tags[p->first_tag]; tag < &client->tags[p->first_tag + p->tag_count]; tag++)
+			{
+				Swap_Registers((uint8_t*)tag->data, &buf_modbus[3 + (tag->address - p->start_address)*2], tag->length);
+			}
+			break;
+		}
+#endif
+		Swap_Registers((uint8_t*)p->data, &buf_modbus[3], p->count);
+		break;
+
+	default:	//write_multiple_registers, start address and count are echoed
+		if(len != 8 || ((buf_modbus[2]<<8) | buf_modbus[3]) != p->start_address || ((buf_modbus[4]<<8) | buf_modbus[5]) != p->count)
+		{
+			Client_Poll_Done(hmodbus, poll_invalid_response);
+			return;
+		}
+	}
+
+	Client_Poll_Done(hmodbus, poll_ok);
+}
+
+static void Client_Poll_Done(modbus_handle_t *hmodbus, uint8_t status)
+{
+	client_t *client = &hmodbus->client;
+	int32_t poll = client->current;
+
+	client->current = -1;
+
+	MBR_Poll_Result_Callback(hmodbus, poll, status);
+}
+
+#if MBR_CLIENT_TAGS
+static int Compare_Tags(const void *a, const void *b)
+{
+	const client_tag_t *tag_a = a;
+	const client_tag_t *tag_b = b;
+
+	if(tag_a->slave_id != tag_b->slave_id)
+	{
+		return tag_a->slave_id - tag_b->slave_id;
+	}
+	if(tag_a->type != tag_b->type)
+	{
+		return (int)tag_a->type - (int)tag_b->type;
+	}
+	return (int)tag_a->address - (int)tag_b->address;
+}
+#endif
+#endif
+
+#if MBR_RESPONSE_CACHE_SIZE
+/**
+ * @brief Sending the cached response when the same read request has been answered before and the registers have not changed.
+ * Read callbacks are not called for cached responses.
+ * @retval 0 = response has been sent, 1 = request has to be processed
+ */
+static uint8_t Send_Cached_Response(modbus_handle_t *hmodbus)
+{
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	response_cache_t *entry;
+	uint32_t version;
+
+	if(buf_modbus[1] != read_holding_registers && buf_modbus[1] != read_input_registers)
+	{
+		return 1;
+	}
+
+	for(uint32_t i=0; i<MBR_RESPONSE_CACHE_SIZE; i++)
+	{
+		entry = &hmodbus->cache[i];
+		if(entry->len == 0 || memcmp(entry->request, buf_modbus, 6))
+		{
+			continue;
+		}
+
+		if(entry->map_version != hmodbus->map->version)
+		{
+			entry->len = 0;
+			return 1;
+		}
+
+		version = 0;
+		for(uint32_t j=entry->index; j<(uint32_t)entry->index+entry->spaces; j++)
+		{
+			version += hmodbus->map->spaces[j]->version;
+		}
+
+		if(version != entry->version)
+		{
+			entry->len = 0;
+			return 1;
+		}
+
+#ifdef MBR_PROFILING
+		Profile_Turnaround(hmodbus, MBR_PROFILE_TIMESTAMP() - hmodbus->frame_end_timestamp);
+#endif
+		MBR_Start_Sending_Callback(hmodbus->huart);
+		hmodbus->flg_tx_busy = 1;
+		HAL_UART_Transmit_DMA(hmodbus->huart, entry->frame, entry->len);	//entry is not replaced before the transmission ends
+		return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Storing the response of a read request (including CRC), the oldest entry is replaced.
+ */
+static void Store_Cached_Response(modbus_handle_t *hmodbus, uint8_t payload_size)
+{
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	response_cache_t *entry;
+
+	if((buf_modbus[1] != read_holding_registers && buf_modbus[1] != read_input_registers) || buf_modbus[0] == 0x00)
+	{
+		return;
+	}
+
+	entry = &hmodbus->cache[hmodbus->cache_next];
+	hmodbus->cache_next = (hmodbus->cache_next + 1) % MBR_RESPONSE_CACHE_SIZE;
+
+	memcpy(entry->request, buf_modbus, 6);
+	memcpy(entry->frame, hmodbus->buf_modbus_tx, payload_size+2);
+	entry->index = hmodbus->cache_fill.index;
+	entry->spaces = hmodbus->cache_fill.spaces;
+	entry->version = hmodbus->cache_fill.version;
+	entry->map_version = hmodbus->map->version;
+	entry->len = payload_size+2;
+}
+#endif
+
 static void Send_Response(modbus_handle_t *hmodbus, uint8_t payload_size)
 {
+	uint8_t *buf_modbus_tx = hmodbus->buf_modbus_tx;
 	uint16_t crc16;
+	PROFILE_BEGIN(timestamp);
+
+	crc16 = Frame_CRC16(hmodbus, buf_modbus_tx, payload_size);
+	buf_modbus_tx[payload_size] = crc16;								// CRC Lo byte
+	buf_modbus_tx[payload_size+1] = crc16>>8;							// CRC Hi byte
 
-	crc16 = Calculate_CRC16(buf_modbus, payload_size);
-	buf_modbus[payload_size] = crc16;									// CRC Lo byte
-	buf_modbus[payload_size+1] = crc16>>8;								// CRC Hi byte
+	PROFILE_STAGE(profile_crc_append, timestamp);
+#ifdef MBR_PROFILING
+	Profile_Turnaround(hmodbus, timestamp - hmodbus->frame_end_timestamp);
+#endif
 
 	MBR_Start_Sending_Callback(hmodbus->huart);
-	HAL_UART_Transmit_DMA(hmodbus->huart, buf_modbus, payload_size+2);
+	hmodbus->flg_tx_busy = 1;
+	HAL_UART_Transmit_DMA(hmodbus->huart, buf_modbus_tx, payload_size+2);
+}
+
+#ifdef MBR_RX_STREAMING_CRC
+static uint8_t Get_Received_Length(UART_HandleTypeDef *huart)
+{
+	return MODBUS_BUFFER_SIZE - huart->hdmarx->Instance->CNDTR;
+}
+
+/**
+ * @brief Folding bytes hmodbus->rx_crc_position..received-1 of the slot filled by DMA into the running CRC.
+ * Main loop can be interrupted by ISR, so the folding is skipped when it is already in progress.
+ * The received length is read only after the folding is owned and a pending reset is applied: when the frame end
+ * interrupt re-arms DMA meanwhile, it sets flg_rx_crc_reset and bytes folded from the new slot are discarded
+ * by the next call.
+ */
+static void Fold_Received_Bytes(modbus_handle_t *hmodbus)
+{
+	uint8_t received;
+
+	if(hmodbus->flg_rx_crc_busy)
+	{
+		return;
+	}
+	hmodbus->flg_rx_crc_busy = 1;
+
+	if(hmodbus->flg_rx_crc_reset)
+	{
+		hmodbus->flg_rx_crc_reset = 0;
+		hmodbus->rx_crc = MBR_CRC16_INIT;
+		hmodbus->rx_crc_position = 0;
+	}
+
+	received = Get_Received_Length(hmodbus->huart);
+	if(received > hmodbus->rx_crc_position)
+	{
+		hmodbus->rx_crc = MBR_CRC16_Update_ISR(hmodbus->rx_crc, &hmodbus->buf_modbus_rx[hmodbus->rx_head][hmodbus->rx_crc_position], received - hmodbus->rx_crc_position);
+		hmodbus->rx_crc_position = received;
+	}
+
+	hmodbus->flg_rx_crc_busy = 0;
 }
+#endif
 
 static void Send_Exeption(modbus_handle_t *hmodbus, uint8_t exeption_code)
 {
-	buf_modbus[0] = communication_slave_id;		// Device address
-	buf_modbus[1] += exception;					// Modbus error code (0x80+command)
-	buf_modbus[2] = exeption_code;				// exception code
+	uint8_t *buf_modbus = hmodbus->buf_modbus;
+	uint8_t *buf_modbus_tx = hmodbus->buf_modbus_tx;
+	buf_modbus_tx[0] = buf_modbus[0];			// Device address (slave id or other served unit id)
+	buf_modbus_tx[1] = buf_modbus[1] | exception;	// Modbus error code (0x80+command)
+	buf_modbus_tx[2] = exeption_code;			// exception code
 
 	Send_Response(hmodbus, 3);					// Send frame
 }
 
+/**
+ * @brief Restarting the communication lost timer after a valid frame.
+ */
+static void Set_Communication_Ok(modbus_handle_t *hmodbus)
+{
+	hmodbus->last_communication_time = HAL_GetTick();
+
+	if(hmodbus->flg_modbus_no_comm)
+	{
+#if MBR_ISR_FAST_PATH
+		if(hmodbus->flg_isr_context)	//application callback is deferred to MBR_Check_For_Request
+		{
+			hmodbus->flg_comm_restored = 1;
+			MBR_Wakeup_Callback(hmodbus);
+			return;
+		}
+#endif
+		hmodbus->flg_modbus_no_comm = 0;
+		MBR_Communication_Restored_Callback(hmodbus);
+	}
+}
+
+static void Check_Communication(modbus_handle_t *hmodbus)
+{
+#if MBR_ISR_FAST_PATH
+	if(hmodbus->flg_comm_restored)
+	{
+		hmodbus->flg_comm_restored = 0;
+		if(hmodbus->flg_modbus_no_comm)
+		{
+			hmodbus->flg_modbus_no_comm = 0;
+			MBR_Communication_Restored_Callback(hmodbus);
+		}
+	}
+#endif
+
+	if(hmodbus->flg_modbus_no_comm || hmodbus->comm_timeout == 0)
+	{
+		return;
+	}
+
+	if(HAL_GetTick() - hmodbus->last_communication_time >= hmodbus->comm_timeout)	//unsigned difference handles tick overflow
+	{
+		hmodbus->flg_modbus_no_comm = 1;
+		MBR_Communication_Lost_Callback(hmodbus);
+	}
+}
+
+/**
+ * @brief CRC16 of a frame, the interrupt safe engine is used when the frame is processed in the interrupt.
+ */
+static uint16_t Frame_CRC16(modbus_handle_t *hmodbus, uint8_t *buf, uint16_t len)
+{
+#if MBR_ISR_FAST_PATH
+	if(hmodbus->flg_isr_context)
+	{
+		return MBR_CRC16_Final(MBR_CRC16_Update_ISR(MBR_CRC16_INIT, buf, len));
+	}
+#endif
+	UNUSED(hmodbus);
+	return Calculate_CRC16(buf, len);
+}
+
+#if MBR_ISR_FAST_PATH
+/**
+ * @brief Checking that the request can be answered in the interrupt: valid FC03/FC04/FC06 with the built-in handler
+ * for address spaces with ISR access only. Unknown addresses, overridden handlers and other function codes are queued,
+ * exceptions raised by the handler itself (rejected by the restriction callback, slave_device_busy) are sent from the interrupt.
+ * @retval 1 = fast path, 0 = task context
+ */
+static uint8_t Is_Fast_Request(modbus_handle_t *hmodbus, const uint8_t *frame, uint8_t len)
+{
+	address_map_t *map = Select_Map(hmodbus, frame[0]);
+	register_type_t type;
+	command_handler_t handler;
+	uint16_t start_address = (frame[2]<<8) + frame[3];
+	uint16_t register_count = (frame[4]<<8) + frame[5];
+	uint32_t end;
+	int32_t index;
+
+	if(len != 8 || map == NULL || hmodbus->mode != slave_mode || hmodbus->flg_listen_only)
+	{
+		return 0;
+	}
+
+	switch(frame[1])
+	{
+	case read_holding_registers:
+		type = holding_registers;
+		handler = Read_Holding_Registers;
+		break;
+	case read_input_registers:
+		type = input_registers;
+		handler = Read_Input_Registers;
+		break;
+	case write_single_register:
+		type = holding_registers;
+		handler = Write_Single_Register;
+		register_count = 1;
+		break;
+	default:
+		return 0;
+	}
+
+	if(register_count == 0 || register_count > 125 || hmodbus->commands[frame[1]] != handler)
+	{
+		return 0;
+	}
+
+	index = Find_Address_Range(map, type, start_address, register_count);
+	if(index < 0)
+	{
+		return 0;
+	}
+
+	end = (uint32_t)start_address + register_count;
+	for(; index < map->first[type+1] && map->spaces[index]->start_offset < end; index++)
+	{
+		if(map->spaces[index]->flg_isr_access == 0)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+#endif
+
 void MBR_Set_Communication_Parameters(modbus_handle_t *hmodbus, uint8_t slave_id, uint8_t baudrate, uint8_t parity)
 {
 	UART_HandleTypeDef *huart;
@@ -601,35 +3620,39 @@ void MBR_Set_Communication_Parameters(modbus_handle_t *hmodbus, uint8_t slave_id
 	hmodbus->init.baudrate = baudrate;
 	hmodbus->init.parity = parity;
 
+	if(huart == NULL)	//handle without UART
+	{
+		return;
+	}
+
 	switch(hmodbus->init.baudrate)
 	{
 	case 0:
 		huart->Init.BaudRate = 4800;
-		HAL_UART_ReceiverTimeout_Config(huart, 39);
 		break;
 	case 1:
 		huart->Init.BaudRate = 9600;
-		HAL_UART_ReceiverTimeout_Config(huart, 39);
 		break;
 	case 2:
 		huart->Init.BaudRate = 19200;
-		HAL_UART_ReceiverTimeout_Config(huart, 39);
 		break;
 	case 3:
 		huart->Init.BaudRate = 38400;
-		HAL_UART_ReceiverTimeout_Config(huart, 67);
 		break;
 	case 4:
 		huart->Init.BaudRate = 57600;
-		HAL_UART_ReceiverTimeout_Config(huart, 101);
 		break;
 	case 5:
 		huart->Init.BaudRate = 115200;
-		HAL_UART_ReceiverTimeout_Config(huart, 202);
 		break;
 	case 6:
 		huart->Init.BaudRate = 230400;
-		HAL_UART_ReceiverTimeout_Config(huart, 403);
+		break;
+	case 7:
+		huart->Init.BaudRate = 460800;
+		break;
+	case 8:
+		huart->Init.BaudRate = 921600;
 		break;
 	} //default is 19200
 
@@ -650,8 +3673,181 @@ void MBR_Set_Communication_Parameters(modbus_handle_t *hmodbus, uint8_t slave_id
 		break;
 	} //default is even parity
 
+	Restart_UART(hmodbus);
+}
+
+/**
+ * @brief Setting any baud rate (e.g. 1000000 or more), receiver timeout is derived from the baud rate and frame format.
+ * @param hmodbus Modbus handle.
+ * @param baudrate Baud rate supported by the UART clock.
+ * @retval none
+ */
+void MBR_Set_Baud_Rate(modbus_handle_t *hmodbus, uint32_t baudrate)
+{
+	if(hmodbus->huart == NULL || baudrate == 0)
+	{
+		return;
+	}
+
+	hmodbus->huart->Init.BaudRate = baudrate;
+	Restart_UART(hmodbus);
+}
+
+/**
+ * @brief Setting shorter (or longer) end of frame detection than t3.5, e.g. for point-to-point links without
+ * other devices on the line. Shorter gap means faster turnaround, but a pause inside the frame splits it.
+ * @param hmodbus Modbus handle.
+ * @param gap_bits Receiver timeout in bit times (counted from the end of the last stop bit), 0 = standard t3.5 (1.75 ms above 19200 Bd).
+ * @retval none
+ */
+void MBR_Set_Frame_Gap(modbus_handle_t *hmodbus, uint32_t gap_bits)
+{
+	hmodbus->frame_gap_bits = (gap_bits > 0xFFFFFF) ? 0xFFFFFF : gap_bits;	//24-bit RTO field
+
+	if(hmodbus->huart != NULL)
+	{
+		Configure_Timing(hmodbus);
+	}
+}
+
+/**
+ * @brief Getting the timing derived from the baud rate and frame format.
+ * @param hmodbus Modbus handle.
+ * @param t15_us Inter-character timeout t1.5 [us], can be NULL.
+ * @param t35_us Inter-frame delay t3.5 [us], can be NULL.
+ * @retval receiver timeout used for the end of frame detection, in bit times
+ */
+uint32_t MBR_Get_Frame_Timing(modbus_handle_t *hmodbus, uint32_t *t15_us, uint32_t *t35_us)
+{
+	if(t15_us != NULL)
+	{
+		*t15_us = hmodbus->t15_us;
+	}
+	if(t35_us != NULL)
+	{
+		*t35_us = hmodbus->t35_us;
+	}
+
+	return hmodbus->rto_bits;
+}
+
+/**
+ * @brief Computing t1.5, t3.5 and the receiver timeout from the baud rate and the frame format of the UART.
+ * Up to 19200 Bd the times are given by the character time, above it they are fixed to 750 us and 1.75 ms.
+ */
+static void Configure_Timing(modbus_handle_t *hmodbus)
+{
+	UART_HandleTypeDef *huart = hmodbus->huart;
+	uint32_t baudrate = (huart->Init.BaudRate != 0) ? huart->Init.BaudRate : 19200;
+	uint32_t char_bits;
+
+	char_bits = 1 + ((huart->Init.StopBits == UART_STOPBITS_2) ? 2 : 1);	//start and stop bits
+	if(huart->Init.WordLength == UART_WORDLENGTH_9B)	//8 data bits and parity, or 9 data bits
+	{
+		char_bits += 9;
+	}
+#ifdef UART_WORDLENGTH_7B
+	else if(huart->Init.WordLength == UART_WORDLENGTH_7B)
+	{
+		char_bits += 7;
+	}
+#endif
+	else
+	{
+		char_bits += 8;
+	}
+
+	if(baudrate <= 19200)
+	{
+		hmodbus->t15_us = (uint32_t)(((uint64_t)char_bits * 3000000 + 2*baudrate - 1) / (2*baudrate));
+		hmodbus->t35_us = (uint32_t)(((uint64_t)char_bits * 7000000 + 2*baudrate - 1) / (2*baudrate));
+		hmodbus->rto_bits = (char_bits * 7 + 1) / 2;
+	}
+	else
+	{
+		hmodbus->t15_us = 750;
+		hmodbus->t35_us = 1750;
+		hmodbus->rto_bits = (uint32_t)(((uint64_t)1750 * baudrate + 999999) / 1000000);
+	}
+
+	if(hmodbus->frame_gap_bits != 0)
+	{
+		hmodbus->rto_bits = hmodbus->frame_gap_bits;
+	}
+
+	HAL_UART_ReceiverTimeout_Config(huart, hmodbus->rto_bits);
+}
+
+static void Restart_UART(modbus_handle_t *hmodbus)
+{
+	UART_HandleTypeDef *huart = hmodbus->huart;
+
+	Configure_Timing(hmodbus);
+
 	HAL_UART_Abort_IT(huart);	//TODO do we need _IT function?
 	HAL_UART_Init(huart);
-	HAL_UART_Receive_DMA(hmodbus->huart, buf_modbus, 0x100);
+	hmodbus->flg_tx_busy = 0;
+	HAL_UART_Receive_DMA(huart, hmodbus->buf_modbus_rx[hmodbus->rx_head], MODBUS_BUFFER_SIZE);
+}
+
+#ifdef MBR_PROFILING
+static void Profile_Stage(modbus_handle_t *hmodbus, profile_stage_t stage, uint32_t *timestamp)
+{
+	uint32_t now = MBR_PROFILE_TIMESTAMP();
+
+	hmodbus->profile.stage_time[stage] += now - *timestamp;
+	*timestamp = now;
+}
+
+static void Profile_Turnaround(modbus_handle_t *hmodbus, uint32_t time)
+{
+	uint32_t index, msb;
+
+	if(time < 4)
+	{
+		index = time;
+	}
+	else
+	{
+		msb = 31 - __builtin_clz(time);
+		index = 4*(msb-1) + ((time >> (msb-2)) & 0x03);	//4 sub-buckets per power of two
+	}
+
+	hmodbus->profile.turnaround[index]++;
+	hmodbus->profile.responses++;
 }
 
+static void Profile_Function(modbus_handle_t *hmodbus, uint8_t function, uint32_t time)
+{
+	profile_function_t *slot;
+	uint32_t i, index;
+
+	for(i=0; i<PROFILE_FUNCTIONS; i++)	//slot of the function code or the first unused one
+	{
+		slot = &hmodbus->profile.functions[i];
+		if(slot->function == function || slot->function == 0)
+		{
+			break;
+		}
+	}
+
+	if(i == PROFILE_FUNCTIONS)	//all slots are taken by other function codes
+	{
+		return;
+	}
+
+	slot->function = function;
+	slot->count++;
+	slot->total_time += time;
+	if(time > slot->max_time)
+	{
+		slot->max_time = time;
+	}
+	index = (time != 0) ? 32 - __builtin_clz(time) : 0;	//number of significant bits
+	if(index >= PROFILE_FUNCTION_HISTOGRAM_SIZE)
+	{
+		index = PROFILE_FUNCTION_HISTOGRAM_SIZE - 1;
+	}
+	slot->histogram[index]++;
+}
+#endif
@@ -1,14 +1,36 @@
 #ifndef __MODBUS_H
 #define __MODBUS_H
 
+#ifdef MBR_HOST_BUILD
+#include "MODBUS_HOST.h"	//HAL emulation for Linux host builds
+#else
 #include "main.h"
+#endif
+#include "MODBUS_CONFIG.h"
 
 typedef enum
 {
 	input_registers		= 0,
-	holding_registers	= 1
+	holding_registers	= 1,
+	coils				= 2,	//bit-packed: point n of the space is bit n%16 of word n/16
+	discrete_inputs		= 3		//bit-packed as coils
 } register_type_t;
 
+#define REGISTER_TYPES		4
+
+typedef enum
+{
+	slave_mode			= 0,	//server, answers requests of the master (default)
+	master_mode			= 1		//client, polls slaves from the poll list (MBR_CLIENT_POLLS > 0)
+} modbus_mode_t;
+
+typedef enum
+{
+	poll_ok					= 0x00,	//exception codes 0x01..0x0B are reported as they are
+	poll_invalid_response	= 0xFE,
+	poll_timeout			= 0xFF
+} poll_status_t;
+
 typedef enum exception_code_e
 {
 	illegal_function			= 0x01,
@@ -18,7 +40,9 @@ typedef enum exception_code_e
 	acknowledgement				= 0x05,
 	slave_device_busy			= 0x06,
 	negative_acknowledgement	= 0x07,
-	memory_parity_error			= 0x08
+	memory_parity_error			= 0x08,
+	gateway_path_unavailable	= 0x0A,
+	gateway_target_failed		= 0x0B
 } exception_code_t;
 
 typedef struct response_s {
@@ -28,37 +52,249 @@ typedef struct response_s {
 } response_t;
 
 
-typedef struct __address_space_t address_space_t;
+typedef struct statistics_s {
+	uint32_t bus_messages;						//frames with valid CRC (any unit address)
+	uint32_t crc_errors;						//frames with CRC error
+	uint32_t other_ids;							//valid frames addressed to other units
+	uint32_t broadcasts;						//valid broadcast requests
+	uint32_t slave_messages;					//requests processed by this unit (broadcasts included)
+	uint32_t no_responses;						//requests without response (broadcasts, listen only mode)
+	uint32_t exceptions;						//exception responses
+	uint32_t exception_codes[16];				//exception responses per exception code
+	uint32_t overruns;							//frames dropped because all RX slots were full, UART overruns
+	uint32_t uart_errors;						//UART errors other than receiver timeout (parity, noise, framing, overrun)
+	uint32_t transmissions;						//completed transmissions
+} statistics_t;
+
+#ifdef MBR_PROFILING
+typedef enum
+{
+	profile_crc_check		= 0,	//CRC check of the received frame
+	profile_lookup			= 1,	//address space lookup
+	profile_encode			= 2,	//register encoding / decoding
+	profile_crc_append		= 3,	//CRC calculation of the response
+	PROFILE_STAGES
+} profile_stage_t;
+
+#define PROFILE_HISTOGRAM_SIZE	128	//log2 buckets with 4 sub-buckets each
+#define PROFILE_FUNCTIONS		8	//function codes with own processing time statistics, slots are assigned on first use
+#define PROFILE_FUNCTION_HISTOGRAM_SIZE	32	//log2 buckets, bucket n counts times in <2^(n-1), 2^n)
+
+typedef struct profile_function_s {
+	uint8_t function;							//function code, 0 = unused slot
+	uint32_t count;								//number of processed requests
+	uint32_t max_time;							//processing time (handler call) in timestamp units
+	uint64_t total_time;
+	uint32_t histogram[PROFILE_FUNCTION_HISTOGRAM_SIZE];
+} profile_function_t;
+
+typedef struct profile_s {
+	uint32_t frames;							//number of processed frames
+	uint32_t responses;							//number of sent responses
+	uint64_t stage_time[PROFILE_STAGES];		//accumulated time per stage, in timestamp units
+	uint32_t turnaround[PROFILE_HISTOGRAM_SIZE];	//histogram of frame end to TX start time
+	profile_function_t functions[PROFILE_FUNCTIONS];	//processing time per function code
+} profile_t;
+#endif
+
+typedef struct __address_space_t
+{
+	register_type_t		type;
+	uint16_t			start_offset;
+	uint16_t			size;
+	uint16_t			*address;
+#if MBR_RESPONSE_CACHE_SIZE
+	volatile uint32_t	version;				//incremented on every write, cached responses with older version are stale
+#endif
+#if MBR_SEQLOCK_RETRIES
+	volatile uint32_t	sequence;				//seqlock: active writers (low halfword) and completed updates (high halfword)
+#endif
+#if MBR_ISR_FAST_PATH
+	uint8_t				flg_isr_access;			//requests can be processed in the interrupt, callbacks of the space are interrupt safe
+#endif
+	uint8_t				flg_storage;			//storage of the application (MBR_Init_Address_Space_Static), not freed by the library
+} address_space_t;
+
+typedef struct register_map_s {
+	address_space_t *const *spaces;				//sorted by type and start offset
+	uint16_t first[REGISTER_TYPES+1];			//index of the first address space of every type, first[REGISTER_TYPES] = number of spaces
+} register_map_t;
+
+/*
+ * Static register map, defined completely at compile time (no heap, no index building at startup):
+ *	#define APP_REGISTER_MAP(X) \
+ *		X(input_registers,		0,		16,	input_data) \
+ *		X(holding_registers,	0,		32,	holding_data) \
+ *		X(holding_registers,	100,	8,	config_data)
+ *	MBR_DEFINE_REGISTER_MAP(app_register_map, APP_REGISTER_MAP);
+ *	...
+ *	MBR_Set_Register_Map(hmodbus, &app_register_map);
+ * Entries have to be sorted by type (in the order of register_type_t) and start offset.
+ * The map is placed in flash unless the cache, seqlock or interrupt fast path need to write to address spaces.
+ */
+#if MBR_RESPONSE_CACHE_SIZE || MBR_SEQLOCK_RETRIES || MBR_ISR_FAST_PATH
+#define MBR_MAP_STORAGE
+#else
+#define MBR_MAP_STORAGE		const
+#endif
+#define MBR_MAP_SPACE(type_, start_offset_, size_, address_)		(address_space_t*)&(MBR_MAP_STORAGE address_space_t){.type = (type_), .start_offset = (start_offset_), .size = (size_), .address = (address_)},
+#define MBR_MAP_COUNT_INPUT(type_, start_offset_, size_, address_)		+ ((type_) == input_registers)
+#define MBR_MAP_COUNT_HOLDING(type_, start_offset_, size_, address_)	+ ((type_) == holding_registers)
+#define MBR_MAP_COUNT_COILS(type_, start_offset_, size_, address_)		+ ((type_) == coils)
+#define MBR_MAP_COUNT_DISCRETE(type_, start_offset_, size_, address_)	+ ((type_) == discrete_inputs)
+#define MBR_DEFINE_REGISTER_MAP(name, MAP) \
+	static address_space_t *const name##_spaces[] = { MAP(MBR_MAP_SPACE) }; \
+	const register_map_t name = { name##_spaces, { 0, \
+		0 MAP(MBR_MAP_COUNT_INPUT), \
+		0 MAP(MBR_MAP_COUNT_INPUT) MAP(MBR_MAP_COUNT_HOLDING), \
+		0 MAP(MBR_MAP_COUNT_INPUT) MAP(MBR_MAP_COUNT_HOLDING) MAP(MBR_MAP_COUNT_COILS), \
+		0 MAP(MBR_MAP_COUNT_INPUT) MAP(MBR_MAP_COUNT_HOLDING) MAP(MBR_MAP_COUNT_COILS) MAP(MBR_MAP_COUNT_DISCRETE) } }
+
+typedef struct change_s {
+	address_space_t *address_space;				//space written by Modbus master, NULL = changes have been lost (queue overflow), re-read all spaces
+	uint16_t start_address;						//address of the first register / coil
+	uint16_t count;								//number of registers / coils
+} change_t;
+
 typedef struct __modbus_hanle_t modbus_handle_t;
 
+/*
+ * Storage of a handle placed by the application (MBR_Init_Modbus_Static). The handle is private, its size is bounded
+ * from the build options here and the bound is checked when MODBUS.c is compiled.
+ */
+#if MBR_MAX_UNITS
+#define MBR_STORAGE_UNITS		(MBR_MAX_UNITS*((MBR_MAX_ADDRESS_SPACES + 2)*sizeof(void*) + 0x18) + 0x130)
+#else
+#define MBR_STORAGE_UNITS		0
+#endif
+#if MBR_CLIENT_POLLS
+#define MBR_STORAGE_CLIENT		(MBR_CLIENT_POLLS*(sizeof(void*) + 0x10) + MBR_CLIENT_SLAVES*0x0C + MBR_CLIENT_TAGS*(sizeof(void*) + 0x10) + 0x30)
+#else
+#define MBR_STORAGE_CLIENT		0
+#endif
+#if MBR_RESPONSE_CACHE_SIZE
+#define MBR_STORAGE_CACHE		((MBR_RESPONSE_CACHE_SIZE + 1)*0x118 + 0x08)
+#else
+#define MBR_STORAGE_CACHE		0
+#endif
+#ifdef MBR_PROFILING
+#define MBR_STORAGE_PROFILE		(sizeof(profile_t) + (MBR_RX_SLOTS + 1)*4)
+#else
+#define MBR_STORAGE_PROFILE		0
+#endif
+#define MBR_HANDLE_STORAGE_SIZE	(0x100*sizeof(void*) + (MBR_RX_SLOTS + 1)*0x108 + (MBR_MAX_ADDRESS_SPACES + 2)*sizeof(void*) + 0x18 \
+		+ sizeof(statistics_t) + 0x80 + MBR_STORAGE_UNITS + MBR_STORAGE_CLIENT + MBR_STORAGE_CACHE + MBR_STORAGE_PROFILE \
+		+ MBR_CHANGE_QUEUE_SIZE*sizeof(change_t) + 0x10)
+
+typedef union modbus_handle_storage_u {
+	uint8_t bytes[MBR_HANDLE_STORAGE_SIZE];
+	uint64_t align;
+	void *align_pointer;
+} modbus_handle_storage_t;
+
+typedef struct modbus_request_s {
+	uint8_t address;				//unit address, 0 = broadcast
+	uint8_t function;				//function code
+	uint8_t *data;					//request data following the function code (CRC excluded), can be modified in place
+	uint8_t length;					//number of data bytes
+} modbus_request_t;
+
+typedef struct modbus_response_s {
+	uint8_t *data;					//response data following the function code, written by the handler
+	uint8_t max_length;				//capacity of data
+	uint8_t length;					//number of data bytes written by the handler
+	exception_code_t exception;		//non zero = exception response is sent instead of data
+	uint8_t flg_response;			//0 = no response (set to 0 for broadcast requests)
+} modbus_response_t;
+
+typedef void (*command_handler_t)(modbus_handle_t *hmodbus, modbus_request_t *request, modbus_response_t *response);
+
 
 /*FUNCTIONS THAT CAN BE USED IN OTHER MODULES*/
 uint32_t FEE_Get_Version(void);
 
-modbus_handle_t *MBR_Init_Modbus(UART_HandleTypeDef *huart);	//call this function in main.c after initialization of all hardware
+modbus_handle_t *MBR_Init_Modbus(UART_HandleTypeDef *huart);	//call this function in main.c after initialization of all hardware, return NULL when NOK
+modbus_handle_t *MBR_Init_Modbus_Static(UART_HandleTypeDef *huart, modbus_handle_storage_t *storage);	//handle placed in storage of the application, return NULL when NOK (MBR_MAX_INSTANCES handles in use)
 void MBR_Destroy_Modbus(modbus_handle_t *hmodbus);
 
-address_space_t *MBR_Init_Address_Space(register_type_t type, uint16_t start_offset, uint16_t size, uint16_t *address);
-void MBR_Add_Address_Space(modbus_handle_t *hmodbus, address_space_t *address_space);
-void MBR_Remove_Address_Space(modbus_handle_t *hmodbus, uint16_t *address);
+address_space_t *MBR_Init_Address_Space(register_type_t type, uint16_t start_offset, uint16_t size, uint16_t *address);	//return NULL when NOK (out of memory)
+address_space_t *MBR_Init_Address_Space_Static(address_space_t *storage, register_type_t type, uint16_t start_offset, uint16_t size, uint16_t *address);	//space placed in storage of the application, return storage
+uint8_t MBR_Add_Address_Space(modbus_handle_t *hmodbus, address_space_t *address_space);	//return 0 when OK, return 1 when NOK (map is full or spaces overlap)
+void MBR_Remove_Address_Space(modbus_handle_t *hmodbus, uint16_t *address);	//searches the maps of all units
+uint8_t MBR_Set_Register_Map(modbus_handle_t *hmodbus, const register_map_t *map);	//return 0 when OK, return 1 when NOK (map is not sorted or spaces overlap)
+uint8_t MBR_Add_Unit(modbus_handle_t *hmodbus, uint8_t unit_id, const register_map_t *map);	//MBR_MAX_UNITS: serve another unit id with own map (NULL = empty), return 0 when OK, return 1 when NOK
+uint8_t MBR_Add_Unit_Address_Space(modbus_handle_t *hmodbus, uint8_t unit_id, address_space_t *address_space);	//return 0 when OK, return 1 when NOK
+uint8_t MBR_Remove_Unit_Address_Space(modbus_handle_t *hmodbus, uint8_t unit_id, uint16_t *address);	//return 0 when OK, return 1 when NOK
 
-void MBR_Set_Communication_Parameters(modbus_handle_t *hmodbus, uint8_t slave_id, uint8_t baudrate, uint8_t parity);
+uint8_t MBR_Add_Custom_Command(modbus_handle_t *hmodbus, uint8_t function_code, command_handler_t handler);	//return 0 when OK, return 1 when NOK (invalid function code)
 
-void MBR_Check_For_Request(modbus_handle_t *hmodbus);
+void MBR_Set_Communication_Parameters(modbus_handle_t *hmodbus, uint8_t slave_id, uint8_t baudrate, uint8_t parity);	//baudrate: 0..8 = 4800..921600, parity: 0 = none, 1 = even, 2 = odd
+void MBR_Set_Baud_Rate(modbus_handle_t *hmodbus, uint32_t baudrate);	//any baud rate, timing is computed from it
+void MBR_Set_Frame_Gap(modbus_handle_t *hmodbus, uint32_t gap_bits);	//shorter end of frame detection for point-to-point links, 0 = t3.5
+uint32_t MBR_Get_Frame_Timing(modbus_handle_t *hmodbus, uint32_t *t15_us, uint32_t *t35_us);	//return receiver timeout in bit times
+
+uint16_t MBR_Process_Frame(modbus_handle_t *hmodbus, uint8_t *request, uint16_t request_length, uint8_t *response);	//transport independent processing (no CRC), return length of the response
+void MBR_Check_For_Request(modbus_handle_t *hmodbus);	//in master mode it drives the poll scheduler
+/*event driven processing, MBR_Wakeup_Callback is called from interrupt when there is something to process*/
+#define MBR_WAIT_FOREVER	0xFFFFFFFFu
+uint32_t MBR_Get_Wait_Time(modbus_handle_t *hmodbus);	//ms until the next deadline, 0 = process now
+void MBR_Wait_For_Request(modbus_handle_t *hmodbus, uint32_t timeout_ms);	//sleeps by MBR_Wait_Callback and processes the event
+void MBR_Wakeup_Callback(modbus_handle_t *hmodbus);	//interrupt context, e.g. semaphore give / task notify
+void MBR_Wait_Callback(modbus_handle_t *hmodbus, uint32_t timeout_ms);	//e.g. semaphore take / task notify wait, default is WFI
+void MBR_Set_Communication_Timeout(modbus_handle_t *hmodbus, uint32_t timeout_ms);	//0 = communication lost detection is disabled
+uint8_t MBR_Is_Communication_Lost(modbus_handle_t *hmodbus);
+void MBR_Get_Statistics(modbus_handle_t *hmodbus, statistics_t *statistics);	//counters are available over the wire by FC08 as well
+void MBR_Reset_Statistics(modbus_handle_t *hmodbus);
+void MBR_Mark_Dirty(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t register_count);	//call after direct writes to address spaces when MBR_RESPONSE_CACHE_SIZE > 0
+/*consistent access to address spaces (MBR_SEQLOCK_RETRIES > 0), one writer at a time*/
+void MBR_Begin_Update(address_space_t *address_space);
+void MBR_End_Update(address_space_t *address_space);	//invalidates cached responses as well
+uint32_t MBR_Read_Begin(address_space_t *address_space);
+uint8_t MBR_Read_Retry(address_space_t *address_space, uint32_t sequence);	//return 1 when the read has to be repeated
+void MBR_Set_ISR_Access(address_space_t *address_space, uint8_t flg_isr_access);	//MBR_ISR_FAST_PATH: FC03/FC04/FC06 for the space are answered in the interrupt
+/*change queue (MBR_CHANGE_QUEUE_SIZE > 0), written ranges are posted instead of calling the update callbacks*/
+uint8_t MBR_Get_Change(modbus_handle_t *hmodbus, change_t *change);	//application side, adjacent changes are merged. return 1 when a change has been taken, 0 when the queue is empty
+void MBR_Change_Posted_Callback(modbus_handle_t *hmodbus);	//called after a request has posted changes, e.g. task notify
+#ifdef MBR_RX_STREAMING_CRC
+void MBR_Receive_Progress(modbus_handle_t *hmodbus);	//fold received bytes into running CRC, can be called from idle line IRQ or timer
+#endif
 
 uint8_t MBR_Check_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data);	//weak ref, can be defined in other modules. return 0 when OK, return 1 when NOK
 
 void MBR_Register_Update_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t register_data);
 void MBR_Register_Read_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data);
+/*range callbacks, called once per request (per address space), by default they call the per-register callbacks above (MBR_PER_REGISTER_CALLBACKS)*/
+uint8_t MBR_Check_Range_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t register_count, const uint16_t *register_data);	//return 0 when OK, return 1 when NOK
+void MBR_Register_Range_Update_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t register_count, const uint16_t *register_data);
+void MBR_Register_Range_Read_Callback(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t register_count, uint16_t *register_data);	//registers can be refreshed in place
+/*bit callbacks (coils and discrete inputs), called once per address space touched by the request*/
+uint8_t MBR_Check_Coil_Restrictions_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t coil_count, const uint8_t *coil_data);	//coil_data is bit-packed as in the request. return 0 when OK, return 1 when NOK
+void MBR_Coil_Update_Callback(modbus_handle_t *hmodbus, uint16_t start_address, uint16_t coil_count);
+void MBR_Bit_Read_Callback(modbus_handle_t *hmodbus, register_type_t type, uint16_t start_address, uint16_t bit_count);	//bits can be refreshed in place
 //void MBR_Register_Init_Callback(modbus_handle_t *hmodbus, uint16_t register_address, uint16_t *register_data);
 
 void MBR_Start_Sending_Callback(UART_HandleTypeDef *huart);
 void MBR_End_Sending_Callback(UART_HandleTypeDef *huart);
 
+/*client (master) mode*/
+void MBR_Set_Mode(modbus_handle_t *hmodbus, modbus_mode_t mode);
+int32_t MBR_Add_Poll(modbus_handle_t *hmodbus, uint8_t slave_id, uint8_t function_code, uint16_t start_address, uint16_t count, uint16_t *data);	//return poll index, -1 when NOK
+uint8_t MBR_Set_Slave_Timeout(modbus_handle_t *hmodbus, uint8_t slave_id, uint16_t timeout_ms);	//return 0 when OK, return 1 when NOK
+uint8_t MBR_Add_Tag(modbus_handle_t *hmodbus, uint8_t slave_id, register_type_t type, uint16_t address, uint16_t length, uint16_t *data);	//return 0 when OK, return 1 when NOK
+int32_t MBR_Plan_Polls(modbus_handle_t *hmodbus, uint16_t max_gap);	//merge tags into polls, return number of polls, -1 when NOK
+void MBR_Poll_Result_Callback(modbus_handle_t *hmodbus, int32_t poll, uint8_t status);	//status: poll_status_t or exception code
+void MBR_Poll_Cycle_Callback(modbus_handle_t *hmodbus);	//all polls have been executed once
+
 void MBR_Communication_Lost_Callback(modbus_handle_t *hmodbus);
 void MBR_Communication_Restored_Callback(modbus_handle_t *hmodbus);
 
-void MBR_Custom_Command_Callback(uint8_t *buf_modbus, response_t *response);
+void MBR_Custom_Command_Callback(uint8_t *buf_modbus, response_t *response);	//called for function codes without registered handler
 uint16_t Calculate_CRC16(uint8_t *buf, uint16_t length);
 
+#ifdef MBR_PROFILING
+void MBR_Get_Profile(modbus_handle_t *hmodbus, profile_t *profile);
+void MBR_Reset_Profile(modbus_handle_t *hmodbus);
+uint32_t MBR_Get_Turnaround_Percentile(modbus_handle_t *hmodbus, uint8_t percentile);
+#endif
+
 #endif
@@ -0,0 +1,88 @@
+#ifndef __MODBUS_CONFIG_H
+#define __MODBUS_CONFIG_H
+
+/*
+ * Build options of the library with their defaults. Override them by compiler flags (-DMBR_...=...) or edit them here.
+ * MODBUS.h includes this file, so the library and the application see the same layout of the public structures
+ * (address_space_t depends on MBR_RESPONSE_CACHE_SIZE, MBR_SEQLOCK_RETRIES and MBR_ISR_FAST_PATH).
+ */
+
+#ifndef MBR_MAX_ADDRESS_SPACES
+#define MBR_MAX_ADDRESS_SPACES		0x10	//capacity of the address map, can be increased up to 0xFFFF
+#endif
+
+#ifndef MBR_PER_REGISTER_CALLBACKS
+#define MBR_PER_REGISTER_CALLBACKS	1		//default range callbacks call the per-register ones (compatibility)
+#endif
+
+#ifndef MBR_STATIC_ALLOCATION
+#define MBR_STATIC_ALLOCATION		0		//1 = malloc is not used, MBR_Init_Modbus / MBR_Init_Address_Space take storage from the static pools
+#endif
+
+#if MBR_STATIC_ALLOCATION
+#ifndef MBR_STATIC_HANDLES
+#define MBR_STATIC_HANDLES			MBR_MAX_INSTANCES	//pool of handles for MBR_Init_Modbus, 0 = no pool (MBR_Init_Modbus_Static only)
+#endif
+#ifndef MBR_STATIC_SPACES
+#define MBR_STATIC_SPACES			0x10	//pool of address spaces for MBR_Init_Address_Space, 0 = no pool (MBR_Init_Address_Space_Static only)
+#endif
+#endif
+
+#ifndef MBR_MAX_UNITS
+#define MBR_MAX_UNITS				0		//unit ids served by one handle in addition to its slave id, each with own register map
+#endif
+
+#ifndef MBR_MAX_INSTANCES
+#define MBR_MAX_INSTANCES			4		//number of Modbus handles (UARTs) served in parallel
+#endif
+
+#ifndef MBR_RX_SLOTS
+#define MBR_RX_SLOTS				3		//receive buffers: one is filled by DMA, others keep received frames
+#endif
+
+#ifndef MBR_ISR_FAST_PATH
+#define MBR_ISR_FAST_PATH			0		//1 = FC03/FC04/FC06 requests for address spaces enabled by MBR_Set_ISR_Access are answered in the receiver timeout interrupt
+#endif
+
+#ifndef MBR_CHANGE_QUEUE_SIZE
+#define MBR_CHANGE_QUEUE_SIZE		0		//entries of the change queue (power of 2), 0 = update callbacks are called synchronously
+#endif
+#if MBR_CHANGE_QUEUE_SIZE & (MBR_CHANGE_QUEUE_SIZE - 1)
+#error "MBR_CHANGE_QUEUE_SIZE has to be a power of 2"
+#endif
+
+#ifndef MBR_COMM_TIMEOUT
+#define MBR_COMM_TIMEOUT			10000	//default communication lost timeout [ms], 0 = disabled
+#endif
+
+#ifndef MBR_RESPONSE_CACHE_SIZE
+#define MBR_RESPONSE_CACHE_SIZE		0		//cached FC03/FC04 responses per handle, 0 = cache is disabled
+#endif
+
+#ifndef MBR_SEQLOCK_RETRIES
+#define MBR_SEQLOCK_RETRIES			0		//attempts to read a consistent block of address space, 0 = consistency layer is disabled
+#endif
+
+#ifndef MBR_CLIENT_POLLS
+#define MBR_CLIENT_POLLS			0		//capacity of the poll list of master mode, 0 = master mode is disabled
+#endif
+
+#if MBR_CLIENT_POLLS
+#ifndef MBR_CLIENT_SLAVES
+#define MBR_CLIENT_SLAVES			32		//number of different slaves in the poll list
+#endif
+#ifndef MBR_CLIENT_TIMEOUT
+#define MBR_CLIENT_TIMEOUT			100		//default response timeout [ms]
+#endif
+#ifndef MBR_CLIENT_RETRIES
+#define MBR_CLIENT_RETRIES			2		//consecutive timeouts before the slave is backed off
+#endif
+#ifndef MBR_CLIENT_BACKOFF
+#define MBR_CLIENT_BACKOFF			1000	//first back-off period [ms], doubled with every further timeout up to 16 times
+#endif
+#ifndef MBR_CLIENT_TAGS
+#define MBR_CLIENT_TAGS				0		//capacity of the tag list of the read planner, 0 = planner is disabled
+#endif
+#endif
+
+#endif
@@ -0,0 +1,502 @@
+/*MODBUS_CRC.c*/
+#ifdef MBR_HOST_BUILD
+#include "MODBUS_HOST.h"
+#else
+#include "main.h"
+#endif
+#include "MODBUS_CRC.h"
+#include <string.h>
+
+#if defined(MBR_HOST_BUILD) || MBR_CRC_ENGINE == MBR_CRC_SLICING4 || MBR_CRC_ENGINE == MBR_CRC_SLICING8
+#define MBR_CRC_SLICING4_ENABLED	1
+#else
+#define MBR_CRC_SLICING4_ENABLED	0
+#endif
+
+#if defined(MBR_HOST_BUILD) || MBR_CRC_ENGINE == MBR_CRC_SLICING8
+#define MBR_CRC_SLICING8_ENABLED	1
+#else
+#define MBR_CRC_SLICING8_ENABLED	0
+#endif
+
+#if MBR_CRC_ENGINE == MBR_CRC_HARDWARE && !defined(CRC_POL_POL)
+#error "CRC peripheral of this MCU has no programmable polynomial, select another MBR_CRC_ENGINE"
+#endif
+
+#if MBR_CRC_ENGINE == MBR_CRC_CLMUL && !defined(__PCLMUL__)
+#error "MBR_CRC_CLMUL requires x86 host with PCLMULQDQ (-mpclmul)"
+#endif
+
+#ifdef __PCLMUL__
+#include <wmmintrin.h>
+#endif
+
+/*
+ * Slicing tables for reflected polynomial 0xA001:
+ * crc_table_0 is the classic byte table, crc_table_k[i] = (crc_table_k-1[i]>>8) ^ crc_table_0[crc_table_k-1[i] & 0xFF]
+ */
+static const uint16_t crc_table_0[256] = {
+		0X0000, 0XC0C1, 0XC181, 0X0140, 0XC301, 0X03C0, 0X0280, 0XC241,
+		0XC601, 0X06C0, 0X0780, 0XC741, 0X0500, 0XC5C1, 0XC481, 0X0440,
+		0XCC01, 0X0CC0, 0X0D80, 0XCD41, 0X0F00, 0XCFC1, 0XCE81, 0X0E40,
+		0X0A00, 0XCAC1, 0XCB81, 0X0B40, 0XC901, 0X09C0, 0X0880, 0XC841,
+		0XD801, 0X18C0, 0X1980, 0XD941, 0X1B00, 0XDBC1, 0XDA81, 0X1A40,
+		0X1E00, 0XDEC1, 0XDF81, 0X1F40, 0XDD01, 0X1DC0, 0X1C80, 0XDC41,
+		0X1400, 0XD4C1, 0XD581, 0X1540, 0XD701, 0X17C0, 0X1680, 0XD641,
+		0XD201, 0X12C0, 0X1380, 0XD341, 0X1100, 0XD1C1, 0XD081, 0X1040,
+		0XF001, 0X30C0, 0X3180, 0XF141, 0X3300, 0XF3C1, 0XF281, 0X3240,
+		0X3600, 0XF6C1, 0XF781, 0X3740, 0XF501, 0X35C0, 0X3480, 0XF441,
+		0X3C00, 0XFCC1, 0XFD81, 0X3D40, 0XFF01, 0X3FC0, 0X3E80, 0XFE41,
+		0XFA01, 0X3AC0, 0X3B80, 0XFB41, 0X3900, 0XF9C1, 0XF881, 0X3840,
+		0X2800, 0XE8C1, 0XE981, 0X2940, 0XEB01, 0X2BC0, 0X2A80, 0XEA41,
+		0XEE01, 0X2EC0, 0X2F80, 0XEF41, 0X2D00, 0XEDC1, 0XEC81, 0X2C40,
+		0XE401, 0X24C0, 0X2580, 0XE541, 0X2700, 0XE7C1, 0XE681, 0X2640,
+		0X2200, 0XE2C1, 0XE381, 0X2340, 0XE101, 0X21C0, 0X2080, 0XE041,
+		0XA001, 0X60C0, 0X6180, 0XA141, 0X6300, 0XA3C1, 0XA281, 0X6240,
+		0X6600, 0XA6C1, 0XA781, 0X6740, 0XA501, 0X65C0, 0X6480, 0XA441,
+		0X6C00, 0XACC1, 0XAD81, 0X6D40, 0XAF01, 0X6FC0, 0X6E80, 0XAE41,
+		0XAA01, 0X6AC0, 0X6B80, 0XAB41, 0X6900, 0XA9C1, 0XA881, 0X6840,
+		0X7800, 0XB8C1, 0XB981, 0X7940, 0XBB01, 0X7BC0, 0X7A80, 0XBA41,
+		0XBE01, 0X7EC0, 0X7F80, 0XBF41, 0X7D00, 0XBDC1, 0XBC81, 0X7C40,
+		0XB401, 0X74C0, 0X7580, 0XB541, 0X7700, 0XB7C1, 0XB681, 0X7640,
+		0X7200, 0XB2C1, 0XB381, 0X7340, 0XB101, 0X71C0, 0X7080, 0XB041,
+		0X5000, 0X90C1, 0X9181, 0X5140, 0X9301, 0X53C0, 0X5280, 0X9241,
+		0X9601, 0X56C0, 0X5780, 0X9741, 0X5500, 0X95C1, 0X9481, 0X5440,
+		0X9C01, 0X5CC0, 0X5D80, 0X9D41, 0X5F00, 0X9FC1, 0X9E81, 0X5E40,
+		0X5A00, 0X9AC1, 0X9B81, 0X5B40, 0X9901, 0X59C0, 0X5880, 0X9841,
+		0X8801, 0X48C0, 0X4980, 0X8941, 0X4B00, 0X8BC1, 0X8A81, 0X4A40,
+		0X4E00, 0X8EC1, 0X8F81, 0X4F40, 0X8D01, 0X4DC0, 0X4C80, 0X8C41,
+		0X4400, 0X84C1, 0X8581, 0X4540, 0X8701, 0X47C0, 0X4680, 0X8641,
+		0X8201, 0X42C0, 0X4380, 0X8341, 0X4100, 0X81C1, 0X8081, 0X4040};
+
+#if MBR_CRC_SLICING4_ENABLED
+static const uint16_t crc_table_1[256] = {
+		0X0000, 0X9001, 0X6001, 0XF000, 0XC002, 0X5003, 0XA003, 0X3002,
+		0XC007, 0X5006, 0XA006, 0X3007, 0X0005, 0X9004, 0X6004, 0XF005,
+		0XC00D, 0X500C, 0XA00C, 0X300D, 0X000F, 0X900E, 0X600E, 0XF00F,
+		0X000A, 0X900B, 0X600B, 0XF00A, 0XC008, 0X5009, 0XA009, 0X3008,
+		0XC019, 0X5018, 0XA018, 0X3019, 0X001B, 0X901A, 0X601A, 0XF01B,
+		0X001E, 0X901F, 0X601F, 0XF01E, 0XC01C, 0X501D, 0XA01D, 0X301C,
+		0X0014, 0X9015, 0X6015, 0XF014, 0XC016, 0X5017, 0XA017, 0X3016,
+		0XC013, 0X5012, 0XA012, 0X3013, 0X0011, 0X9010, 0X6010, 0XF011,
+		0XC031, 0X5030, 0XA030, 0X3031, 0X0033, 0X9032, 0X6032, 0XF033,
+		0X0036, 0X9037, 0X6037, 0XF036, 0XC034, 0X5035, 0XA035, 0X3034,
+		0X003C, 0X903D, 0X603D, 0XF03C, 0XC03E, 0X503F, 0XA03F, 0X303E,
+		0XC03B, 0X503A, 0XA03A, 0X303B, 0X0039, 0X9038, 0X6038, 0XF039,
+		0X0028, 0X9029, 0X6029, 0XF028, 0XC02A, 0X502B, 0XA02B, 0X302A,
+		0XC02F, 0X502E, 0XA02E, 0X302F, 0X002D, 0X902C, 0X602C, 0XF02D,
+		0XC025, 0X5024, 0XA024, 0X3025, 0X0027, 0X9026, 0X6026, 0XF027,
+		0X0022, 0X9023, 0X6023, 0XF022, 0XC020, 0X5021, 0XA021, 0X3020,
+		0XC061, 0X5060, 0XA060, 0X3061, 0X0063, 0X9062, 0X6062, 0XF063,
+		0X0066, 0X9067, 0X6067, 0XF066, 0XC064, 0X5065, 0XA065, 0X3064,
+		0X006C, 0X906D, 0X606D, 0XF06C, 0XC06E, 0X506F, 0XA06F, 0X306E,
+		0XC06B, 0X506A, 0XA06A, 0X306B, 0X0069, 0X9068, 0X6068, 0XF069,
+		0X0078, 0X9079, 0X6079, 0XF078, 0XC07A, 0X507B, 0XA07B, 0X307A,
+		0XC07F, 0X507E, 0XA07E, 0X307F, 0X007D, 0X907C, 0X607C, 0XF07D,
+		0XC075, 0X5074, 0XA074, 0X3075, 0X0077, 0X9076, 0X6076, 0XF077,
+		0X0072, 0X9073, 0X6073, 0XF072, 0XC070, 0X5071, 0XA071, 0X3070,
+		0X0050, 0X9051, 0X6051, 0XF050, 0XC052, 0X5053, 0XA053, 0X3052,
+		0XC057, 0X5056, 0XA056, 0X3057, 0X0055, 0X9054, 0X6054, 0XF055,
+		0XC05D, 0X505C, 0XA05C, 0X305D, 0X005F, 0X905E, 0X605E, 0XF05F,
+		0X005A, 0X905B, 0X605B, 0XF05A, 0XC058, 0X5059, 0XA059, 0X3058,
+		0XC049, 0X5048, 0XA048, 0X3049, 0X004B, 0X904A, 0X604A, 0XF04B,
+		0X004E, 0X904F, 0X604F, 0XF04E, 0XC04C, 0X504D, 0XA04D, 0X304C,
+		0X0044, 0X9045, 0X6045, 0XF044, 0XC046, 0X5047, 0XA047, 0X3046,
+		0XC043, 0X5042, 0XA042, 0X3043, 0X0041, 0X9040, 0X6040, 0XF041};
+
+static const uint16_t crc_table_2[256] = {
+		0X0000, 0XC051, 0XC0A1, 0X00F0, 0XC141, 0X0110, 0X01E0, 0XC1B1,
+		0XC281, 0X02D0, 0X0220, 0XC271, 0X03C0, 0XC391, 0XC361, 0X0330,
+		0XC501, 0X0550, 0X05A0, 0XC5F1, 0X0440, 0XC411, 0XC4E1, 0X04B0,
+		0X0780, 0XC7D1, 0XC721, 0X0770, 0XC6C1, 0X0690, 0X0660, 0XC631,
+		0XCA01, 0X0A50, 0X0AA0, 0XCAF1, 0X0B40, 0XCB11, 0XCBE1, 0X0BB0,
+		0X0880, 0XC8D1, 0XC821, 0X0870, 0XC9C1, 0X0990, 0X0960, 0XC931,
+		0X0F00, 0XCF51, 0XCFA1, 0X0FF0, 0XCE41, 0X0E10, 0X0EE0, 0XCEB1,
+		0XCD81, 0X0DD0, 0X0D20, 0XCD71, 0X0CC0, 0XCC91, 0XCC61, 0X0C30,
+		0XD401, 0X1450, 0X14A0, 0XD4F1, 0X1540, 0XD511, 0XD5E1, 0X15B0,
+		0X1680, 0XD6D1, 0XD621, 0X1670, 0XD7C1, 0X1790, 0X1760, 0XD731,
+		0X1100, 0XD151, 0XD1A1, 0X11F0, 0XD041, 0X1010, 0X10E0, 0XD0B1,
+		0XD381, 0X13D0, 0X1320, 0XD371, 0X12C0, 0XD291, 0XD261, 0X1230,
+		0X1E00, 0XDE51, 0XDEA1, 0X1EF0, 0XDF41, 0X1F10, 0X1FE0, 0XDFB1,
+		0XDC81, 0X1CD0, 0X1C20, 0XDC71, 0X1DC0, 0XDD91, 0XDD61, 0X1D30,
+		0XDB01, 0X1B50, 0X1BA0, 0XDBF1, 0X1A40, 0XDA11, 0XDAE1, 0X1AB0,
+		0X1980, 0XD9D1, 0XD921, 0X1970, 0XD8C1, 0X1890, 0X1860, 0XD831,
+		0XE801, 0X2850, 0X28A0, 0XE8F1, 0X2940, 0XE911, 0XE9E1, 0X29B0,
+		0X2A80, 0XEAD1, 0XEA21, 0X2A70, 0XEBC1, 0X2B90, 0X2B60, 0XEB31,
+		0X2D00, 0XED51, 0XEDA1, 0X2DF0, 0XEC41, 0X2C10, 0X2CE0, 0XECB1,
+		0XEF81, 0X2FD0, 0X2F20, 0XEF71, 0X2EC0, 0XEE91, 0XEE61, 0X2E30,
+		0X2200, 0XE251, 0XE2A1, 0X22F0, 0XE341, 0X2310, 0X23E0, 0XE3B1,
+		0XE081, 0X20D0, 0X2020, 0XE071, 0X21C0, 0XE191, 0XE161, 0X2130,
+		0XE701, 0X2750, 0X27A0, 0XE7F1, 0X2640, 0XE611, 0XE6E1, 0X26B0,
+		0X2580, 0XE5D1, 0XE521, 0X2570, 0XE4C1, 0X2490, 0X2460, 0XE431,
+		0X3C00, 0XFC51, 0XFCA1, 0X3CF0, 0XFD41, 0X3D10, 0X3DE0, 0XFDB1,
+		0XFE81, 0X3ED0, 0X3E20, 0XFE71, 0X3FC0, 0XFF91, 0XFF61, 0X3F30,
+		0XF901, 0X3950, 0X39A0, 0XF9F1, 0X3840, 0XF811, 0XF8E1, 0X38B0,
+		0X3B80, 0XFBD1, 0XFB21, 0X3B70, 0XFAC1, 0X3A90, 0X3A60, 0XFA31,
+		0XF601, 0X3650, 0X36A0, 0XF6F1, 0X3740, 0XF711, 0XF7E1, 0X37B0,
+		0X3480, 0XF4D1, 0XF421, 0X3470, 0XF5C1, 0X3590, 0X3560, 0XF531,
+		0X3300, 0XF351, 0XF3A1, 0X33F0, 0XF241, 0X3210, 0X32E0, 0XF2B1,
+		0XF181, 0X31D0, 0X3120, 0XF171, 0X30C0, 0XF091, 0XF061, 0X3030};
+
+static const uint16_t crc_table_3[256] = {
+		0X0000, 0XFC01, 0XB801, 0X4400, 0X3001, 0XCC00, 0X8800, 0X7401,
+		0X6002, 0X9C03, 0XD803, 0X2402, 0X5003, 0XAC02, 0XE802, 0X1403,
+		0XC004, 0X3C05, 0X7805, 0X8404, 0XF005, 0X0C04, 0X4804, 0XB405,
+		0XA006, 0X5C07, 0X1807, 0XE406, 0X9007, 0X6C06, 0X2806, 0XD407,
+		0XC00B, 0X3C0A, 0X780A, 0X840B, 0XF00A, 0X0C0B, 0X480B, 0XB40A,
+		0XA009, 0X5C08, 0X1808, 0XE409, 0X9008, 0X6C09, 0X2809, 0XD408,
+		0X000F, 0XFC0E, 0XB80E, 0X440F, 0X300E, 0XCC0F, 0X880F, 0X740E,
+		0X600D, 0X9C0C, 0XD80C, 0X240D, 0X500C, 0XAC0D, 0XE80D, 0X140C,
+		0XC015, 0X3C14, 0X7814, 0X8415, 0XF014, 0X0C15, 0X4815, 0XB414,
+		0XA017, 0X5C16, 0X1816, 0XE417, 0X9016, 0X6C17, 0X2817, 0XD416,
+		0X0011, 0XFC10, 0XB810, 0X4411, 0X3010, 0XCC11, 0X8811, 0X7410,
+		0X6013, 0X9C12, 0XD812, 0X2413, 0X5012, 0XAC13, 0XE813, 0X1412,
+		0X001E, 0XFC1F, 0XB81F, 0X441E, 0X301F, 0XCC1E, 0X881E, 0X741F,
+		0X601C, 0X9C1D, 0XD81D, 0X241C, 0X501D, 0XAC1C, 0XE81C, 0X141D,
+		0XC01A, 0X3C1B, 0X781B, 0X841A, 0XF01B, 0X0C1A, 0X481A, 0XB41B,
+		0XA018, 0X5C19, 0X1819, 0XE418, 0X9019, 0X6C18, 0X2818, 0XD419,
+		0XC029, 0X3C28, 0X7828, 0X8429, 0XF028, 0X0C29, 0X4829, 0XB428,
+		0XA02B, 0X5C2A, 0X182A, 0XE42B, 0X902A, 0X6C2B, 0X282B, 0XD42A,
+		0X002D, 0XFC2C, 0XB82C, 0X442D, 0X302C, 0XCC2D, 0X882D, 0X742C,
+		0X602F, 0X9C2E, 0XD82E, 0X242F, 0X502E, 0XAC2F, 0XE82F, 0X142E,
+		0X0022, 0XFC23, 0XB823, 0X4422, 0X3023, 0XCC22, 0X8822, 0X7423,
+		0X6020, 0X9C21, 0XD821, 0X2420, 0X5021, 0XAC20, 0XE820, 0X1421,
+		0XC026, 0X3C27, 0X7827, 0X8426, 0XF027, 0X0C26, 0X4826, 0XB427,
+		0XA024, 0X5C25, 0X1825, 0XE424, 0X9025, 0X6C24, 0X2824, 0XD425,
+		0X003C, 0XFC3D, 0XB83D, 0X443C, 0X303D, 0XCC3C, 0X883C, 0X743D,
+		0X603E, 0X9C3F, 0XD83F, 0X243E, 0X503F, 0XAC3E, 0XE83E, 0X143F,
+		0XC038, 0X3C39, 0X7839, 0X8438, 0XF039, 0X0C38, 0X4838, 0XB439,
+		0XA03A, 0X5C3B, 0X183B, 0XE43A, 0X903B, 0X6C3A, 0X283A, 0XD43B,
+		0XC037, 0X3C36, 0X7836, 0X8437, 0XF036, 0X0C37, 0X4837, 0XB436,
+		0XA035, 0X5C34, 0X1834, 0XE435, 0X9034, 0X6C35, 0X2835, 0XD434,
+		0X0033, 0XFC32, 0XB832, 0X4433, 0X3032, 0XCC33, 0X8833, 0X7432,
+		0X6031, 0X9C30, 0XD830, 0X2431, 0X5030, 0XAC31, 0XE831, 0X1430};
+
+#if MBR_CRC_SLICING8_ENABLED
+static const uint16_t crc_table_4[256] = {
+		0X0000, 0XC03D, 0XC079, 0X0044, 0XC0F1, 0X00CC, 0X0088, 0XC0B5,
+		0XC1E1, 0X01DC, 0X0198, 0XC1A5, 0X0110, 0XC12D, 0XC169, 0X0154,
+		0XC3C1, 0X03FC, 0X03B8, 0XC385, 0X0330, 0XC30D, 0XC349, 0X0374,
+		0X0220, 0XC21D, 0XC259, 0X0264, 0XC2D1, 0X02EC, 0X02A8, 0XC295,
+		0XC781, 0X07BC, 0X07F8, 0XC7C5, 0X0770, 0XC74D, 0XC709, 0X0734,
+		0X0660, 0XC65D, 0XC619, 0X0624, 0XC691, 0X06AC, 0X06E8, 0XC6D5,
+		0X0440, 0XC47D, 0XC439, 0X0404, 0XC4B1, 0X048C, 0X04C8, 0XC4F5,
+		0XC5A1, 0X059C, 0X05D8, 0XC5E5, 0X0550, 0XC56D, 0XC529, 0X0514,
+		0XCF01, 0X0F3C, 0X0F78, 0XCF45, 0X0FF0, 0XCFCD, 0XCF89, 0X0FB4,
+		0X0EE0, 0XCEDD, 0XCE99, 0X0EA4, 0XCE11, 0X0E2C, 0X0E68, 0XCE55,
+		0X0CC0, 0XCCFD, 0XCCB9, 0X0C84, 0XCC31, 0X0C0C, 0X0C48, 0XCC75,
+		0XCD21, 0X0D1C, 0X0D58, 0XCD65, 0X0DD0, 0XCDED, 0XCDA9, 0X0D94,
+		0X0880, 0XC8BD, 0XC8F9, 0X08C4, 0XC871, 0X084C, 0X0808, 0XC835,
+		0XC961, 0X095C, 0X0918, 0XC925, 0X0990, 0XC9AD, 0XC9E9, 0X09D4,
+		0XCB41, 0X0B7C, 0X0B38, 0XCB05, 0X0BB0, 0XCB8D, 0XCBC9, 0X0BF4,
+		0X0AA0, 0XCA9D, 0XCAD9, 0X0AE4, 0XCA51, 0X0A6C, 0X0A28, 0XCA15,
+		0XDE01, 0X1E3C, 0X1E78, 0XDE45, 0X1EF0, 0XDECD, 0XDE89, 0X1EB4,
+		0X1FE0, 0XDFDD, 0XDF99, 0X1FA4, 0XDF11, 0X1F2C, 0X1F68, 0XDF55,
+		0X1DC0, 0XDDFD, 0XDDB9, 0X1D84, 0XDD31, 0X1D0C, 0X1D48, 0XDD75,
+		0XDC21, 0X1C1C, 0X1C58, 0XDC65, 0X1CD0, 0XDCED, 0XDCA9, 0X1C94,
+		0X1980, 0XD9BD, 0XD9F9, 0X19C4, 0XD971, 0X194C, 0X1908, 0XD935,
+		0XD861, 0X185C, 0X1818, 0XD825, 0X1890, 0XD8AD, 0XD8E9, 0X18D4,
+		0XDA41, 0X1A7C, 0X1A38, 0XDA05, 0X1AB0, 0XDA8D, 0XDAC9, 0X1AF4,
+		0X1BA0, 0XDB9D, 0XDBD9, 0X1BE4, 0XDB51, 0X1B6C, 0X1B28, 0XDB15,
+		0X1100, 0XD13D, 0XD179, 0X1144, 0XD1F1, 0X11CC, 0X1188, 0XD1B5,
+		0XD0E1, 0X10DC, 0X1098, 0XD0A5, 0X1010, 0XD02D, 0XD069, 0X1054,
+		0XD2C1, 0X12FC, 0X12B8, 0XD285, 0X1230, 0XD20D, 0XD249, 0X1274,
+		0X1320, 0XD31D, 0XD359, 0X1364, 0XD3D1, 0X13EC, 0X13A8, 0XD395,
+		0XD681, 0X16BC, 0X16F8, 0XD6C5, 0X1670, 0XD64D, 0XD609, 0X1634,
+		0X1760, 0XD75D, 0XD719, 0X1724, 0XD791, 0X17AC, 0X17E8, 0XD7D5,
+		0X1540, 0XD57D, 0XD539, 0X1504, 0XD5B1, 0X158C, 0X15C8, 0XD5F5,
+		0XD4A1, 0X149C, 0X14D8, 0XD4E5, 0X1450, 0XD46D, 0XD429, 0X1414};
+
+static const uint16_t crc_table_5[256] = {
+		0X0000, 0XD101, 0XE201, 0X3300, 0X8401, 0X5500, 0X6600, 0XB701,
+		0X4801, 0X9900, 0XAA00, 0X7B01, 0XCC00, 0X1D01, 0X2E01, 0XFF00,
+		0X9002, 0X4103, 0X7203, 0XA302, 0X1403, 0XC502, 0XF602, 0X2703,
+		0XD803, 0X0902, 0X3A02, 0XEB03, 0X5C02, 0X8D03, 0XBE03, 0X6F02,
+		0X6007, 0XB106, 0X8206, 0X5307, 0XE406, 0X3507, 0X0607, 0XD706,
+		0X2806, 0XF907, 0XCA07, 0X1B06, 0XAC07, 0X7D06, 0X4E06, 0X9F07,
+		0XF005, 0X2104, 0X1204, 0XC305, 0X7404, 0XA505, 0X9605, 0X4704,
+		0XB804, 0X6905, 0X5A05, 0X8B04, 0X3C05, 0XED04, 0XDE04, 0X0F05,
+		0XC00E, 0X110F, 0X220F, 0XF30E, 0X440F, 0X950E, 0XA60E, 0X770F,
+		0X880F, 0X590E, 0X6A0E, 0XBB0F, 0X0C0E, 0XDD0F, 0XEE0F, 0X3F0E,
+		0X500C, 0X810D, 0XB20D, 0X630C, 0XD40D, 0X050C, 0X360C, 0XE70D,
+		0X180D, 0XC90C, 0XFA0C, 0X2B0D, 0X9C0C, 0X4D0D, 0X7E0D, 0XAF0C,
+		0XA009, 0X7108, 0X4208, 0X9309, 0X2408, 0XF509, 0XC609, 0X1708,
+		0XE808, 0X3909, 0X0A09, 0XDB08, 0X6C09, 0XBD08, 0X8E08, 0X5F09,
+		0X300B, 0XE10A, 0XD20A, 0X030B, 0XB40A, 0X650B, 0X560B, 0X870A,
+		0X780A, 0XA90B, 0X9A0B, 0X4B0A, 0XFC0B, 0X2D0A, 0X1E0A, 0XCF0B,
+		0XC01F, 0X111E, 0X221E, 0XF31F, 0X441E, 0X951F, 0XA61F, 0X771E,
+		0X881E, 0X591F, 0X6A1F, 0XBB1E, 0X0C1F, 0XDD1E, 0XEE1E, 0X3F1F,
+		0X501D, 0X811C, 0XB21C, 0X631D, 0XD41C, 0X051D, 0X361D, 0XE71C,
+		0X181C, 0XC91D, 0XFA1D, 0X2B1C, 0X9C1D, 0X4D1C, 0X7E1C, 0XAF1D,
+		0XA018, 0X7119, 0X4219, 0X9318, 0X2419, 0XF518, 0XC618, 0X1719,
+		0XE819, 0X3918, 0X0A18, 0XDB19, 0X6C18, 0XBD19, 0X8E19, 0X5F18,
+		0X301A, 0XE11B, 0XD21B, 0X031A, 0XB41B, 0X651A, 0X561A, 0X871B,
+		0X781B, 0XA91A, 0X9A1A, 0X4B1B, 0XFC1A, 0X2D1B, 0X1E1B, 0XCF1A,
+		0X0011, 0XD110, 0XE210, 0X3311, 0X8410, 0X5511, 0X6611, 0XB710,
+		0X4810, 0X9911, 0XAA11, 0X7B10, 0XCC11, 0X1D10, 0X2E10, 0XFF11,
+		0X9013, 0X4112, 0X7212, 0XA313, 0X1412, 0XC513, 0XF613, 0X2712,
+		0XD812, 0X0913, 0X3A13, 0XEB12, 0X5C13, 0X8D12, 0XBE12, 0X6F13,
+		0X6016, 0XB117, 0X8217, 0X5316, 0XE417, 0X3516, 0X0616, 0XD717,
+		0X2817, 0XF916, 0XCA16, 0X1B17, 0XAC16, 0X7D17, 0X4E17, 0X9F16,
+		0XF014, 0X2115, 0X1215, 0XC314, 0X7415, 0XA514, 0X9614, 0X4715,
+		0XB815, 0X6914, 0X5A14, 0X8B15, 0X3C14, 0XED15, 0XDE15, 0X0F14};
+
+static const uint16_t crc_table_6[256] = {
+		0X0000, 0XC010, 0XC023, 0X0033, 0XC045, 0X0055, 0X0066, 0XC076,
+		0XC089, 0X0099, 0X00AA, 0XC0BA, 0X00CC, 0XC0DC, 0XC0EF, 0X00FF,
+		0XC111, 0X0101, 0X0132, 0XC122, 0X0154, 0XC144, 0XC177, 0X0167,
+		0X0198, 0XC188, 0XC1BB, 0X01AB, 0XC1DD, 0X01CD, 0X01FE, 0XC1EE,
+		0XC221, 0X0231, 0X0202, 0XC212, 0X0264, 0XC274, 0XC247, 0X0257,
+		0X02A8, 0XC2B8, 0XC28B, 0X029B, 0XC2ED, 0X02FD, 0X02CE, 0XC2DE,
+		0X0330, 0XC320, 0XC313, 0X0303, 0XC375, 0X0365, 0X0356, 0XC346,
+		0XC3B9, 0X03A9, 0X039A, 0XC38A, 0X03FC, 0XC3EC, 0XC3DF, 0X03CF,
+		0XC441, 0X0451, 0X0462, 0XC472, 0X0404, 0XC414, 0XC427, 0X0437,
+		0X04C8, 0XC4D8, 0XC4EB, 0X04FB, 0XC48D, 0X049D, 0X04AE, 0XC4BE,
+		0X0550, 0XC540, 0XC573, 0X0563, 0XC515, 0X0505, 0X0536, 0XC526,
+		0XC5D9, 0X05C9, 0X05FA, 0XC5EA, 0X059C, 0XC58C, 0XC5BF, 0X05AF,
+		0X0660, 0XC670, 0XC643, 0X0653, 0XC625, 0X0635, 0X0606, 0XC616,
+		0XC6E9, 0X06F9, 0X06CA, 0XC6DA, 0X06AC, 0XC6BC, 0XC68F, 0X069F,
+		0XC771, 0X0761, 0X0752, 0XC742, 0X0734, 0XC724, 0XC717, 0X0707,
+		0X07F8, 0XC7E8, 0XC7DB, 0X07CB, 0XC7BD, 0X07AD, 0X079E, 0XC78E,
+		0XC881, 0X0891, 0X08A2, 0XC8B2, 0X08C4, 0XC8D4, 0XC8E7, 0X08F7,
+		0X0808, 0XC818, 0XC82B, 0X083B, 0XC84D, 0X085D, 0X086E, 0XC87E,
+		0X0990, 0XC980, 0XC9B3, 0X09A3, 0XC9D5, 0X09C5, 0X09F6, 0XC9E6,
+		0XC919, 0X0909, 0X093A, 0XC92A, 0X095C, 0XC94C, 0XC97F, 0X096F,
+		0X0AA0, 0XCAB0, 0XCA83, 0X0A93, 0XCAE5, 0X0AF5, 0X0AC6, 0XCAD6,
+		0XCA29, 0X0A39, 0X0A0A, 0XCA1A, 0X0A6C, 0XCA7C, 0XCA4F, 0X0A5F,
+		0XCBB1, 0X0BA1, 0X0B92, 0XCB82, 0X0BF4, 0XCBE4, 0XCBD7, 0X0BC7,
+		0X0B38, 0XCB28, 0XCB1B, 0X0B0B, 0XCB7D, 0X0B6D, 0X0B5E, 0XCB4E,
+		0X0CC0, 0XCCD0, 0XCCE3, 0X0CF3, 0XCC85, 0X0C95, 0X0CA6, 0XCCB6,
+		0XCC49, 0X0C59, 0X0C6A, 0XCC7A, 0X0C0C, 0XCC1C, 0XCC2F, 0X0C3F,
+		0XCDD1, 0X0DC1, 0X0DF2, 0XCDE2, 0X0D94, 0XCD84, 0XCDB7, 0X0DA7,
+		0X0D58, 0XCD48, 0XCD7B, 0X0D6B, 0XCD1D, 0X0D0D, 0X0D3E, 0XCD2E,
+		0XCEE1, 0X0EF1, 0X0EC2, 0XCED2, 0X0EA4, 0XCEB4, 0XCE87, 0X0E97,
+		0X0E68, 0XCE78, 0XCE4B, 0X0E5B, 0XCE2D, 0X0E3D, 0X0E0E, 0XCE1E,
+		0X0FF0, 0XCFE0, 0XCFD3, 0X0FC3, 0XCFB5, 0X0FA5, 0X0F96, 0XCF86,
+		0XCF79, 0X0F69, 0X0F5A, 0XCF4A, 0X0F3C, 0XCF2C, 0XCF1F, 0X0F0F};
+
+static const uint16_t crc_table_7[256] = {
+		0X0000, 0XCCC1, 0XD981, 0X1540, 0XF301, 0X3FC0, 0X2A80, 0XE641,
+		0XA601, 0X6AC0, 0X7F80, 0XB341, 0X5500, 0X99C1, 0X8C81, 0X4040,
+		0X0C01, 0XC0C0, 0XD580, 0X1941, 0XFF00, 0X33C1, 0X2681, 0XEA40,
+		0XAA00, 0X66C1, 0X7381, 0XBF40, 0X5901, 0X95C0, 0X8080, 0X4C41,
+		0X1802, 0XD4C3, 0XC183, 0X0D42, 0XEB03, 0X27C2, 0X3282, 0XFE43,
+		0XBE03, 0X72C2, 0X6782, 0XAB43, 0X4D02, 0X81C3, 0X9483, 0X5842,
+		0X1403, 0XD8C2, 0XCD82, 0X0143, 0XE702, 0X2BC3, 0X3E83, 0XF242,
+		0XB202, 0X7EC3, 0X6B83, 0XA742, 0X4103, 0X8DC2, 0X9882, 0X5443,
+		0X3004, 0XFCC5, 0XE985, 0X2544, 0XC305, 0X0FC4, 0X1A84, 0XD645,
+		0X9605, 0X5AC4, 0X4F84, 0X8345, 0X6504, 0XA9C5, 0XBC85, 0X7044,
+		0X3C05, 0XF0C4, 0XE584, 0X2945, 0XCF04, 0X03C5, 0X1685, 0XDA44,
+		0X9A04, 0X56C5, 0X4385, 0X8F44, 0X6905, 0XA5C4, 0XB084, 0X7C45,
+		0X2806, 0XE4C7, 0XF187, 0X3D46, 0XDB07, 0X17C6, 0X0286, 0XCE47,
+		0X8E07, 0X42C6, 0X5786, 0X9B47, 0X7D06, 0XB1C7, 0XA487, 0X6846,
+		0X2407, 0XE8C6, 0XFD86, 0X3147, 0XD706, 0X1BC7, 0X0E87, 0XC246,
+		0X8206, 0X4EC7, 0X5B87, 0X9746, 0X7107, 0XBDC6, 0XA886, 0X6447,
+		0X6008, 0XACC9, 0XB989, 0X7548, 0X9309, 0X5FC8, 0X4A88, 0X8649,
+		0XC609, 0X0AC8, 0X1F88, 0XD349, 0X3508, 0XF9C9, 0XEC89, 0X2048,
+		0X6C09, 0XA0C8, 0XB588, 0X7949, 0X9F08, 0X53C9, 0X4689, 0X8A48,
+		0XCA08, 0X06C9, 0X1389, 0XDF48, 0X3909, 0XF5C8, 0XE088, 0X2C49,
+		0X780A, 0XB4CB, 0XA18B, 0X6D4A, 0X8B0B, 0X47CA, 0X528A, 0X9E4B,
+		0XDE0B, 0X12CA, 0X078A, 0XCB4B, 0X2D0A, 0XE1CB, 0XF48B, 0X384A,
+		0X740B, 0XB8CA, 0XAD8A, 0X614B, 0X870A, 0X4BCB, 0X5E8B, 0X924A,
+		0XD20A, 0X1ECB, 0X0B8B, 0XC74A, 0X210B, 0XEDCA, 0XF88A, 0X344B,
+		0X500C, 0X9CCD, 0X898D, 0X454C, 0XA30D, 0X6FCC, 0X7A8C, 0XB64D,
+		0XF60D, 0X3ACC, 0X2F8C, 0XE34D, 0X050C, 0XC9CD, 0XDC8D, 0X104C,
+		0X5C0D, 0X90CC, 0X858C, 0X494D, 0XAF0C, 0X63CD, 0X768D, 0XBA4C,
+		0XFA0C, 0X36CD, 0X238D, 0XEF4C, 0X090D, 0XC5CC, 0XD08C, 0X1C4D,
+		0X480E, 0X84CF, 0X918F, 0X5D4E, 0XBB0F, 0X77CE, 0X628E, 0XAE4F,
+		0XEE0F, 0X22CE, 0X378E, 0XFB4F, 0X1D0E, 0XD1CF, 0XC48F, 0X084E,
+		0X440F, 0X88CE, 0X9D8E, 0X514F, 0XB70E, 0X7BCF, 0X6E8F, 0XA24E,
+		0XE20E, 0X2ECF, 0X3B8F, 0XF74E, 0X110F, 0XDDCE, 0XC88E, 0X044F};
+
+#endif	//MBR_CRC_SLICING8_ENABLED
+#endif	//MBR_CRC_SLICING4_ENABLED
+
+/*PUBLIC FUNCTIONS*/
+uint16_t MBR_CRC16_Init(void)
+{
+	return MBR_CRC16_INIT;
+}
+
+/**
+ * @brief Updating the running CRC16 (Modbus) with the next part of data.
+ * @param crc Running CRC value, MBR_CRC16_Init() for the first part.
+ * @param buf Data.
+ * @param len Number of bytes.
+ * @retval updated CRC value
+ */
+uint16_t MBR_CRC16_Update(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+#if MBR_CRC_ENGINE == MBR_CRC_SLICING4
+	return MBR_CRC16_Update_Slicing4(crc, buf, len);
+#elif MBR_CRC_ENGINE == MBR_CRC_SLICING8
+	return MBR_CRC16_Update_Slicing8(crc, buf, len);
+#elif MBR_CRC_ENGINE == MBR_CRC_HARDWARE
+	return MBR_CRC16_Update_Hardware(crc, buf, len);
+#elif MBR_CRC_ENGINE == MBR_CRC_CLMUL
+	return MBR_CRC16_Update_CLMUL(crc, buf, len);
+#else
+	return MBR_CRC16_Update_Table(crc, buf, len);
+#endif
+}
+
+uint16_t MBR_CRC16_Final(uint16_t crc)
+{
+	return crc;	//Modbus CRC has no final XOR, CRC Lo byte is sent first
+}
+
+/**
+ * @brief CRC16 for interrupt context (streaming CRC, interrupt fast path). The selected engine is used unless it is
+ * the CRC peripheral: its configuration and data register are shared with the main loop, which can be interrupted
+ * in the middle of a calculation, so the byte table is used instead.
+ */
+uint16_t MBR_CRC16_Update_ISR(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+#if MBR_CRC_ENGINE == MBR_CRC_HARDWARE
+	return MBR_CRC16_Update_Table(crc, buf, len);
+#else
+	return MBR_CRC16_Update(crc, buf, len);
+#endif
+}
+
+/**
+ * @brief Comparing the selected CRC engine and its interrupt variant with the reference byte table (different lengths, alignments and splits).
+ * @param none
+ * @retval 0 = ok, 1 = engine result differs from the reference
+ */
+uint8_t MBR_CRC16_Check_Engine(void)
+{
+	uint8_t buf[0x104];
+	uint32_t seed = 0x12345678;
+	uint16_t reference, crc;
+
+	for(uint32_t i=0; i<sizeof(buf); i++)
+	{
+		seed = seed*1103515245u + 12345u;
+		buf[i] = seed>>16;
+	}
+
+	for(uint32_t offset=0; offset<4; offset++)
+	{
+		for(uint32_t len=0; len<=0x100; len++)
+		{
+			reference = MBR_CRC16_Update_Table(MBR_CRC16_INIT, buf+offset, len);
+
+			if(MBR_CRC16_Update(MBR_CRC16_INIT, buf+offset, len) != reference || MBR_CRC16_Update_ISR(MBR_CRC16_INIT, buf+offset, len) != reference)
+			{
+				return 1;
+			}
+
+			crc = MBR_CRC16_Update(MBR_CRC16_INIT, buf+offset, len/3);
+			crc = MBR_CRC16_Update(crc, buf+offset+len/3, len-len/3);
+			if(crc != reference)
+			{
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+uint16_t MBR_CRC16_Update_Table(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	uint8_t xor;
+
+	while(len--)
+	{
+		xor = *buf++ ^ crc;
+		crc >>= 8;
+		crc ^= crc_table_0[xor];
+	}
+
+	return crc;
+}
+
+#if MBR_CRC_SLICING4_ENABLED
+uint16_t MBR_CRC16_Update_Slicing4(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	uint16_t x;
+
+	while(len >= 4)
+	{
+		x = crc ^ (buf[0] | (buf[1]<<8));
+		crc = crc_table_3[x & 0xFF] ^ crc_table_2[x >> 8] ^ crc_table_1[buf[2]] ^ crc_table_0[buf[3]];
+		buf += 4;
+		len -= 4;
+	}
+
+	return MBR_CRC16_Update_Table(crc, buf, len);
+}
+#endif
+
+#if MBR_CRC_SLICING8_ENABLED
+uint16_t MBR_CRC16_Update_Slicing8(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	uint16_t x;
+
+	while(len >= 8)
+	{
+		x = crc ^ (buf[0] | (buf[1]<<8));
+		crc = crc_table_7[x & 0xFF] ^ crc_table_6[x >> 8] ^ crc_table_5[buf[2]] ^ crc_table_4[buf[3]]
+			^ crc_table_3[buf[4]] ^ crc_table_2[buf[5]] ^ crc_table_1[buf[6]] ^ crc_table_0[buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+
+	return MBR_CRC16_Update_Slicing4(crc, buf, len);
+}
+#endif
+
+#if MBR_CRC_ENGINE == MBR_CRC_HARDWARE
+/**
+ * @brief CRC16 with CRC peripheral. The peripheral is reconfigured on every call,
+ * so it can be shared with other modules as long as they are not running in interrupts.
+ */
+uint16_t MBR_CRC16_Update_Hardware(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	__HAL_RCC_CRC_CLK_ENABLE();
+
+	CRC->POL = 0x8005;												//polynomial in normal representation
+	CRC->CR = CRC_CR_POLYSIZE_0 | CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;	//16 bit, input reversed by byte, output reversed
+	CRC->INIT = __RBIT(crc) >> 16;									//running value is kept reflected
+	CRC->CR |= CRC_CR_RESET;
+
+	while(len--)
+	{
+		*(__IO uint8_t *)&CRC->DR = *buf++;
+	}
+
+	return CRC->DR;
+}
+#endif
+
+#ifdef __PCLMUL__
+/**
+ * @brief CRC16 with carry-less multiplication, 8 bytes per iteration (Barrett reduction in reflected domain).
+ * q = M ^ floor(M*mu'/x^64), crc = q*P mod x^16, where mu = floor(x^80/P) = x^64 + mu'.
+ */
+uint16_t MBR_CRC16_Update_CLMUL(uint16_t crc, const uint8_t *buf, uint32_t len)
+{
+	const __m128i k = _mm_set_epi64x(0xA001, 0xF87FF5FFE7FFDFFFULL);	//reflected P mod x^16, reflected mu'
+	__m128i product;
+	uint64_t data;
+
+	while(len >= 8)
+	{
+		memcpy(&data, buf, 8);
+		data ^= crc;
+
+		product = _mm_clmulepi64_si128(_mm_cvtsi64_si128(data), k, 0x00);
+		data ^= (uint64_t)_mm_cvtsi128_si64(product) << 1;
+
+		product = _mm_clmulepi64_si128(_mm_cvtsi64_si128(data), k, 0x10);
+		crc = ((uint64_t)_mm_cvtsi128_si64(product) >> 63) | ((uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(product, product)) << 1);
+
+		buf += 8;
+		len -= 8;
+	}
+
+	return MBR_CRC16_Update_Table(crc, buf, len);
+}
+#endif
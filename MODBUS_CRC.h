@@ -0,0 +1,51 @@
+#ifndef __MODBUS_CRC_H
+#define __MODBUS_CRC_H
+
+#include <stdint.h>
+
+/*
+ * CRC16 engines, select one with MBR_CRC_ENGINE.
+ * The engine also runs in interrupts when MBR_RX_STREAMING_CRC (DMA half transfer, receiver timeout) or MBR_ISR_FAST_PATH
+ * (whole request and response) is enabled, the interrupt time grows with its cost per byte. MBR_CRC_HARDWARE is used
+ * by the main loop only, the interrupts fall back to the byte table (MBR_CRC16_Update_ISR), the slowest engine.
+ * With these options prefer the slicing engines, bench/CRC_BENCH.c compares the engines on host.
+ */
+#define MBR_CRC_TABLE			0	//byte-at-a-time table, 512 bytes of flash
+#define MBR_CRC_SLICING4		1	//slicing-by-4 tables, 4 bytes per iteration, 2 KB of flash
+#define MBR_CRC_SLICING8		2	//slicing-by-8 tables, 8 bytes per iteration, 4 KB of flash
+#define MBR_CRC_HARDWARE		3	//CRC peripheral with programmable polynomial (STM32F07x/F09x and newer)
+#define MBR_CRC_CLMUL			4	//carry-less multiplication (host build, x86 with PCLMULQDQ)
+
+#ifndef MBR_CRC_ENGINE
+#ifdef MBR_HOST_BUILD
+#define MBR_CRC_ENGINE			MBR_CRC_SLICING8
+#else
+#define MBR_CRC_ENGINE			MBR_CRC_SLICING4
+#endif
+#endif
+
+#define MBR_CRC16_INIT			0xFFFF
+
+/*
+ * Incremental usage:
+ *	crc = MBR_CRC16_Init();
+ *	crc = MBR_CRC16_Update(crc, part1, len1);
+ *	crc = MBR_CRC16_Update(crc, part2, len2);
+ *	crc = MBR_CRC16_Final(crc);
+ * CRC16 computed over the whole frame including its CRC bytes is 0 when the frame is valid.
+ */
+uint16_t MBR_CRC16_Init(void);
+uint16_t MBR_CRC16_Update(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t MBR_CRC16_Final(uint16_t crc);
+uint16_t MBR_CRC16_Update_ISR(uint16_t crc, const uint8_t *buf, uint32_t len);	//for interrupts: never touches the CRC peripheral used by the main loop
+
+uint8_t MBR_CRC16_Check_Engine(void);	//return 0 when the selected engine matches the reference table, 1 when not
+
+/*particular engines, available for comparison and benchmarking*/
+uint16_t MBR_CRC16_Update_Table(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t MBR_CRC16_Update_Slicing4(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t MBR_CRC16_Update_Slicing8(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t MBR_CRC16_Update_Hardware(uint16_t crc, const uint8_t *buf, uint32_t len);
+uint16_t MBR_CRC16_Update_CLMUL(uint16_t crc, const uint8_t *buf, uint32_t len);
+
+#endif
@@ -0,0 +1,355 @@
+/*MODBUS_HOST.c*/
+#ifdef MBR_HOST_BUILD
+
+#define _GNU_SOURCE
+#include "MODBUS_HOST.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOST_DEFAULT_BAUDRATE		19200
+#define HOST_MAX_UARTS				64
+
+/*FUNCTION PROTOTYPES*/
+static uint64_t Get_RTO_ns(UART_HandleTypeDef *huart);
+static void Receive_Bytes(UART_HandleTypeDef *huart);
+
+/*PUBLIC FUNCTIONS*/
+/**
+ * @brief Monotonic time used for tick and receiver timeout emulation.
+ * @param none
+ * @retval time in nanoseconds
+ */
+uint64_t HOST_Get_Time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	static uint64_t start_time;
+
+	if(start_time == 0)
+	{
+		start_time = HOST_Get_Time_ns();
+	}
+
+	return (uint32_t)((HOST_Get_Time_ns() - start_time) / 1000000u);
+}
+
+/**
+ * @brief Binding the UART handle to an already opened file descriptor.
+ * @param huart UART handle.
+ * @param fd File descriptor of the transport (tty, pty or socket).
+ * @retval none
+ */
+void HOST_UART_Attach(UART_HandleTypeDef *huart, int fd)
+{
+	memset(huart, 0, sizeof(UART_HandleTypeDef));
+
+	huart->fd = fd;
+	huart->dma_rx.Instance = &huart->dma_rx_channel;
+	huart->hdmarx = &huart->dma_rx;
+	huart->Init.BaudRate = HOST_DEFAULT_BAUDRATE;
+	huart->Init.WordLength = UART_WORDLENGTH_9B;
+	huart->Init.Parity = UART_PARITY_EVEN;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * @brief Opening the pseudo-terminal master side and binding it to the UART handle.
+ * @param huart UART handle.
+ * @param slave_name Buffer for the slave device path (e.g. /dev/pts/3), Modbus master tools can open it.
+ * @param slave_name_size Size of slave_name buffer.
+ * @retval 0 = ok, -1 = error
+ */
+int HOST_UART_Open_PTY(UART_HandleTypeDef *huart, char *slave_name, size_t slave_name_size)
+{
+	struct termios tio;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0)
+	{
+		return -1;
+	}
+
+	if(grantpt(fd) || unlockpt(fd) || ptsname_r(fd, slave_name, slave_name_size))
+	{
+		close(fd);
+		return -1;
+	}
+
+	if(tcgetattr(fd, &tio) == 0)	//raw mode, no echo and no line discipline
+	{
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	HOST_UART_Attach(huart, fd);
+
+	return 0;
+}
+
+/**
+ * @brief Creating a socketpair, one end is bound to the UART handle, the other one is returned to the caller.
+ * @param huart UART handle.
+ * @retval peer file descriptor (load generator side), -1 = error
+ */
+int HOST_UART_Open_Socketpair(UART_HandleTypeDef *huart)
+{
+	int fds[2];
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+	{
+		return -1;
+	}
+
+	HOST_UART_Attach(huart, fds[0]);
+
+	return fds[1];
+}
+
+void HOST_UART_Close(UART_HandleTypeDef *huart)
+{
+	if(huart->fd >= 0)
+	{
+		close(huart->fd);
+	}
+
+	huart->fd = -1;
+	huart->rx_buffer = NULL;
+}
+
+/**
+ * @brief Emulation of UART/DMA interrupts. Reads the transport and fires HAL callbacks.
+ * @param huart UART handle.
+ * @param timeout_ms Maximum time to wait for an event, 0 = do not wait, -1 = wait forever.
+ * @retval number of fired callbacks, -1 = transport error
+ */
+int HOST_UART_Poll(UART_HandleTypeDef *huart, int timeout_ms)
+{
+	return HOST_UART_Poll_Multiple(&huart, 1, timeout_ms);
+}
+
+/**
+ * @brief Emulation of UART/DMA interrupts for several UARTs at once (one poll() for all transports).
+ * @param huarts Array of UART handles.
+ * @param count Number of UART handles (up to HOST_MAX_UARTS).
+ * @param timeout_ms Maximum time to wait for an event, 0 = do not wait, -1 = wait forever.
+ * @retval number of fired callbacks, -1 = transport error (callbacks of all UARTs have been fired, the failed ones have flg_hangup set)
+ */
+int HOST_UART_Poll_Multiple(UART_HandleTypeDef **huarts, uint32_t count, int timeout_ms)
+{
+	struct pollfd pfd[HOST_MAX_UARTS];
+	UART_HandleTypeDef *huart;
+	uint64_t now, rto_deadline;
+	int callbacks = 0;
+	int wait_ms = timeout_ms;
+	int rto_ms;
+	uint8_t flg_transport_error = 0;
+
+	if(count > HOST_MAX_UARTS)
+	{
+		return -1;
+	}
+
+	for(uint32_t i=0; i<count; i++)
+	{
+		huart = huarts[i];
+
+		if(huart->flg_tx_complete)
+		{
+			huart->flg_tx_complete = 0;
+			HAL_UART_TxCpltCallback(huart);
+			callbacks++;
+			wait_ms = 0;
+		}
+
+		if(huart->flg_rx_pending)	//do not sleep past the receiver timeout
+		{
+			rto_deadline = huart->last_rx_time_ns + Get_RTO_ns(huart);
+			now = HOST_Get_Time_ns();
+			rto_ms = (rto_deadline > now) ? (int)((rto_deadline - now + 999999u) / 1000000u) : 0;
+			if(wait_ms < 0 || rto_ms < wait_ms)
+			{
+				wait_ms = rto_ms;
+			}
+		}
+
+		pfd[i].fd = huart->fd;
+		pfd[i].events = POLLIN;
+		pfd[i].revents = 0;
+	}
+
+	if(poll(pfd, count, wait_ms) < 0)
+	{
+		return (errno == EINTR) ? callbacks : -1;
+	}
+
+	for(uint32_t i=0; i<count; i++)
+	{
+		huart = huarts[i];
+
+		if(pfd[i].revents & POLLIN)
+		{
+			Receive_Bytes(huart);
+		}
+		if(pfd[i].revents & (POLLHUP | POLLERR))	//bytes received before the hang-up and other UARTs are still served, the error is reported at the end
+		{
+			huart->flg_hangup = 1;
+			flg_transport_error = 1;
+		}
+
+		if(huart->flg_rx_pending && huart->flg_rto_enabled)
+		{
+			if(HOST_Get_Time_ns() - huart->last_rx_time_ns >= Get_RTO_ns(huart))
+			{
+				huart->flg_rx_pending = 0;
+				huart->rx_buffer = NULL;	//HAL aborts DMA reception on blocking errors
+				huart->ErrorCode |= HAL_UART_ERROR_RTO;
+				HAL_UART_ErrorCallback(huart);
+				callbacks++;
+			}
+		}
+	}
+
+	return flg_transport_error ? -1 : callbacks;
+}
+
+/*HAL API*/
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	if(huart->Init.BaudRate == 0)
+	{
+		huart->Init.BaudRate = HOST_DEFAULT_BAUDRATE;
+	}
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Abort_IT(UART_HandleTypeDef *huart)
+{
+	huart->rx_buffer = NULL;
+	huart->flg_rx_pending = 0;
+	huart->flg_tx_complete = 0;
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if(huart->rx_buffer != NULL)
+	{
+		return HAL_BUSY;
+	}
+
+	huart->rx_buffer = pData;
+	huart->rx_size = Size;
+	huart->hdmarx->Instance->CNDTR = Size;
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+	struct pollfd pfd = {huart->fd, POLLOUT, 0};
+	ssize_t written;
+
+	while(Size)
+	{
+		written = write(huart->fd, pData, Size);
+		if(written < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return HAL_ERROR;
+		}
+
+		pData += written;
+		Size -= written;
+	}
+
+	huart->flg_tx_complete = 1;	//TxCpltCallback is fired from HOST_UART_Poll, as from the interrupt
+
+	return HAL_OK;
+}
+
+void HAL_UART_ReceiverTimeout_Config(UART_HandleTypeDef *huart, uint32_t TimeoutValue)
+{
+	huart->rto_bits = TimeoutValue;
+}
+
+HAL_StatusTypeDef HAL_UART_EnableReceiverTimeout(UART_HandleTypeDef *huart)
+{
+	huart->flg_rto_enabled = 1;
+
+	return HAL_OK;
+}
+
+/*PRIVATE FUNCTIONS*/
+static uint64_t Get_RTO_ns(UART_HandleTypeDef *huart)
+{
+	uint32_t baudrate = huart->Init.BaudRate ? huart->Init.BaudRate : HOST_DEFAULT_BAUDRATE;
+
+	return (uint64_t)huart->rto_bits * 1000000000u / baudrate;
+}
+
+static void Receive_Bytes(UART_HandleTypeDef *huart)
+{
+	uint8_t discard[0x100];
+	uint32_t received, left;
+	ssize_t len;
+
+	for(;;)
+	{
+		left = huart->rx_buffer ? huart->hdmarx->Instance->CNDTR : 0;
+
+		if(left)
+		{
+			received = huart->rx_size - left;
+			len = read(huart->fd, huart->rx_buffer + received, left);
+		}
+		else	//reception is not armed or DMA buffer is full: bytes are lost (overrun)
+		{
+			len = read(huart->fd, discard, sizeof(discard));
+			if(len > 0)
+			{
+				huart->ErrorCode |= HAL_UART_ERROR_ORE;
+			}
+		}
+
+		if(len <= 0)
+		{
+			break;
+		}
+
+		if(left)
+		{
+			huart->hdmarx->Instance->CNDTR = left - len;
+		}
+
+		huart->flg_rx_pending = 1;
+		huart->last_rx_time_ns = HOST_Get_Time_ns();
+	}
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef __MODBUS_HOST_H
+#define __MODBUS_HOST_H
+
+/*
+ * Minimal emulation of the STM32 HAL UART/DMA API used by MODBUS.c.
+ * Compile MODBUS.c and MODBUS_HOST.c with -DMBR_HOST_BUILD to run the library on a Linux host.
+ * UART is mapped to a file descriptor (pseudo-terminal or socketpair), receiver timeout is emulated
+ * by measuring the idle time between incoming bytes.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define __weak				__attribute__((weak))
+#define __ALIGNED(x)		__attribute__((aligned(x)))
+#define UNUSED(X)			(void)(X)
+
+typedef enum
+{
+	HAL_OK			= 0x00,
+	HAL_ERROR		= 0x01,
+	HAL_BUSY		= 0x02,
+	HAL_TIMEOUT		= 0x03
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	HAL_UNLOCKED	= 0x00,
+	HAL_LOCKED		= 0x01
+} HAL_LockTypeDef;
+
+#define HAL_UART_ERROR_NONE		0x00000000U
+#define HAL_UART_ERROR_PE		0x00000001U
+#define HAL_UART_ERROR_NE		0x00000002U
+#define HAL_UART_ERROR_FE		0x00000004U
+#define HAL_UART_ERROR_ORE		0x00000008U
+#define HAL_UART_ERROR_DMA		0x00000010U
+#define HAL_UART_ERROR_RTO		0x00000020U
+
+#define UART_WORDLENGTH_7B		0x10000000U
+#define UART_WORDLENGTH_8B		0x00000000U
+#define UART_WORDLENGTH_9B		0x00001000U
+
+#define UART_PARITY_NONE		0x00000000U
+#define UART_PARITY_EVEN		0x00000400U
+#define UART_PARITY_ODD			0x00000600U
+
+#define UART_STOPBITS_1			0x00000000U
+#define UART_STOPBITS_2			0x00002000U
+
+typedef struct
+{
+	volatile uint32_t	CNDTR;					//number of data items left to transfer
+} DMA_Channel_TypeDef;
+
+typedef struct
+{
+	DMA_Channel_TypeDef	*Instance;
+} DMA_HandleTypeDef;
+
+typedef struct
+{
+	uint32_t			BaudRate;
+	uint32_t			WordLength;
+	uint32_t			StopBits;
+	uint32_t			Parity;
+} UART_InitTypeDef;
+
+typedef struct __UART_HandleTypeDef
+{
+	UART_InitTypeDef	Init;
+	DMA_HandleTypeDef	*hdmarx;
+	volatile uint32_t	ErrorCode;
+
+	/*host emulation state*/
+	int					fd;						//transport file descriptor
+	DMA_HandleTypeDef	dma_rx;
+	DMA_Channel_TypeDef	dma_rx_channel;
+	uint8_t				*rx_buffer;				//DMA target, NULL when reception is not armed
+	uint16_t			rx_size;
+	uint32_t			rto_bits;				//receiver timeout in bit times
+	uint8_t				flg_rto_enabled;
+	uint8_t				flg_rx_pending;			//bytes received since the last receiver timeout
+	uint8_t				flg_tx_complete;		//transmission finished, TxCpltCallback is pending
+	uint8_t				flg_hangup;				//transport has been closed by the peer or failed, reported by HOST_UART_Poll
+	uint64_t			last_rx_time_ns;
+} UART_HandleTypeDef;
+
+
+/*HAL API subset*/
+uint32_t HAL_GetTick(void);
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Abort_IT(UART_HandleTypeDef *huart);
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size);
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size);
+void HAL_UART_ReceiverTimeout_Config(UART_HandleTypeDef *huart, uint32_t TimeoutValue);
+HAL_StatusTypeDef HAL_UART_EnableReceiverTimeout(UART_HandleTypeDef *huart);
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart);
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart);
+
+
+/*host transport*/
+void HOST_UART_Attach(UART_HandleTypeDef *huart, int fd);
+int HOST_UART_Open_PTY(UART_HandleTypeDef *huart, char *slave_name, size_t slave_name_size);
+int HOST_UART_Open_Socketpair(UART_HandleTypeDef *huart);
+void HOST_UART_Close(UART_HandleTypeDef *huart);
+int HOST_UART_Poll(UART_HandleTypeDef *huart, int timeout_ms);
+int HOST_UART_Poll_Multiple(UART_HandleTypeDef **huarts, uint32_t count, int timeout_ms);	//up to 64 UARTs
+
+uint64_t HOST_Get_Time_ns(void);
+
+#endif
@@ -0,0 +1,750 @@
+/*MODBUS_PERSIST.c*/
+#include "MODBUS_PERSIST.h"
+#include "MODBUS_CRC.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef MBR_HOST_BUILD
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifndef MBR_PERSIST_SPACES
+#define MBR_PERSIST_SPACES			4		//persisted address spaces
+#endif
+
+#ifndef MBR_PERSIST_REGISTERS
+#define MBR_PERSIST_REGISTERS		256		//persisted registers of all spaces (size of the journal)
+#endif
+
+#ifndef MBR_PERSIST_DELAY
+#define MBR_PERSIST_DELAY			1000	//age of the journal before it is committed [ms], writes arriving meanwhile are coalesced
+#endif
+
+#ifndef MBR_PERSIST_BATCH
+#define MBR_PERSIST_BATCH			32		//records written by one MBR_Persist_Process call, a full batch is committed without waiting
+#endif
+
+/*
+ * Flash layout, all items are 8 bytes (one doubleword program):
+ *	sector header:	magic (32 bits), sequence (32 bits)
+ *	record:			register address, value, CRC16 of address and value, 0x0000
+ * A sector starts with the snapshot of all persisted registers closed by the mark record, single records follow.
+ */
+#define PERSIST_ITEM_SIZE			8
+#define PERSIST_MAGIC				0x5052424Du	//"MBRP"
+#define PERSIST_ERASED				0xFFFFFFFFFFFFFFFFull
+#define PERSIST_MARK_ADDRESS		0xFFFF		//snapshot is complete, register 0xFFFF cannot be persisted
+#define PERSIST_MARK_VALUE			0x5AA5
+
+typedef struct __persist_space_t
+{
+	address_space_t		*address_space;
+	uint16_t			first;					//journal bit of the first register
+} persist_space_t;
+
+struct __persist_t
+{
+	uint32_t			flash_address;
+	uint32_t			sector_size;
+	uint8_t				sector_count;
+	uint8_t				active;					//sector being appended
+	uint32_t			position;				//offset of the next record in the active sector
+	uint32_t			sequence;				//sequence of the active sector, incremented with every new sector
+	persist_space_t		spaces[MBR_PERSIST_SPACES];
+	uint8_t				space_count;
+	uint16_t			register_count;
+	uint32_t			journal[(MBR_PERSIST_REGISTERS + 31) / 32];	//dirty bit of every persisted register
+	uint32_t			dirty;					//number of dirty bits
+	uint32_t			dirty_time;				//tick of the oldest uncommitted write
+	uint8_t				flg_restored;			//log is open, records can be appended
+	persist_status_t	status;
+};
+
+/*VARIABLES*/
+#if MBR_STATIC_ALLOCATION
+static persist_t persist_pool;
+static uint8_t flg_persist_used;
+#endif
+#ifdef MBR_HOST_BUILD
+static int host_fd = -1;
+#elif defined(FLASH_FLAG_ECCD)
+static volatile uint8_t flg_ecc_error;	//set by MBR_Persist_ECC_Error_Handler in NMI
+#endif
+
+/*FUNCTION PROTOTYPES*/
+static persist_space_t *Find_Register(persist_t *persist, uint16_t register_address, uint16_t *offset);
+static uint16_t Read_Register(address_space_t *address_space, uint16_t offset);
+static uint64_t Make_Record(uint16_t register_address, uint16_t value);
+static uint8_t Check_Record(uint64_t record);
+static uint8_t Read_Header(persist_t *persist, uint8_t sector, uint32_t *sequence);
+static uint32_t Scan_Sector(persist_t *persist, uint8_t sector, uint8_t *flg_complete);
+static void Replay_Sector(persist_t *persist, uint8_t sector, uint32_t end);
+static uint8_t Write_Record(persist_t *persist, uint16_t register_address, uint16_t value);
+static uint8_t Write_Snapshot(persist_t *persist);
+static uint8_t Start_Sector(persist_t *persist);
+static uint8_t Commit(persist_t *persist, uint32_t max_records);
+
+/*PUBLIC FUNCTIONS*/
+/**
+ * @brief Creating the persistence of holding registers in a flash area of sector_count erasable sectors.
+ * Every sector has to hold twice the persisted registers plus two records (snapshot interrupted by reset and a new one).
+ * @param flash_address Address of the first sector (offset in the file on host).
+ * @param sector_size Size of a sector (erase unit, e.g. flash page), multiple of 8.
+ * @param sector_count Number of sectors, at least 2. More sectors = less erases per sector.
+ * @retval persistence, NULL = not ok
+ */
+persist_t *MBR_Persist_Init(uint32_t flash_address, uint32_t sector_size, uint8_t sector_count)
+{
+	persist_t *persist;
+
+	if(sector_count < 2 || sector_size < 4*PERSIST_ITEM_SIZE || sector_size % PERSIST_ITEM_SIZE)
+	{
+		return NULL;
+	}
+
+#if MBR_STATIC_ALLOCATION
+	if(flg_persist_used)
+	{
+		return NULL;
+	}
+	flg_persist_used = 1;
+	persist = &persist_pool;
+#else
+	persist = (persist_t*) malloc(sizeof(persist_t));
+	if(persist == NULL)
+	{
+		return NULL;
+	}
+#endif
+
+	memset(persist, 0, sizeof(persist_t));
+	persist->flash_address = flash_address;
+	persist->sector_size = sector_size;
+	persist->sector_count = sector_count;
+	persist->active = sector_count - 1;	//the first new sector is sector 0
+
+	return persist;
+}
+
+void MBR_Persist_Destroy(persist_t *persist)
+{
+	if(persist == NULL)
+	{
+		return;
+	}
+
+#if MBR_STATIC_ALLOCATION
+	flg_persist_used = 0;
+#else
+	free(persist);
+#endif
+}
+
+/**
+ * @brief Adding holding registers to be persisted, before MBR_Persist_Restore.
+ * @param persist Persistence created by MBR_Persist_Init.
+ * @param address_space Address space of holding registers.
+ * @retval 0 = ok, 1 = not ok (wrong type, overlap, MBR_PERSIST_SPACES / MBR_PERSIST_REGISTERS or sector capacity exceeded)
+ */
+uint8_t MBR_Persist_Add_Space(persist_t *persist, address_space_t *address_space)
+{
+	uint32_t capacity = persist->sector_size / PERSIST_ITEM_SIZE - 1;
+	uint32_t end = (uint32_t)address_space->start_offset + address_space->size;
+	address_space_t *other;
+
+	if(persist->flg_restored || address_space->type != holding_registers || persist->space_count >= MBR_PERSIST_SPACES
+			|| end > PERSIST_MARK_ADDRESS || persist->register_count + address_space->size > MBR_PERSIST_REGISTERS
+			|| 2u*(persist->register_count + address_space->size + 1) > capacity)
+	{
+		return 1;
+	}
+
+	for(uint32_t i=0; i<persist->space_count; i++)
+	{
+		other = persist->spaces[i].address_space;
+		if(address_space->start_offset < other->start_offset + other->size && other->start_offset < end)
+		{
+			return 1;
+		}
+	}
+
+	persist->spaces[persist->space_count].address_space = address_space;
+	persist->spaces[persist->space_count].first = persist->register_count;
+	persist->space_count++;
+	persist->register_count += address_space->size;
+
+	return 0;
+}
+
+/**
+ * @brief Restoring the persisted registers from the log, call once at boot before the communication is started.
+ * The newest sector with complete snapshot is replayed, followed by the newer sector whose snapshot has been interrupted.
+ * Records of registers which are not persisted anymore are ignored. An empty or foreign flash area is formatted
+ * with the current register values.
+ * @param persist Persistence with all address spaces added.
+ * @retval 0 = registers have been restored, 1 = no log has been found (registers are kept)
+ */
+uint8_t MBR_Persist_Restore(persist_t *persist)
+{
+	int32_t newest = -1, complete = -1;
+	uint32_t newest_sequence = 0, complete_sequence = 0, sequence, end, newest_end = 0;
+	uint8_t flg_complete;
+
+	for(uint32_t sector=0; sector<persist->sector_count; sector++)
+	{
+		if(Read_Header(persist, sector, &sequence))
+		{
+			continue;
+		}
+
+		end = Scan_Sector(persist, sector, &flg_complete);
+		if(newest < 0 || (int32_t)(sequence - newest_sequence) > 0)
+		{
+			newest = sector;
+			newest_sequence = sequence;
+			newest_end = end;
+		}
+		if(flg_complete && (complete < 0 || (int32_t)(sequence - complete_sequence) > 0))
+		{
+			complete = sector;
+			complete_sequence = sequence;
+		}
+	}
+
+	persist->flg_restored = 1;
+	memset(persist->journal, 0, sizeof(persist->journal));
+	persist->dirty = 0;
+
+	if(newest < 0)
+	{
+		Start_Sector(persist);
+		return 1;
+	}
+
+	if(complete >= 0 && complete != newest)
+	{
+		Replay_Sector(persist, complete, Scan_Sector(persist, complete, &flg_complete));
+	}
+	Replay_Sector(persist, newest, newest_end);
+
+	persist->active = newest;
+	persist->sequence = newest_sequence;
+	persist->position = newest_end;
+
+	if(complete != newest)	//the snapshot has been interrupted, older sectors can be erased only after a complete one
+	{
+		if(Write_Snapshot(persist))
+		{
+			Start_Sector(persist);
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Journaling written holding registers, registers which are not persisted are ignored.
+ * Cheap (bit set per register), repeated writes of a register before the commit produce one record.
+ * @param persist Persistence.
+ * @param start_address Address of the first written register.
+ * @param register_count Number of written registers.
+ * @retval none
+ */
+void MBR_Persist_Mark(persist_t *persist, uint16_t start_address, uint16_t register_count)
+{
+	uint32_t end = (uint32_t)start_address + register_count;
+	uint32_t first, last, bit;
+	address_space_t *address_space;
+
+	for(uint32_t i=0; i<persist->space_count; i++)
+	{
+		address_space = persist->spaces[i].address_space;
+		first = (start_address > address_space->start_offset) ? start_address : address_space->start_offset;
+		last = (end < (uint32_t)address_space->start_offset + address_space->size) ? end : (uint32_t)address_space->start_offset + address_space->size;
+
+		for(uint32_t address = first; address < last; address++)
+		{
+			bit = persist->spaces[i].first + address - address_space->start_offset;
+			if((persist->journal[bit/32] & (1u << (bit%32))) == 0)
+			{
+				persist->journal[bit/32] |= 1u << (bit%32);
+				if(persist->dirty++ == 0)
+				{
+					persist->dirty_time = HAL_GetTick();
+				}
+			}
+		}
+	}
+}
+
+void MBR_Persist_Mark_All(persist_t *persist)
+{
+	for(uint32_t i=0; i<persist->space_count; i++)
+	{
+		MBR_Persist_Mark(persist, persist->spaces[i].address_space->start_offset, persist->spaces[i].address_space->size);
+	}
+}
+
+/**
+ * @brief Background commit of the journal, call from the main loop or a low priority task.
+ * The journal is committed when it is older than MBR_PERSIST_DELAY or holds MBR_PERSIST_BATCH registers,
+ * at most MBR_PERSIST_BATCH records are written per call (plus the snapshot when the sector is full).
+ * @param persist Persistence.
+ * @retval none
+ */
+void MBR_Persist_Process(persist_t *persist)
+{
+	if(!persist->flg_restored || persist->dirty == 0)
+	{
+		return;
+	}
+
+	if(persist->dirty < MBR_PERSIST_BATCH && HAL_GetTick() - persist->dirty_time < MBR_PERSIST_DELAY)
+	{
+		return;
+	}
+
+	Commit(persist, MBR_PERSIST_BATCH);
+}
+
+/**
+ * @brief Committing the whole journal at once, e.g. on power fail detection or before a reset.
+ * @param persist Persistence.
+ * @retval 0 = ok, 1 = not ok (log is not restored, flash error)
+ */
+uint8_t MBR_Persist_Flush(persist_t *persist)
+{
+	if(!persist->flg_restored)
+	{
+		return 1;
+	}
+
+	return Commit(persist, 0xFFFFFFFFu);
+}
+
+void MBR_Persist_Get_Status(persist_t *persist, persist_status_t *status)
+{
+	*status = persist->status;
+	status->dirty = persist->dirty;
+	status->sequence = persist->sequence;
+	status->free_records = (persist->sector_size - persist->position) / PERSIST_ITEM_SIZE;
+}
+
+#ifdef MBR_HOST_BUILD
+/**
+ * @brief Opening the file which stands in for the flash area, missing part of the file is erased (0xFF).
+ * @param path File path.
+ * @param size Size of the flash area (sector_size * sector_count).
+ * @retval 0 = ok, -1 = error
+ */
+int MBR_Persist_Host_Open(const char *path, uint32_t size)
+{
+	uint8_t erased[0x100];
+	struct stat st;
+	uint32_t length;
+
+	MBR_Persist_Host_Close();
+
+	host_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(host_fd < 0 || fstat(host_fd, &st))
+	{
+		MBR_Persist_Host_Close();
+		return -1;
+	}
+
+	memset(erased, 0xFF, sizeof(erased));
+	for(uint32_t position = st.st_size; position < size; position += length)
+	{
+		length = (size - position < sizeof(erased)) ? size - position : sizeof(erased);
+		if(pwrite(host_fd, erased, length, position) != (ssize_t)length)
+		{
+			MBR_Persist_Host_Close();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void MBR_Persist_Host_Close(void)
+{
+	if(host_fd >= 0)
+	{
+		close(host_fd);
+	}
+
+	host_fd = -1;
+}
+
+/**
+ * @brief Flash port of the host build, NOR flash is emulated: erase sets all bits, a place can be programmed once.
+ */
+__weak uint8_t MBR_Persist_Flash_Erase(uint32_t address, uint32_t size)
+{
+	uint8_t erased[0x100];
+	uint32_t length;
+
+	memset(erased, 0xFF, sizeof(erased));
+	for(; size; size -= length, address += length)
+	{
+		length = (size < sizeof(erased)) ? size : sizeof(erased);
+		if(host_fd < 0 || pwrite(host_fd, erased, length, address) != (ssize_t)length)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+__weak uint8_t MBR_Persist_Flash_Program(uint32_t address, uint64_t data)
+{
+	uint64_t old;
+
+	MBR_Persist_Flash_Read(address, &old, sizeof(old));
+	if(host_fd < 0 || address % PERSIST_ITEM_SIZE || old != PERSIST_ERASED)
+	{
+		return 1;
+	}
+
+	return pwrite(host_fd, &data, sizeof(data), address) != sizeof(data);
+}
+
+__weak void MBR_Persist_Flash_Read(uint32_t address, void *data, uint32_t size)
+{
+	ssize_t length = (host_fd < 0) ? 0 : pread(host_fd, data, size, address);
+
+	if(length < (ssize_t)size)	//outside of the file: erased
+	{
+		memset((uint8_t*)data + (length > 0 ? length : 0), 0xFF, size - (length > 0 ? length : 0));
+	}
+}
+#else
+/**
+ * @brief Flash port for STM32 families with page erase (F0/F1/F3/G0/G4/L4/WB), override for other families
+ * (sector erase of F2/F4/F7, quad-word programming of H7/L5/U5) or for external flash.
+ * @param address Address of the first page.
+ * @param size Size of the erased area, multiple of the page size.
+ * @retval 0 = ok, 1 = not ok
+ */
+__weak uint8_t MBR_Persist_Flash_Erase(uint32_t address, uint32_t size)
+{
+	FLASH_EraseInitTypeDef erase = {0};
+	uint32_t page_error;
+	HAL_StatusTypeDef status;
+
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+#ifdef FLASH_TYPEPROGRAM_HALFWORD	//F0/F1/F3: pages are selected by address
+	erase.PageAddress = address;
+#else	//G0/G4/L4/WB: pages are selected by index within the bank
+	erase.Page = (address - FLASH_BASE) / FLASH_PAGE_SIZE;
+#ifdef FLASH_BANK_1
+	erase.Banks = FLASH_BANK_1;
+#endif
+#if defined(FLASH_BANK_2) && defined(FLASH_BANK_SIZE)
+	if(address - FLASH_BASE >= FLASH_BANK_SIZE)
+	{
+		erase.Banks = FLASH_BANK_2;
+		erase.Page -= FLASH_BANK_SIZE / FLASH_PAGE_SIZE;
+	}
+#endif
+#endif
+	erase.NbPages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASHEx_Erase(&erase, &page_error);
+	HAL_FLASH_Lock();
+
+	return status != HAL_OK;
+}
+
+__weak uint8_t MBR_Persist_Flash_Program(uint32_t address, uint64_t data)
+{
+	HAL_StatusTypeDef status;
+
+	HAL_FLASH_Unlock();
+	status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, address, data);
+	HAL_FLASH_Lock();
+
+	return status != HAL_OK;
+}
+
+/**
+ * @brief Reading the internal flash, it is memory mapped. On families with ECC (G0/G4/L4/WB) a double word torn by reset
+ * while programming can hold a double ECC error, its read raises NMI. MBR_Persist_ECC_Error_Handler() called
+ * from NMI_Handler clears the error, the double word is then returned as zeros (corrupted record, skipped).
+ */
+__weak void MBR_Persist_Flash_Read(uint32_t address, void *data, uint32_t size)
+{
+#ifdef FLASH_FLAG_ECCD
+	flg_ecc_error = 0;
+	memcpy(data, (const void*)address, size);
+	if(flg_ecc_error)
+	{
+		memset(data, 0, size);
+	}
+#else
+	memcpy(data, (const void*)address, size);
+#endif
+}
+
+#ifdef FLASH_FLAG_ECCD
+/**
+ * @brief Handling of double ECC error of flash read, call from NMI_Handler before other NMI sources.
+ * @param none
+ * @retval 1 = ECC error has been cleared (return from NMI_Handler), 0 = NMI has another source
+ */
+uint8_t MBR_Persist_ECC_Error_Handler(void)
+{
+	if(__HAL_FLASH_GET_FLAG(FLASH_FLAG_ECCD) == 0)
+	{
+		return 0;
+	}
+
+	__HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ECCD);
+	flg_ecc_error = 1;
+	return 1;
+}
+#endif
+#endif
+
+/*PRIVATE FUNCTIONS*/
+static persist_space_t *Find_Register(persist_t *persist, uint16_t register_address, uint16_t *offset)
+{
+	address_space_t *address_space;
+
+	for(uint32_t i=0; i<persist->space_count; i++)
+	{
+		address_space = persist->spaces[i].address_space;
+		if(register_address >= address_space->start_offset && register_address - address_space->start_offset < address_space->size)
+		{
+			*offset = register_address - address_space->start_offset;
+			return &persist->spaces[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Reading the register consistently with the writes of Modbus master (seqlock, MBR_SEQLOCK_RETRIES).
+ */
+static uint16_t Read_Register(address_space_t *address_space, uint16_t offset)
+{
+	uint32_t sequence;
+	uint16_t value;
+
+	do
+	{
+		sequence = MBR_Read_Begin(address_space);
+		value = address_space->address[offset];
+	} while(MBR_Read_Retry(address_space, sequence));
+
+	return value;
+}
+
+static uint64_t Make_Record(uint16_t register_address, uint16_t value)
+{
+	uint8_t bytes[4] = {register_address, register_address >> 8, value, value >> 8};
+	uint16_t crc = MBR_CRC16_Final(MBR_CRC16_Update(MBR_CRC16_Init(), bytes, sizeof(bytes)));
+
+	return register_address | (uint32_t)value << 16 | (uint64_t)crc << 32;
+}
+
+/**
+ * @retval 0 = valid record, 1 = erased, torn or corrupted record
+ */
+static uint8_t Check_Record(uint64_t record)
+{
+	return record != Make_Record(record, record >> 16);
+}
+
+/**
+ * @retval 0 = sector has a valid header, 1 = sector is erased or foreign
+ */
+static uint8_t Read_Header(persist_t *persist, uint8_t sector, uint32_t *sequence)
+{
+	uint64_t header;
+
+	MBR_Persist_Flash_Read(persist->flash_address + sector*persist->sector_size, &header, sizeof(header));
+	*sequence = header >> 32;
+
+	return (uint32_t)header != PERSIST_MAGIC || *sequence == 0xFFFFFFFFu;
+}
+
+/**
+ * @brief Finding the end of the log in the sector (first erased place) and the mark of complete snapshot.
+ * @retval offset of the first erased place, sector_size when the sector is full
+ */
+static uint32_t Scan_Sector(persist_t *persist, uint8_t sector, uint8_t *flg_complete)
+{
+	uint32_t address = persist->flash_address + sector*persist->sector_size;
+	uint32_t position;
+	uint64_t record;
+
+	*flg_complete = 0;
+
+	for(position = PERSIST_ITEM_SIZE; position < persist->sector_size; position += PERSIST_ITEM_SIZE)
+	{
+		MBR_Persist_Flash_Read(address + position, &record, sizeof(record));
+		if(record == PERSIST_ERASED)
+		{
+			break;
+		}
+		if(record == Make_Record(PERSIST_MARK_ADDRESS, PERSIST_MARK_VALUE))
+		{
+			*flg_complete = 1;
+		}
+	}
+
+	return position;
+}
+
+static void Replay_Sector(persist_t *persist, uint8_t sector, uint32_t end)
+{
+	uint32_t address = persist->flash_address + sector*persist->sector_size;
+	persist_space_t *space;
+	uint64_t record;
+	uint16_t offset;
+
+	for(uint32_t position = PERSIST_ITEM_SIZE; position < end; position += PERSIST_ITEM_SIZE)
+	{
+		MBR_Persist_Flash_Read(address + position, &record, sizeof(record));
+		if(Check_Record(record) || (uint16_t)record == PERSIST_MARK_ADDRESS)	//torn record (reset while programming) is skipped
+		{
+			continue;
+		}
+
+		space = Find_Register(persist, record, &offset);
+		if(space != NULL)
+		{
+			MBR_Begin_Update(space->address_space);
+			space->address_space->address[offset] = record >> 16;
+			MBR_End_Update(space->address_space);
+		}
+	}
+}
+
+/**
+ * @retval 0 = ok, 1 = not ok (active sector is full, flash error)
+ */
+static uint8_t Write_Record(persist_t *persist, uint16_t register_address, uint16_t value)
+{
+	uint32_t address = persist->flash_address + persist->active*persist->sector_size + persist->position;
+
+	if(persist->position + PERSIST_ITEM_SIZE > persist->sector_size)
+	{
+		return 1;
+	}
+
+	persist->position += PERSIST_ITEM_SIZE;	//a failed place is not programmed again
+	if(MBR_Persist_Flash_Program(address, Make_Record(register_address, value)))
+	{
+		return 1;
+	}
+
+	persist->status.records++;
+	return 0;
+}
+
+/**
+ * @brief Writing all persisted registers followed by the mark, the journal is cleared.
+ * @retval 0 = ok, 1 = not ok
+ */
+static uint8_t Write_Snapshot(persist_t *persist)
+{
+	address_space_t *address_space;
+
+	memset(persist->journal, 0, sizeof(persist->journal));
+	persist->dirty = 0;
+
+	for(uint32_t i=0; i<persist->space_count; i++)
+	{
+		address_space = persist->spaces[i].address_space;
+		for(uint32_t offset=0; offset<address_space->size; offset++)
+		{
+			if(Write_Record(persist, address_space->start_offset + offset, Read_Register(address_space, offset)))
+			{
+				return 1;
+			}
+		}
+	}
+
+	return Write_Record(persist, PERSIST_MARK_ADDRESS, PERSIST_MARK_VALUE);
+}
+
+/**
+ * @brief Moving the log to the next sector (the oldest one): erase, header with the next sequence and snapshot.
+ * The sectors are used round robin, so all of them are erased equally often.
+ * @retval 0 = ok, 1 = not ok (flash error)
+ */
+static uint8_t Start_Sector(persist_t *persist)
+{
+	uint8_t sector = (persist->active + 1) % persist->sector_count;
+	uint32_t address = persist->flash_address + sector*persist->sector_size;
+
+	persist->sequence++;
+	if(persist->sequence == 0xFFFFFFFFu)	//reserved for erased header
+	{
+		persist->sequence = 1;
+	}
+
+	persist->active = sector;
+	persist->position = persist->sector_size;	//nothing is appended until the header is written
+
+	persist->status.erases++;
+	if(MBR_Persist_Flash_Erase(address, persist->sector_size)
+			|| MBR_Persist_Flash_Program(address, PERSIST_MAGIC | (uint64_t)persist->sequence << 32))
+	{
+		return 1;
+	}
+
+	persist->position = PERSIST_ITEM_SIZE;
+	return Write_Snapshot(persist);
+}
+
+/**
+ * @brief Writing up to max_records dirty registers, a new sector with snapshot is started when the active one is full.
+ * @retval 0 = ok, 1 = not ok (flash error)
+ */
+static uint8_t Commit(persist_t *persist, uint32_t max_records)
+{
+	persist_space_t *space = persist->spaces;
+	uint32_t records = persist->status.records;
+	uint32_t bit = 0;
+	uint8_t status = 0;
+
+	for(uint32_t written = 0; persist->dirty && written < max_records; written++, bit++)
+	{
+		if(persist->position + PERSIST_ITEM_SIZE > persist->sector_size)
+		{
+			status = Start_Sector(persist);	//snapshot commits the whole journal
+			break;
+		}
+
+		while(bit < persist->register_count && (persist->journal[bit/32] & (1u << (bit%32))) == 0)
+		{
+			bit = (persist->journal[bit/32] >> (bit%32)) ? bit + 1 : (bit | 31) + 1;	//skip clean words at once
+		}
+		while(bit >= space->first + space->address_space->size)
+		{
+			space++;
+		}
+
+		persist->journal[bit/32] &= ~(1u << (bit%32));
+		persist->dirty--;
+		if(Write_Record(persist, space->address_space->start_offset + bit - space->first, Read_Register(space->address_space, bit - space->first)))
+		{
+			MBR_Persist_Mark(persist, space->address_space->start_offset + bit - space->first, 1);	//kept for the next commit
+			status = 1;
+			break;
+		}
+	}
+
+	if(persist->status.records != records)	//empty journal or failed write: nothing has been committed
+	{
+		persist->status.commits++;
+	}
+	return status;
+}
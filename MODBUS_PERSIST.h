@@ -0,0 +1,52 @@
+#ifndef __MODBUS_PERSIST_H
+#define __MODBUS_PERSIST_H
+
+/*
+ * Write-behind persistence of holding registers.
+ * Registers written by Modbus master are journaled in RAM (one dirty bit per register, repeated writes are coalesced)
+ * and committed in batches to a log in flash by MBR_Persist_Process, outside of the request processing.
+ * The log rotates over several flash sectors (wear levelling): every sector starts with a snapshot of all persisted
+ * registers followed by single register records, so only the newest sectors are replayed at boot.
+ * Host builds (-DMBR_HOST_BUILD) keep the log in a file opened by MBR_Persist_Host_Open.
+ */
+
+#include "MODBUS.h"
+
+typedef struct persist_status_s {
+	uint32_t dirty;								//registers waiting in the journal
+	uint32_t commits;							//batches written to flash
+	uint32_t records;							//register records written to flash (snapshots included)
+	uint32_t erases;							//erased sectors
+	uint32_t sequence;							//sequence number of the active sector
+	uint32_t free_records;						//records left in the active sector
+} persist_status_t;
+
+typedef struct __persist_t persist_t;
+
+persist_t *MBR_Persist_Init(uint32_t flash_address, uint32_t sector_size, uint8_t sector_count);	//sector_size multiple of 8, 2..255 sectors, return NULL when NOK
+void MBR_Persist_Destroy(persist_t *persist);
+uint8_t MBR_Persist_Add_Space(persist_t *persist, address_space_t *address_space);	//holding registers only, return 0 when OK, return 1 when NOK
+uint8_t MBR_Persist_Restore(persist_t *persist);	//call once after MBR_Persist_Add_Space, return 0 when restored, return 1 when the log has been formatted (defaults are kept)
+
+/*journal, call from the context of MBR_Persist_Process (e.g. while draining MBR_Get_Change or from MBR_Register_Range_Update_Callback)*/
+void MBR_Persist_Mark(persist_t *persist, uint16_t start_address, uint16_t register_count);
+void MBR_Persist_Mark_All(persist_t *persist);	//e.g. after the change queue has overflowed
+void MBR_Persist_Process(persist_t *persist);	//background: commits a batch when the journal is old or full enough
+uint8_t MBR_Persist_Flush(persist_t *persist);	//commits the whole journal now (e.g. power fail), return 0 when OK, return 1 when NOK
+void MBR_Persist_Get_Status(persist_t *persist, persist_status_t *status);
+
+/*flash port, weak refs: the default ones program the internal flash by HAL (F0/F1/F3/G0/G4/L4/WB) or the host file*/
+uint8_t MBR_Persist_Flash_Erase(uint32_t address, uint32_t size);	//return 0 when OK, return 1 when NOK
+uint8_t MBR_Persist_Flash_Program(uint32_t address, uint64_t data);	//8 bytes to an erased, 8-byte aligned place, return 0 when OK, return 1 when NOK
+void MBR_Persist_Flash_Read(uint32_t address, void *data, uint32_t size);
+
+#if !defined(MBR_HOST_BUILD) && defined(FLASH_FLAG_ECCD)
+uint8_t MBR_Persist_ECC_Error_Handler(void);	//G0/G4/L4/WB: call from NMI_Handler, torn records of the log raise double ECC error. return 1 when handled
+#endif
+
+#ifdef MBR_HOST_BUILD
+int MBR_Persist_Host_Open(const char *path, uint32_t size);	//flash addresses are offsets in the file, a new file is erased, return 0 = ok, -1 = error
+void MBR_Persist_Host_Close(void);
+#endif
+
+#endif
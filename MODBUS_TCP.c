@@ -0,0 +1,577 @@
+/*MODBUS_TCP.c*/
+#ifdef MBR_HOST_BUILD
+
+#define _GNU_SOURCE
+#include "MODBUS_TCP.h"
+#include "MODBUS_CRC.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define TCP_MAX_WORKERS			64
+#define TCP_MAX_CONNECTIONS		1024
+#define TCP_FRAME_SIZE			0x100	//unit address, PDU and CRC, as MODBUS_BUFFER_SIZE
+#define TCP_MBAP_HEADER			6		//transaction id, protocol id and length, the unit id belongs to the frame
+#define TCP_BUFFER_SIZE			(TCP_MBAP_HEADER + TCP_FRAME_SIZE + 2)
+
+typedef struct __tcp_connection_t
+{
+	int							fd;
+	struct __tcp_connection_t	*prev;			//list of open connections
+	struct __tcp_connection_t	*next;
+	uint32_t					rx_len;
+	uint32_t					tx_len;			//response waiting for the socket, no request is processed meanwhile
+	uint32_t					tx_position;
+	uint8_t						rx[2*TCP_BUFFER_SIZE] __ALIGNED(4);	//frames are moved to the beginning, so the request is halfword aligned
+	uint8_t						tx[TCP_BUFFER_SIZE] __ALIGNED(4);
+} tcp_connection_t;
+
+struct __tcp_server_t
+{
+	modbus_handle_t		*hmodbus;
+	tcp_framing_t		framing;
+	uint8_t				unit_id;				//0 = every unit id is served
+	uint16_t			port;
+	int					listen_fd;
+	int					epoll_fd;				//shared by all workers, connections are registered one-shot
+	int					stop_fd;				//eventfd, wakes up all workers when the server is stopped
+	pthread_mutex_t		lock;					//Modbus handle
+	pthread_mutex_t		connections_lock;
+	tcp_connection_t	*connections;
+	uint32_t			connection_count;
+	uint32_t			worker_count;
+	pthread_t			workers[TCP_MAX_WORKERS];
+};
+
+/*FUNCTION PROTOTYPES*/
+static void *Worker(void *arg);
+static void Accept_Connections(tcp_server_t *server);
+static void Serve_Connection(tcp_server_t *server, tcp_connection_t *conn, uint32_t events);
+static int Process_Frames(tcp_server_t *server, tcp_connection_t *conn);
+static int Flush_Connection(tcp_connection_t *conn);
+static void Close_Connection(tcp_server_t *server, tcp_connection_t *conn);
+static uint32_t Get_RTU_Request_Length(const uint8_t *buf, uint32_t available);
+static uint16_t Execute_Request(tcp_server_t *server, uint8_t *request, uint16_t request_length, uint8_t *response);
+static void Free_Server(tcp_server_t *server);
+
+/*PUBLIC FUNCTIONS*/
+/**
+ * @brief Starting the server, requests are processed by the worker threads.
+ * @param hmodbus Modbus handle with the address spaces and handlers.
+ * @param address IPv4 address to listen on, NULL = all interfaces.
+ * @param port TCP port (502 for Modbus TCP), 0 = any free port (see MBR_TCP_Get_Port).
+ * @param framing tcp_mbap or tcp_rtu.
+ * @param unit_id Served unit id, 0 = all unit ids. Other MBAP requests get gateway_path_unavailable, other RTU frames are ignored.
+ * @param workers Number of worker threads, 1..64.
+ * @retval server, NULL = not ok
+ */
+tcp_server_t *MBR_TCP_Start(modbus_handle_t *hmodbus, const char *address, uint16_t port, tcp_framing_t framing, uint8_t unit_id, uint32_t workers)
+{
+	tcp_server_t *server;
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	struct epoll_event event;
+	int option = 1;
+
+	if(workers == 0 || workers > TCP_MAX_WORKERS)
+	{
+		return NULL;
+	}
+
+	server = (tcp_server_t*) calloc(1, sizeof(tcp_server_t));
+	if(server == NULL)
+	{
+		return NULL;
+	}
+
+	server->hmodbus = hmodbus;
+	server->framing = framing;
+	server->unit_id = unit_id;
+	server->epoll_fd = -1;
+	server->stop_fd = -1;
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_mutex_init(&server->connections_lock, NULL);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(server->listen_fd < 0 || (address != NULL && inet_pton(AF_INET, address, &addr.sin_addr) != 1))
+	{
+		Free_Server(server);
+		return NULL;
+	}
+
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+	if(bind(server->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(server->listen_fd, SOMAXCONN)
+			|| getsockname(server->listen_fd, (struct sockaddr*)&addr, &addr_len))
+	{
+		Free_Server(server);
+		return NULL;
+	}
+	server->port = ntohs(addr.sin_port);
+
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(server->epoll_fd < 0 || server->stop_fd < 0)
+	{
+		Free_Server(server);
+		return NULL;
+	}
+
+	event.events = EPOLLIN | EPOLLONESHOT;	//re-armed by the worker which accepted the connections
+	event.data.ptr = &server->listen_fd;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event);
+
+	event.events = EPOLLIN;	//level triggered, all workers see it
+	event.data.ptr = &server->stop_fd;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->stop_fd, &event);
+
+	for(server->worker_count = 0; server->worker_count < workers; server->worker_count++)
+	{
+		if(pthread_create(&server->workers[server->worker_count], NULL, Worker, server))
+		{
+			MBR_TCP_Stop(server);
+			return NULL;
+		}
+	}
+
+	return server;
+}
+
+/**
+ * @brief Stopping the workers, closing all connections and freeing the server.
+ * @param server Server started by MBR_TCP_Start.
+ * @retval none
+ */
+void MBR_TCP_Stop(tcp_server_t *server)
+{
+	uint64_t value = 1;
+
+	if(write(server->stop_fd, &value, sizeof(value)) < 0)
+	{
+		return;
+	}
+
+	for(uint32_t i=0; i<server->worker_count; i++)
+	{
+		pthread_join(server->workers[i], NULL);
+	}
+
+	while(server->connections != NULL)
+	{
+		Close_Connection(server, server->connections);
+	}
+
+	Free_Server(server);
+}
+
+uint16_t MBR_TCP_Get_Port(tcp_server_t *server)
+{
+	return server->port;
+}
+
+uint32_t MBR_TCP_Get_Connections(tcp_server_t *server)
+{
+	uint32_t count;
+
+	pthread_mutex_lock(&server->connections_lock);
+	count = server->connection_count;
+	pthread_mutex_unlock(&server->connections_lock);
+
+	return count;
+}
+
+void MBR_TCP_Lock(tcp_server_t *server)
+{
+	pthread_mutex_lock(&server->lock);
+}
+
+void MBR_TCP_Unlock(tcp_server_t *server)
+{
+	pthread_mutex_unlock(&server->lock);
+}
+
+/*PRIVATE FUNCTIONS*/
+/**
+ * @brief Worker thread. Every epoll_wait takes one event, the connection is owned by the worker
+ * until it is re-armed (EPOLLONESHOT), so the connection buffers are never shared.
+ */
+static void *Worker(void *arg)
+{
+	tcp_server_t *server = arg;
+	struct epoll_event event;
+	int count;
+
+	for(;;)
+	{
+		count = epoll_wait(server->epoll_fd, &event, 1, -1);
+		if(count < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if(count <= 0)
+		{
+			continue;
+		}
+
+		if(event.data.ptr == &server->stop_fd)
+		{
+			break;
+		}
+		else if(event.data.ptr == &server->listen_fd)
+		{
+			Accept_Connections(server);
+		}
+		else
+		{
+			Serve_Connection(server, event.data.ptr, event.events);
+		}
+	}
+
+	return NULL;
+}
+
+static void Accept_Connections(tcp_server_t *server)
+{
+	tcp_connection_t *conn;
+	struct epoll_event event;
+	int fd, option = 1;
+
+	while((fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		conn = NULL;
+		pthread_mutex_lock(&server->connections_lock);
+		if(server->connection_count < TCP_MAX_CONNECTIONS)
+		{
+			conn = (tcp_connection_t*) malloc(sizeof(tcp_connection_t));
+		}
+		if(conn != NULL)
+		{
+			conn->fd = fd;
+			conn->rx_len = 0;
+			conn->tx_len = 0;
+			conn->tx_position = 0;
+			conn->prev = NULL;
+			conn->next = server->connections;
+			if(server->connections != NULL)
+			{
+				server->connections->prev = conn;
+			}
+			server->connections = conn;
+			server->connection_count++;
+		}
+		pthread_mutex_unlock(&server->connections_lock);
+
+		if(conn == NULL)	//too many connections
+		{
+			close(fd);
+			continue;
+		}
+
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));	//responses are small and latency sensitive
+
+		event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+		event.data.ptr = conn;
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &server->listen_fd;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->listen_fd, &event);
+}
+
+static void Serve_Connection(tcp_server_t *server, tcp_connection_t *conn, uint32_t events)
+{
+	struct epoll_event event;
+	ssize_t len;
+
+	if(events & EPOLLERR)
+	{
+		Close_Connection(server, conn);
+		return;
+	}
+
+	if(conn->tx_len && Flush_Connection(conn))
+	{
+		Close_Connection(server, conn);
+		return;
+	}
+
+	while(conn->tx_len == 0)	//requests are not read while the response is waiting for the socket
+	{
+		len = recv(conn->fd, &conn->rx[conn->rx_len], sizeof(conn->rx) - conn->rx_len, 0);
+		if(len < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+		if(len <= 0)	//closed by the client or error
+		{
+			Close_Connection(server, conn);
+			return;
+		}
+
+		conn->rx_len += len;
+		if(Process_Frames(server, conn))	//framing error, the connection is closed as required by Modbus TCP
+		{
+			Close_Connection(server, conn);
+			return;
+		}
+	}
+
+	event.events = (conn->tx_len ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+	event.data.ptr = conn;
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * @brief Processing all complete frames in the receive buffer.
+ * @retval 0 = ok, -1 = framing error
+ */
+static int Process_Frames(tcp_server_t *server, tcp_connection_t *conn)
+{
+	uint8_t *rx = conn->rx;
+	uint8_t *tx = conn->tx;
+	uint32_t length, pdu_length;
+	uint16_t response_length, crc16;
+
+	while(conn->tx_len == 0)
+	{
+		if(server->framing == tcp_mbap)
+		{
+			if(conn->rx_len < TCP_MBAP_HEADER)
+			{
+				break;
+			}
+
+			pdu_length = (rx[4]<<8) | rx[5];	//unit id and PDU
+			if(rx[2] || rx[3] || pdu_length < 2 || pdu_length > TCP_FRAME_SIZE - 2)	//protocol id has to be 0
+			{
+				return -1;
+			}
+
+			length = TCP_MBAP_HEADER + pdu_length;
+			if(conn->rx_len < length)
+			{
+				break;
+			}
+
+			if(server->unit_id && rx[6] != server->unit_id)
+			{
+				tx[6] = rx[6];
+				tx[7] = rx[7] | 0x80;
+				tx[8] = gateway_path_unavailable;
+				response_length = 3;
+			}
+			else
+			{
+				response_length = Execute_Request(server, &rx[TCP_MBAP_HEADER], pdu_length, &tx[TCP_MBAP_HEADER]);
+			}
+
+			if(response_length)
+			{
+				tx[0] = rx[0];	//transaction id is echoed
+				tx[1] = rx[1];
+				tx[2] = 0;
+				tx[3] = 0;
+				tx[4] = response_length>>8;
+				tx[5] = response_length;
+				conn->tx_len = TCP_MBAP_HEADER + response_length;
+			}
+		}
+		else
+		{
+			length = Get_RTU_Request_Length(rx, conn->rx_len);
+			if(length == 0)
+			{
+				break;
+			}
+			if(length < 4 || length > TCP_FRAME_SIZE)
+			{
+				return -1;
+			}
+			if(conn->rx_len < length)
+			{
+				break;
+			}
+
+			if(Calculate_CRC16(rx, length) == 0 && (server->unit_id == 0 || rx[0] == server->unit_id || rx[0] == 0x00))	//invalid frames are ignored as on the bus
+			{
+				response_length = Execute_Request(server, rx, length - 2, tx);
+				if(response_length && rx[0] != 0x00)	//no response to broadcast
+				{
+					crc16 = Calculate_CRC16(tx, response_length);
+					tx[response_length] = crc16;
+					tx[response_length+1] = crc16>>8;
+					conn->tx_len = response_length + 2;
+				}
+			}
+		}
+
+		conn->rx_len -= length;
+		memmove(rx, &rx[length], conn->rx_len);
+
+		if(conn->tx_len && Flush_Connection(conn))
+		{
+			return -1;
+		}
+	}
+
+	if(conn->tx_len == 0 && conn->rx_len == sizeof(conn->rx))	//no complete frame in the full buffer
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Sending the pending response.
+ * @retval 0 = sent or waiting for the socket, -1 = error
+ */
+static int Flush_Connection(tcp_connection_t *conn)
+{
+	ssize_t len;
+
+	while(conn->tx_position < conn->tx_len)
+	{
+		len = send(conn->fd, &conn->tx[conn->tx_position], conn->tx_len - conn->tx_position, MSG_NOSIGNAL);
+		if(len < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		conn->tx_position += len;
+	}
+
+	conn->tx_len = 0;
+	conn->tx_position = 0;
+
+	return 0;
+}
+
+static void Close_Connection(tcp_server_t *server, tcp_connection_t *conn)
+{
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+
+	pthread_mutex_lock(&server->connections_lock);
+	if(conn->prev != NULL)
+	{
+		conn->prev->next = conn->next;
+	}
+	else
+	{
+		server->connections = conn->next;
+	}
+	if(conn->next != NULL)
+	{
+		conn->next->prev = conn->prev;
+	}
+	server->connection_count--;
+	pthread_mutex_unlock(&server->connections_lock);
+
+	free(conn);
+}
+
+/**
+ * @brief Length of the RTU request is not transmitted, it is given by the function code.
+ * @retval length of the request including CRC, 0 = more bytes are needed.
+ * Frames of unknown function codes end at the first matching CRC, so pipelined requests are not merged.
+ * Without a match in TCP_FRAME_SIZE bytes the longest frame is taken, it fails the CRC check and is dropped.
+ */
+static uint32_t Get_RTU_Request_Length(const uint8_t *buf, uint32_t available)
+{
+	uint16_t crc;
+	uint32_t length;
+
+	if(available < 2)
+	{
+		return 0;
+	}
+
+	switch(buf[1])
+	{
+	case 0x01:
+	case 0x02:
+	case 0x03:
+	case 0x04:
+	case 0x05:
+	case 0x06:
+	case 0x08:
+		return 8;
+	case 0x0F:
+	case 0x10:
+		return (available < 7) ? 0 : 9 + buf[6];
+	case 0x16:
+		return 10;
+	case 0x17:
+		return (available < 11) ? 0 : 13 + buf[10];
+	default:
+		if(available < 4)
+		{
+			return 0;
+		}
+		crc = MBR_CRC16_Update(MBR_CRC16_INIT, buf, 3);
+		for(length=4; length<=available && length<=TCP_FRAME_SIZE; length++)
+		{
+			crc = MBR_CRC16_Update(crc, &buf[length-1], 1);
+			if(crc == 0)	//CRC over the frame including its CRC field
+			{
+				return length;
+			}
+		}
+		return (available >= TCP_FRAME_SIZE) ? TCP_FRAME_SIZE : 0;
+	}
+}
+
+static uint16_t Execute_Request(tcp_server_t *server, uint8_t *request, uint16_t request_length, uint8_t *response)
+{
+	uint16_t response_length;
+
+	pthread_mutex_lock(&server->lock);
+	response_length = MBR_Process_Frame(server->hmodbus, request, request_length, response);
+	pthread_mutex_unlock(&server->lock);
+
+	return response_length;
+}
+
+static void Free_Server(tcp_server_t *server)
+{
+	if(server->listen_fd >= 0)
+	{
+		close(server->listen_fd);
+	}
+	if(server->epoll_fd >= 0)
+	{
+		close(server->epoll_fd);
+	}
+	if(server->stop_fd >= 0)
+	{
+		close(server->stop_fd);
+	}
+
+	pthread_mutex_destroy(&server->lock);
+	pthread_mutex_destroy(&server->connections_lock);
+	free(server);
+}
+
+#endif
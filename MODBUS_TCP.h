@@ -0,0 +1,29 @@
+#ifndef __MODBUS_TCP_H
+#define __MODBUS_TCP_H
+
+/*
+ * Modbus TCP (MBAP) and RTU over TCP server for Linux host builds (-DMBR_HOST_BUILD).
+ * Requests of all connections are processed by the handlers and address spaces of one Modbus handle,
+ * the handle can be shared with a UART (use MBR_TCP_Lock/MBR_TCP_Unlock around MBR_Check_For_Request)
+ * or created without UART by MBR_Init_Modbus(NULL).
+ */
+
+#include "MODBUS.h"
+
+typedef enum
+{
+	tcp_mbap	= 0,	//Modbus TCP: MBAP header, no CRC
+	tcp_rtu		= 1		//RTU frames (with CRC) over TCP
+} tcp_framing_t;
+
+typedef struct __tcp_server_t tcp_server_t;
+
+tcp_server_t *MBR_TCP_Start(modbus_handle_t *hmodbus, const char *address, uint16_t port, tcp_framing_t framing, uint8_t unit_id, uint32_t workers);	//return NULL when NOK
+void MBR_TCP_Stop(tcp_server_t *server);
+uint16_t MBR_TCP_Get_Port(tcp_server_t *server);	//actual port, useful when started with port 0
+uint32_t MBR_TCP_Get_Connections(tcp_server_t *server);
+
+void MBR_TCP_Lock(tcp_server_t *server);	//serializes the access to the Modbus handle with the server workers
+void MBR_TCP_Unlock(tcp_server_t *server);
+
+#endif
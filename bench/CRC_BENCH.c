@@ -0,0 +1,188 @@
+/*CRC_BENCH.c*/
+/*
+ * Cross-check and benchmark of the CRC16 engines of MODBUS_CRC.c on host.
+ * Every engine is compared with a bitwise reference over lengths 0..300, buffer alignments 0..7 and split points,
+ * then the time per call is measured for typical frame lengths (median of several runs).
+ *	gcc -O2 -DMBR_HOST_BUILD -mpclmul -I. MODBUS_CRC.c bench/CRC_BENCH.c -o crc_bench
+ *	./crc_bench			exit code 1 when an engine differs from the reference
+ * Without -mpclmul the CLMUL engine is skipped. The hardware engine exists on target only,
+ * MBR_CRC16_Check_Engine() verifies it there.
+ */
+#include "MODBUS_CRC.h"
+#include <stdio.h>
+#include <time.h>
+
+#define CRC_MAX_LENGTH			300
+#define CRC_ALIGNMENTS			8
+#define CRC_BENCH_CALLS			200000
+#define CRC_BENCH_RUNS			5
+
+typedef uint16_t (*crc_engine_t)(uint16_t crc, const uint8_t *buf, uint32_t len);
+
+typedef struct __crc_engine_entry_t
+{
+	const char			*name;
+	crc_engine_t		update;
+} crc_engine_entry_t;
+
+static const crc_engine_entry_t engines[] = {
+	{"table",		MBR_CRC16_Update_Table},
+	{"slicing4",	MBR_CRC16_Update_Slicing4},
+	{"slicing8",	MBR_CRC16_Update_Slicing8},
+#ifdef __PCLMUL__
+	{"clmul",		MBR_CRC16_Update_CLMUL},
+#endif
+	{"selected",	MBR_CRC16_Update},
+	{"isr",			MBR_CRC16_Update_ISR},
+};
+#define CRC_ENGINES				(sizeof(engines)/sizeof(engines[0]))
+
+static const uint32_t bench_lengths[] = {8, 64, 255};
+#define CRC_BENCH_LENGTHS		(sizeof(bench_lengths)/sizeof(bench_lengths[0]))
+
+static uint8_t buf[CRC_MAX_LENGTH + CRC_ALIGNMENTS];
+
+/*FUNCTION PROTOTYPES*/
+static uint16_t Reference_CRC16(uint16_t crc, const uint8_t *data, uint32_t len);
+static uint8_t Check_Engine(const crc_engine_entry_t *engine);
+static double Measure_Engine(const crc_engine_entry_t *engine, uint32_t len);
+static uint64_t Get_Time_ns(void);
+
+int main(void)
+{
+	uint32_t seed = 0x12345678;
+	int status = 0;
+
+	for(uint32_t i=0; i<sizeof(buf); i++)
+	{
+		seed = seed*1103515245u + 12345u;
+		buf[i] = seed>>16;
+	}
+
+	printf("%-10s %6s", "engine", "check");
+	for(uint32_t l=0; l<CRC_BENCH_LENGTHS; l++)
+	{
+		printf("  %4u B [ns]", bench_lengths[l]);
+	}
+	printf("\n");
+
+	for(uint32_t e=0; e<CRC_ENGINES; e++)
+	{
+		uint8_t failed = Check_Engine(&engines[e]);
+
+		if(failed)
+		{
+			status = 1;
+		}
+		printf("%-10s %6s", engines[e].name, failed ? "FAIL" : "ok");
+		for(uint32_t l=0; l<CRC_BENCH_LENGTHS; l++)
+		{
+			printf("  %11.1f", Measure_Engine(&engines[e], bench_lengths[l]));
+		}
+		printf("\n");
+	}
+
+	if(MBR_CRC16_Check_Engine())
+	{
+		printf("MBR_CRC16_Check_Engine: FAIL\n");
+		status = 1;
+	}
+
+	return status;
+}
+
+/*PRIVATE FUNCTIONS*/
+/**
+ * @brief Bitwise CRC16 (Modbus), independent of the tables of MODBUS_CRC.c.
+ */
+static uint16_t Reference_CRC16(uint16_t crc, const uint8_t *data, uint32_t len)
+{
+	while(len--)
+	{
+		crc ^= *data++;
+		for(uint8_t bit=0; bit<8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+		}
+	}
+
+	return crc;
+}
+
+/**
+ * @retval 0 = engine matches the reference for every length, alignment and split, 1 = mismatch
+ */
+static uint8_t Check_Engine(const crc_engine_entry_t *engine)
+{
+	uint16_t reference, crc;
+
+	for(uint32_t offset=0; offset<CRC_ALIGNMENTS; offset++)
+	{
+		for(uint32_t len=0; len<=CRC_MAX_LENGTH; len++)
+		{
+			reference = Reference_CRC16(MBR_CRC16_INIT, buf+offset, len);
+
+			if(engine->update(MBR_CRC16_INIT, buf+offset, len) != reference)
+			{
+				printf("%s: length %u, offset %u differs\n", engine->name, len, offset);
+				return 1;
+			}
+
+			for(uint32_t split=1; split<len; split += (len < 32 ? 1 : 7))
+			{
+				crc = engine->update(MBR_CRC16_INIT, buf+offset, split);
+				crc = engine->update(crc, buf+offset+split, len-split);
+				if(crc != reference)
+				{
+					printf("%s: length %u, offset %u, split %u differs\n", engine->name, len, offset, split);
+					return 1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @retval median time of one call [ns]
+ */
+static double Measure_Engine(const crc_engine_entry_t *engine, uint32_t len)
+{
+	double runs[CRC_BENCH_RUNS], swap;
+	volatile uint16_t sink = 0;
+	uint16_t crc = MBR_CRC16_INIT;
+	uint64_t start;
+
+	for(uint32_t run=0; run<CRC_BENCH_RUNS; run++)
+	{
+		start = Get_Time_ns();
+		for(uint32_t i=0; i<CRC_BENCH_CALLS; i++)
+		{
+			crc = engine->update(crc, buf + (i & 3), len);
+		}
+		runs[run] = (double)(Get_Time_ns() - start) / CRC_BENCH_CALLS;
+		sink = crc;
+	}
+	(void)sink;
+
+	for(uint32_t i=1; i<CRC_BENCH_RUNS; i++)
+	{
+		for(uint32_t j=i; j>0 && runs[j-1] > runs[j]; j--)
+		{
+			swap = runs[j];
+			runs[j] = runs[j-1];
+			runs[j-1] = swap;
+		}
+	}
+
+	return runs[CRC_BENCH_RUNS/2];
+}
+
+static uint64_t Get_Time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
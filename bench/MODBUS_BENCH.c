@@ -0,0 +1,394 @@
+/*MODBUS_BENCH.c*/
+/*
+ * End-to-end request/response benchmark of the host build (socketpair UART, HAL emulation).
+ * Every request goes through the receiver timeout callback, Check_Frame, Process_Request and Send_Response;
+ * the per-stage processing time comes from MBR_PROFILING.
+ *	gcc -O2 -DMBR_HOST_BUILD -DMBR_PROFILING -I. MODBUS.c MODBUS_CRC.c MODBUS_HOST.c bench/MODBUS_BENCH.c -o modbus_bench
+ *	./modbus_bench								print the results
+ *	./modbus_bench --save bench/baseline.txt		store processing time per frame of every workload
+ *	./modbus_bench --check bench/baseline.txt [%]	exit code 1 when a workload is slower than baseline + tolerance (default 30 %)
+ * Processing times are compared relative to a calibration loop (bitwise CRC, no library code), so the check follows
+ * the speed of the machine (frequency scaling, shared hosts). Save the baseline again when the compiler changes.
+ */
+#ifndef MBR_PROFILING
+#error "build the benchmark with -DMBR_PROFILING"
+#endif
+
+#include "MODBUS.h"
+#include "MODBUS_CRC.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BENCH_FRAMES			5000	//requests per run
+#define BENCH_RUNS				12		//the fastest run is reported, the others absorb scheduling noise
+#define BENCH_TOLERANCE			30		//default tolerance of --check [%]
+#define BENCH_BAUDRATE			921600
+#define BENCH_FRAME_GAP			4		//receiver timeout [bit times], short gap of a point-to-point link
+#define BENCH_REGISTERS			200
+#define BENCH_FRAME_SIZE		256		//RTU frame maximum
+#define BENCH_CALIBRATION_BYTES	4096	//bytes of the calibration loop
+
+typedef struct __bench_workload_t
+{
+	const char			*name;
+	uint8_t				function;
+	uint16_t			count;					//registers
+} bench_workload_t;
+
+typedef struct __bench_result_t
+{
+	double				frames_per_second;
+	double				stage_ns[PROFILE_STAGES];	//per frame
+	double				processing_ns;			//sum of the stages per frame, compared with the baseline
+	uint32_t			p50_ns;
+	uint32_t			p99_ns;
+} bench_result_t;
+
+static const bench_workload_t workloads[] = {
+	{"fc03_x1",		0x03,	1},
+	{"fc03_x125",	0x03,	125},
+	{"fc04_x64",	0x04,	64},
+	{"fc06",		0x06,	1},
+	{"fc16_x100",	0x10,	100},
+};
+#define BENCH_WORKLOADS			(sizeof(workloads)/sizeof(workloads[0]))
+
+static UART_HandleTypeDef huart;
+static modbus_handle_t *hmodbus;
+static int peer;
+static uint16_t holding[BENCH_REGISTERS];
+static uint16_t input[BENCH_REGISTERS];
+
+/*FUNCTION PROTOTYPES*/
+static uint32_t Build_Request(const bench_workload_t *workload, uint32_t sequence, uint8_t *frame);
+static int Transact(const uint8_t *request, uint32_t len);
+static int Run_Workload(const bench_workload_t *workload, bench_result_t *result);
+static double Calibrate(void);
+static int Load_Baseline(const char *path, double *baseline, double *calibration);
+
+int main(int argc, char *argv[])
+{
+	bench_result_t result, best[BENCH_WORKLOADS];
+	double baseline[BENCH_WORKLOADS];
+	double calibration, baseline_calibration = 0, scale = 1;
+	const char *save_path = NULL, *check_path = NULL;
+	double tolerance = BENCH_TOLERANCE;
+	FILE *file = NULL;
+	int status = 0;
+
+	if(argc >= 3 && strcmp(argv[1], "--save") == 0)
+	{
+		save_path = argv[2];
+	}
+	else if(argc >= 3 && strcmp(argv[1], "--check") == 0)
+	{
+		check_path = argv[2];
+		if(argc >= 4)
+		{
+			tolerance = atof(argv[3]);
+		}
+		if(Load_Baseline(check_path, baseline, &baseline_calibration))
+		{
+			fprintf(stderr, "cannot read baseline %s\n", check_path);
+			return 2;
+		}
+	}
+	else if(argc != 1)
+	{
+		fprintf(stderr, "usage: %s [--save FILE | --check FILE [tolerance_percent]]\n", argv[0]);
+		return 2;
+	}
+
+	if(MBR_CRC16_Check_Engine())
+	{
+		fprintf(stderr, "CRC engine does not match the reference table\n");
+		return 2;
+	}
+
+	peer = HOST_UART_Open_Socketpair(&huart);
+	hmodbus = MBR_Init_Modbus(&huart);
+	if(peer < 0 || hmodbus == NULL)
+	{
+		fprintf(stderr, "cannot create the Modbus handle\n");
+		return 2;
+	}
+	fcntl(peer, F_SETFL, O_NONBLOCK);
+
+	MBR_Add_Address_Space(hmodbus, MBR_Init_Address_Space(holding_registers, 0, BENCH_REGISTERS, holding));
+	MBR_Add_Address_Space(hmodbus, MBR_Init_Address_Space(input_registers, 0, BENCH_REGISTERS, input));
+	MBR_Set_Communication_Parameters(hmodbus, 1, 6, 1);
+	MBR_Set_Baud_Rate(hmodbus, BENCH_BAUDRATE);
+	MBR_Set_Frame_Gap(hmodbus, BENCH_FRAME_GAP);
+
+	calibration = Calibrate();
+	if(check_path != NULL)
+	{
+		scale = calibration / baseline_calibration;
+		printf("calibration %.0f ns, baseline %.0f ns: baseline is scaled by %.2f\n", calibration, baseline_calibration, scale);
+	}
+
+	if(save_path != NULL)
+	{
+		file = fopen(save_path, "w");
+		if(file == NULL)
+		{
+			fprintf(stderr, "cannot write baseline %s\n", save_path);
+			return 2;
+		}
+		fprintf(file, "# workload processing_ns_per_frame (MODBUS_BENCH.c)\n");
+		fprintf(file, "calibration %.1f\n", calibration);
+	}
+
+	printf("%-10s %10s %10s %8s %8s %8s %8s %8s %8s\n", "workload", "frames/s", "proc_ns", "crc_chk", "lookup", "encode", "crc_app", "p50_ns", "p99_ns");
+
+	for(uint32_t run=0; run<BENCH_RUNS; run++)	//runs are interleaved, so a slow period of the machine does not hit all runs of one workload
+	{
+		for(uint32_t w=0; w<BENCH_WORKLOADS; w++)
+		{
+			if(Run_Workload(&workloads[w], &result))
+			{
+				fprintf(stderr, "%s: no response\n", workloads[w].name);
+				return 2;
+			}
+			if(run == 0 || result.processing_ns < best[w].processing_ns)
+			{
+				best[w] = result;
+			}
+		}
+	}
+
+	for(uint32_t w=0; w<BENCH_WORKLOADS; w++)
+	{
+		printf("%-10s %10.0f %10.1f", workloads[w].name, best[w].frames_per_second, best[w].processing_ns);
+		for(uint32_t s=0; s<PROFILE_STAGES; s++)
+		{
+			printf(" %8.1f", best[w].stage_ns[s]);
+		}
+		printf(" %8u %8u", best[w].p50_ns, best[w].p99_ns);
+
+		if(file != NULL)
+		{
+			fprintf(file, "%s %.1f\n", workloads[w].name, best[w].processing_ns);
+		}
+
+		if(check_path != NULL)
+		{
+			if(best[w].processing_ns > baseline[w] * scale * (1 + tolerance/100))
+			{
+				printf("  SLOWER than baseline %.1f", baseline[w] * scale);
+				status = 1;
+			}
+			else
+			{
+				printf("  ok (baseline %.1f)", baseline[w] * scale);
+			}
+		}
+		printf("\n");
+	}
+
+	if(file != NULL)
+	{
+		fclose(file);
+	}
+
+	MBR_Destroy_Modbus(hmodbus);
+	HOST_UART_Close(&huart);
+	close(peer);
+
+	return status;
+}
+
+/*PRIVATE FUNCTIONS*/
+static uint32_t Build_Request(const bench_workload_t *workload, uint32_t sequence, uint8_t *frame)
+{
+	uint16_t start = sequence % (BENCH_REGISTERS - workload->count + 1);
+	uint32_t len;
+	uint16_t crc;
+
+	frame[0] = 1;
+	frame[1] = workload->function;
+	frame[2] = start >> 8;
+	frame[3] = start;
+
+	switch(workload->function)
+	{
+	case 0x06:
+		frame[4] = sequence >> 8;
+		frame[5] = sequence;
+		len = 6;
+		break;
+	case 0x10:
+		frame[4] = 0;
+		frame[5] = workload->count;
+		frame[6] = workload->count * 2;
+		for(uint32_t i=0; i<workload->count; i++)
+		{
+			frame[7 + 2*i] = (sequence + i) >> 8;
+			frame[8 + 2*i] = sequence + i;
+		}
+		len = 7 + workload->count * 2;
+		break;
+	default:
+		frame[4] = 0;
+		frame[5] = workload->count;
+		len = 6;
+		break;
+	}
+
+	crc = Calculate_CRC16(frame, len);
+	frame[len++] = crc;
+	frame[len++] = crc >> 8;
+
+	return len;
+}
+
+/**
+ * @brief Sending the request and spinning on the emulated interrupts until the whole response has arrived.
+ * @retval 0 = response received, 1 = no response
+ */
+static int Transact(const uint8_t *request, uint32_t len)
+{
+	uint8_t response[BENCH_FRAME_SIZE];
+	ssize_t received = 0, n;
+	uint64_t deadline = HOST_Get_Time_ns() + 1000000000u;
+
+	if(write(peer, request, len) != (ssize_t)len)
+	{
+		return 1;
+	}
+
+	while(HOST_Get_Time_ns() < deadline)
+	{
+		HOST_UART_Poll(&huart, 0);
+		MBR_Check_For_Request(hmodbus);
+
+		n = read(peer, response + received, sizeof(response) - received);
+		if(n > 0)
+		{
+			received += n;
+		}
+		if(received >= 5 && (response[1] & 0x80 || received >= (response[1] <= 0x04 ? 5 + response[2] : 8)))
+		{
+			HOST_UART_Poll(&huart, 0);	//end of transmission
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int Run_Workload(const bench_workload_t *workload, bench_result_t *result)
+{
+	uint8_t request[BENCH_FRAME_SIZE];
+	profile_t profile;
+	uint64_t start;
+	uint32_t len;
+
+	MBR_Reset_Profile(hmodbus);
+	start = HOST_Get_Time_ns();
+
+	for(uint32_t i=0; i<BENCH_FRAMES; i++)
+	{
+		len = Build_Request(workload, i, request);
+		if(Transact(request, len))
+		{
+			return 1;
+		}
+	}
+
+	result->frames_per_second = BENCH_FRAMES * 1e9 / (HOST_Get_Time_ns() - start);
+
+	MBR_Get_Profile(hmodbus, &profile);
+	result->processing_ns = 0;
+	for(uint32_t s=0; s<PROFILE_STAGES; s++)
+	{
+		result->stage_ns[s] = (double)profile.stage_time[s] / (profile.frames ? profile.frames : 1);
+		result->processing_ns += result->stage_ns[s];
+	}
+	result->p50_ns = MBR_Get_Turnaround_Percentile(hmodbus, 50);
+	result->p99_ns = MBR_Get_Turnaround_Percentile(hmodbus, 99);
+
+	return 0;
+}
+
+/**
+ * @brief Timing a fixed CPU load independent of the library (bitwise CRC16), the fastest of several runs.
+ * @retval time of the calibration loop [ns]
+ */
+static double Calibrate(void)
+{
+	volatile uint16_t sink;
+	uint64_t start, time, best = 0;
+	uint16_t crc;
+
+	for(uint32_t run=0; run<BENCH_RUNS*3; run++)
+	{
+		start = HOST_Get_Time_ns();
+		crc = 0xFFFF;
+		for(uint32_t i=0; i<BENCH_CALIBRATION_BYTES; i++)
+		{
+			crc ^= (uint8_t)(i*31);
+			for(uint8_t bit=0; bit<8; bit++)
+			{
+				crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+			}
+		}
+		sink = crc;
+		time = HOST_Get_Time_ns() - start;
+		if(run == 0 || time < best)
+		{
+			best = time;
+		}
+	}
+	(void)sink;
+
+	return best;
+}
+
+/**
+ * @retval 0 = calibration and every workload have a baseline value, 1 = file is missing or incomplete
+ */
+static int Load_Baseline(const char *path, double *baseline, double *calibration)
+{
+	char line[128], name[64];
+	double value;
+	uint32_t found = 0;
+	FILE *file = fopen(path, "r");
+
+	if(file == NULL)
+	{
+		return 1;
+	}
+
+	for(uint32_t w=0; w<BENCH_WORKLOADS; w++)
+	{
+		baseline[w] = 0;
+	}
+	*calibration = 0;
+
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		if(line[0] == '#' || sscanf(line, "%63s %lf", name, &value) != 2)
+		{
+			continue;
+		}
+		if(strcmp(name, "calibration") == 0 && value > 0)
+		{
+			*calibration = value;
+		}
+		for(uint32_t w=0; w<BENCH_WORKLOADS; w++)
+		{
+			if(strcmp(name, workloads[w].name) == 0 && baseline[w] == 0)
+			{
+				baseline[w] = value;
+				found++;
+			}
+		}
+	}
+
+	fclose(file);
+	return found != BENCH_WORKLOADS || *calibration == 0;
+}